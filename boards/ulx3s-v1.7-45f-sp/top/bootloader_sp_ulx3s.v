@@ -7,7 +7,7 @@ module bootloader_sp_ulx3s (
   output [7:0] led,
 
   input  flash_miso,
-  output flash_mosi,
+  inout  flash_mosi,
   output flash_clk,
   output flash_csn,
  
@@ -56,8 +56,14 @@ module bootloader_sp_ulx3s (
   wire boot;
   wire S_flash_clk;
   wire S_flash_csn;
+  wire S_flash_mosi;
+  wire [3:0] S_flash_dq_oe;
 
-  tinyfpgasp_bootloader tinyfpgasp_bootloader_inst (
+  tinyfpgasp_bootloader #(
+    .SPI_DUAL(1),
+    .SPI_QUAD(0),
+    .SPI_BULK(1)
+  ) tinyfpgasp_bootloader_inst (
     .clk_48mhz(clk_48mhz),
     .reset(reset),
     .usb_p_tx(usb_p_tx),
@@ -68,12 +74,17 @@ module bootloader_sp_ulx3s (
     .led(pin_led),
     .debug_led(debug_led),
     .spi_miso(flash_miso),
-    .spi_mosi(flash_mosi),
+    .spi_mosi(S_flash_mosi),
+    .spi_dq({2'b11, flash_miso, flash_mosi}),
+    .spi_dq_oe(S_flash_dq_oe),
     .spi_sck(S_flash_clk),
     .spi_cs(S_flash_csn),
     .boot(boot)
   );
 
+  // IO0 is released when flash drives it in dual/quad output read
+  assign flash_mosi = S_flash_dq_oe[0] ? S_flash_mosi : 1'bz;
+
   assign usb_fpga_dp = reset ? 1'b0 : (usb_tx_en ? usb_p_tx : 1'bz);
   assign usb_fpga_dn = reset ? 1'b0 : (usb_tx_en ? usb_n_tx : 1'bz);
   assign usb_p_rx = usb_tx_en ? 1'b1 : usb_fpga_dp;
@@ -10,10 +10,10 @@ module bootloader_sp_ulx3s (
   output [7:0] led,
 
   input  flash_miso,
-  output flash_mosi,
+  inout  flash_mosi,
   output flash_csn,
-  output flash_wpn,
-  output flash_holdn,
+  inout  flash_wpn,
+  inout  flash_holdn,
  
   input [6:0] btn,
   output wifi_gpio0
@@ -60,8 +60,14 @@ module bootloader_sp_ulx3s (
   wire boot;
   wire S_flash_clk;
   wire S_flash_csn;
+  wire S_flash_mosi;
+  wire [3:0] S_flash_dq_oe;
 
-  tinyfpgasp_bootloader tinyfpgasp_bootloader_inst (
+  tinyfpgasp_bootloader #(
+    .SPI_DUAL(1),
+    .SPI_QUAD(1),
+    .SPI_BULK(1)
+  ) tinyfpgasp_bootloader_inst (
     .clk_48mhz(clk_48mhz),
     .reset(reset),
     .usb_p_tx(usb_p_tx),
@@ -72,12 +78,17 @@ module bootloader_sp_ulx3s (
     .led(pin_led),
     .debug_led(debug_led),
     .spi_miso(flash_miso),
-    .spi_mosi(flash_mosi),
+    .spi_mosi(S_flash_mosi),
+    .spi_dq({flash_holdn, flash_wpn, flash_miso, flash_mosi}),
+    .spi_dq_oe(S_flash_dq_oe),
     .spi_sck(S_flash_clk),
     .spi_cs(S_flash_csn),
     .boot(boot)
   );
 
+  // IO0 is released when flash drives it in dual/quad output read
+  assign flash_mosi = S_flash_dq_oe[0] ? S_flash_mosi : 1'bz;
+
   assign usb_fpga_dp = reset ? 1'b0 : (usb_tx_en ? usb_p_tx : 1'bz);
   assign usb_fpga_dn = reset ? 1'b0 : (usb_tx_en ? usb_n_tx : 1'bz);
   assign usb_p_rx = usb_tx_en ? 1'b1 : usb_fpga_dp;
@@ -130,9 +141,10 @@ module bootloader_sp_ulx3s (
   // PULLUP 1.5k D+
   assign usb_fpga_pu_dp = 1;
 
-  // set 1 to holdn wpn for use as single bit mode spi
-  assign flash_holdn = 1;
-  assign flash_wpn = 1;
+  // holdn wpn are 1 for single bit mode spi,
+  // released when flash drives them in quad output read
+  assign flash_holdn = S_flash_dq_oe[3] ? 1'b1 : 1'bz;
+  assign flash_wpn = S_flash_dq_oe[2] ? 1'b1 : 1'bz;
 
   // delay for BTN0 is required
   reg [3:0] R_progn = 0;
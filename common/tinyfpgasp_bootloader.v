@@ -1,4 +1,9 @@
-module tinyfpgasp_bootloader (
+module tinyfpgasp_bootloader #(
+  parameter SPI_DUAL = 0, // IO0 (MOSI) pin can be turned to input
+  parameter SPI_QUAD = 0, // IO2 (WP#) and IO3 (HOLD#) pins are routed
+  parameter SPI_BULK = 0, // EP1 bulk OUT/IN with framed SPI commands (usb_spi_bridge_ep)
+  parameter SPI_DIV = 0 // control endpoint SPI clock 24 MHz/(SPI_DIV+1) until the host sets it
+) (
   input  clk_48mhz,
   input  reset,
 
@@ -21,6 +26,9 @@ module tinyfpgasp_bootloader (
   output spi_sck,
   output spi_mosi,
   input  spi_miso,
+  // optional dual/quad output read, IO pins with output enable
+  input  [3:0] spi_dq,
+  output [3:0] spi_dq_oe,
 
   // when asserted it indicates the bootloader is ready for the FPGA to load
   // the user config.  different FPGAs use different primitives for this
@@ -137,7 +145,26 @@ module tinyfpgasp_bootloader (
   wire boot_to_user_design;
 
   assign boot = host_presence_timeout || boot_to_user_design;
-  usb_sp_ctrl_ep ctrl_ep_inst (
+
+  // both endpoints can drive SPI, host never uses them at the same time.
+  // bridge owns the bus while its chip select is active.
+  wire ctrl_spi_cs;
+  wire ctrl_spi_sck;
+  wire ctrl_spi_mosi;
+  wire bulk_spi_cs;
+  wire bulk_spi_sck;
+  wire bulk_spi_mosi;
+
+  assign spi_cs = ctrl_spi_cs && bulk_spi_cs;
+  assign spi_sck = bulk_spi_cs ? ctrl_spi_sck : bulk_spi_sck;
+  assign spi_mosi = bulk_spi_cs ? ctrl_spi_mosi : bulk_spi_mosi;
+
+  usb_sp_ctrl_ep #(
+    .SPI_DUAL(SPI_DUAL),
+    .SPI_QUAD(SPI_QUAD),
+    .SPI_BULK(SPI_BULK),
+    .SPI_DIV(SPI_DIV)
+  ) ctrl_ep_inst (
     .clk(clk_48mhz),
     .reset(reset),
     .dev_addr(dev_addr),
@@ -146,10 +173,12 @@ module tinyfpgasp_bootloader (
     .debug_led(debug_led),
     
     // SPI chip interface
-    .spi_csn(spi_cs),
-    .spi_clk(spi_sck),
-    .spi_mosi(spi_mosi),
+    .spi_csn(ctrl_spi_cs),
+    .spi_clk(ctrl_spi_sck),
+    .spi_mosi(ctrl_spi_mosi),
     .spi_miso(spi_miso),
+    .spi_dq(spi_dq),
+    .spi_dq_oe(spi_dq_oe),
 
     // out endpoint interface 
     .out_ep_req(ctrl_out_ep_req),
@@ -172,9 +201,88 @@ module tinyfpgasp_bootloader (
     .in_ep_acked(ctrl_in_ep_acked)
   );
 
+  generate
+    if (SPI_BULK) begin
+      usb_spi_bridge_ep usb_spi_bridge_ep_inst (
+        .clk(clk_48mhz),
+        .reset(reset),
+
+        // out endpoint interface 
+        .out_ep_req(serial_out_ep_req),
+        .out_ep_grant(serial_out_ep_grant),
+        .out_ep_data_avail(serial_out_ep_data_avail),
+        .out_ep_setup(serial_out_ep_setup),
+        .out_ep_data_get(serial_out_ep_data_get),
+        .out_ep_data(out_ep_data),
+        .out_ep_stall(serial_out_ep_stall),
+        .out_ep_acked(serial_out_ep_acked),
+
+        // in endpoint interface 
+        .in_ep_req(serial_in_ep_req),
+        .in_ep_grant(serial_in_ep_grant),
+        .in_ep_data_free(serial_in_ep_data_free),
+        .in_ep_data_put(serial_in_ep_data_put),
+        .in_ep_data(serial_in_ep_data),
+        .in_ep_data_done(serial_in_ep_data_done),
+        .in_ep_stall(serial_in_ep_stall),
+        .in_ep_acked(serial_in_ep_acked),
+
+        // spi interface 
+        .spi_cs_b(bulk_spi_cs),
+        .spi_sck(bulk_spi_sck),
+        .spi_mosi(bulk_spi_mosi),
+        .spi_miso(spi_miso),
+
+        // warm boot interface
+        .boot_to_user_design(boot_to_user_design)
+      );
+    end else begin
+      assign bulk_spi_cs = 1'b1;
+      assign bulk_spi_sck = 1'b1;
+      assign bulk_spi_mosi = 1'b0;
+      assign boot_to_user_design = 1'b0;
+    end
+  endgenerate
+
+  // EP1 is connected to the protocol engine only with SPI_BULK
+  localparam NUM_EPS = SPI_BULK ? 2 : 1;
+  wire [1:0] pe_out_ep_grant;
+  wire [1:0] pe_out_ep_data_avail;
+  wire [1:0] pe_out_ep_setup;
+  wire [1:0] pe_out_ep_acked;
+  wire [1:0] pe_in_ep_grant;
+  wire [1:0] pe_in_ep_data_free;
+  wire [1:0] pe_in_ep_acked;
+  wire [1:0] pe_out_ep_req = {serial_out_ep_req, ctrl_out_ep_req};
+  wire [1:0] pe_out_ep_data_get = {serial_out_ep_data_get, ctrl_out_ep_data_get};
+  wire [1:0] pe_out_ep_stall = {serial_out_ep_stall, ctrl_out_ep_stall};
+  wire [1:0] pe_in_ep_req = {serial_in_ep_req, ctrl_in_ep_req};
+  wire [1:0] pe_in_ep_data_put = {serial_in_ep_data_put, ctrl_in_ep_data_put};
+  wire [15:0] pe_in_ep_data = {serial_in_ep_data[7:0], ctrl_in_ep_data[7:0]};
+  wire [1:0] pe_in_ep_data_done = {serial_in_ep_data_done, ctrl_in_ep_data_done};
+  wire [1:0] pe_in_ep_stall = {serial_in_ep_stall, ctrl_in_ep_stall};
+  assign {serial_out_ep_grant, ctrl_out_ep_grant} = pe_out_ep_grant;
+  assign {serial_out_ep_data_avail, ctrl_out_ep_data_avail} = pe_out_ep_data_avail;
+  assign {serial_out_ep_setup, ctrl_out_ep_setup} = pe_out_ep_setup;
+  assign {serial_out_ep_acked, ctrl_out_ep_acked} = pe_out_ep_acked;
+  assign {serial_in_ep_grant, ctrl_in_ep_grant} = pe_in_ep_grant;
+  assign {serial_in_ep_data_free, ctrl_in_ep_data_free} = pe_in_ep_data_free;
+  assign {serial_in_ep_acked, ctrl_in_ep_acked} = pe_in_ep_acked;
+  generate
+    if (!SPI_BULK) begin
+      assign pe_out_ep_grant[1] = 1'b0;
+      assign pe_out_ep_data_avail[1] = 1'b0;
+      assign pe_out_ep_setup[1] = 1'b0;
+      assign pe_out_ep_acked[1] = 1'b0;
+      assign pe_in_ep_grant[1] = 1'b0;
+      assign pe_in_ep_data_free[1] = 1'b0;
+      assign pe_in_ep_acked[1] = 1'b0;
+    end
+  endgenerate
+
   usb_fs_pe #(
-    .NUM_OUT_EPS(5'd1),
-    .NUM_IN_EPS(5'd1)
+    .NUM_OUT_EPS(NUM_EPS),
+    .NUM_IN_EPS(NUM_EPS)
   ) usb_fs_pe_inst (
     .clk(clk_48mhz),
     .reset(reset),
@@ -188,24 +296,24 @@ module tinyfpgasp_bootloader (
     .dev_addr(dev_addr),
 
     // out endpoint interfaces 
-    .out_ep_req({ctrl_out_ep_req}),
-    .out_ep_grant({ctrl_out_ep_grant}),
-    .out_ep_data_avail({ctrl_out_ep_data_avail}),
-    .out_ep_setup({ctrl_out_ep_setup}),
-    .out_ep_data_get({ctrl_out_ep_data_get}),
+    .out_ep_req(pe_out_ep_req[NUM_EPS-1:0]),
+    .out_ep_grant(pe_out_ep_grant[NUM_EPS-1:0]),
+    .out_ep_data_avail(pe_out_ep_data_avail[NUM_EPS-1:0]),
+    .out_ep_setup(pe_out_ep_setup[NUM_EPS-1:0]),
+    .out_ep_data_get(pe_out_ep_data_get[NUM_EPS-1:0]),
     .out_ep_data(out_ep_data),
-    .out_ep_stall({ctrl_out_ep_stall}),
-    .out_ep_acked({ctrl_out_ep_acked}),
+    .out_ep_stall(pe_out_ep_stall[NUM_EPS-1:0]),
+    .out_ep_acked(pe_out_ep_acked[NUM_EPS-1:0]),
 
     // in endpoint interfaces 
-    .in_ep_req({ctrl_in_ep_req}),
-    .in_ep_grant({ctrl_in_ep_grant}),
-    .in_ep_data_free({ctrl_in_ep_data_free}),
-    .in_ep_data_put({ctrl_in_ep_data_put}),
-    .in_ep_data({ctrl_in_ep_data[7:0]}),
-    .in_ep_data_done({ctrl_in_ep_data_done}),
-    .in_ep_stall({ctrl_in_ep_stall}),
-    .in_ep_acked({ctrl_in_ep_acked}),
+    .in_ep_req(pe_in_ep_req[NUM_EPS-1:0]),
+    .in_ep_grant(pe_in_ep_grant[NUM_EPS-1:0]),
+    .in_ep_data_free(pe_in_ep_data_free[NUM_EPS-1:0]),
+    .in_ep_data_put(pe_in_ep_data_put[NUM_EPS-1:0]),
+    .in_ep_data(pe_in_ep_data[NUM_EPS*8-1:0]),
+    .in_ep_data_done(pe_in_ep_data_done[NUM_EPS-1:0]),
+    .in_ep_stall(pe_in_ep_stall[NUM_EPS-1:0]),
+    .in_ep_acked(pe_in_ep_acked[NUM_EPS-1:0]),
 
     // sof interface
     .sof_valid(sof_valid),
@@ -1,4 +1,9 @@
-module usb_sp_ctrl_ep (
+module usb_sp_ctrl_ep #(
+  parameter SPI_DUAL = 0, // board can turn IO0 (MOSI) to input
+  parameter SPI_QUAD = 0, // board routes IO2 (WP#) and IO3 (HOLD#)
+  parameter SPI_BULK = 0, // configuration descriptor lists EP1 bulk OUT/IN of usb_spi_bridge_ep
+  parameter SPI_DIV = 0 // SPI clock divider after reset, clk/2/(SPI_DIV+1), host may change it
+) (
   input clk,
   input reset,
   output [6:0] dev_addr,
@@ -12,6 +17,8 @@ module usb_sp_ctrl_ep (
   output spi_mosi,
   output reg spi_clk = 1,
   output reg spi_csn = 1,
+  input [3:0] spi_dq, // IO3-IO0 pins as input for dual/quad output read
+  output [3:0] spi_dq_oe, // 1:drive IO pin, IO0 from spi_mosi, IO2 and IO3 high
 
   ////////////////////
   // out endpoint interface 
@@ -56,27 +63,176 @@ module usb_sp_ctrl_ep (
   reg data_stage_end = 0;
   reg status_stage_end = 0;
   reg send_zero_length_data_pkt = 0;
+  reg out_data_received = 0; // all packets of OUT data stage received
 
 
   /////////////////////////
   /// SPI BUFFERING
   /////////////////////////
-  reg [7:0] out_buf [0:63]; // PC out transfer should be received here (64 byte max)
+  reg [7:0] out_buf [0:63]; // PC out transfer is received here, ring buffer streamed to SPI
   reg [7:0] in_buf [0:31]; // PC in transfer when PC reads back buffered SPI response (32 byte max)
   reg [5:0] out_buf_addr_usb = 0; // 0-63 address for the buffer for USB acceptor
   reg [5:0] out_buf_addr_spi = 0; // 0-63 address for the buffer for SPI sender
-  reg [5:0] spi_length = 0; // 0-32 number of bytes to be sent by OUT
-  reg [5:0] spi_bytes_sent = 0; // 0-32 bit current number of bytes sent by OUT
+  // OUT data stage can span many packets, USB is held off while out_buf is full
+  wire [5:0] out_buf_level = out_buf_addr_usb - out_buf_addr_spi;
+  wire out_buf_full = out_buf_level >= 60; // margin for bytes in flight
+  reg out_spi = 0; // OUT data stage goes to SPI, other data stages are discarded
+  reg out_spi_wait = 0; // OUT data stage is NAKed until SPI and page engine are free
+  reg [12:0] out_bytes_received = 0; // 0-4096 bytes of OUT data stage received
+  reg [12:0] spi_length = 0; // 0-4096 number of bytes to be sent by OUT
+  reg [12:0] spi_bytes_sent = 0; // 0-4096 current number of bytes sent by OUT
   reg [3:0] spi_bit_counter = 10; // 0-15
   reg send_in_buf = 0;
+  reg send_status = 0; // IN sends status registers instead of ROM or buffer
+  reg [1:0] spi_width = 0; // 0:x1 1:x2 2:x4 bits per clock after header bytes
+  reg [3:0] spi_header = 0; // single bit bytes (command, address) remaining at start of OUT packet
   reg spi_continue = 0; // 0:normal packet (reset start, closed end) 1:packet continued (open start, open end)
 
-  reg [25:0] superslow; // so slow that LEDs are visible
+  /////////////////////////
+  /// RLE DECODER
+  /////////////////////////
+  // compressed SPI OUT: out_buf holds tokens, each followed by
+  // run length literal bytes (token[7]=0) or one byte sent run length
+  // times (token[7]=1), run length is token[6:0]+1
+  reg rle_mode = 0; // out_buf is RLE coded
+  reg [7:0] rle_count = 0; // 0: next out_buf byte is a token
+  reg rle_repeat = 0; // current run repeats one byte
+
+  /////////////////////////
+  /// FLASH SCAN
+  /////////////////////////
+  // gateware itself reads a flash range (command 0x03) and returns only
+  // CRC32 of the data or the first address which is not 0xFF
+  reg scan_active = 0; // SPI is driven by the scanner, not by out_buf
+  reg scan_blank = 0; // 0:CRC32 1:blank check
+  reg [2:0] scan_header = 0; // 4-0 command and address bytes still to be sent
+  reg [23:0] scan_start = 0; // address sent with read command
+  reg [23:0] scan_addr = 0; // address of next data byte
+  reg [24:0] scan_count = 0; // data bytes remaining
+  reg [31:0] scan_crc = 0;
+  reg [31:0] scan_result = 0; // CRC32 or first non-0xFF address (32'hFFFFFFFF: all blank)
+  reg [7:0] scan_opcode = 8'h03; // read command, 0x0B, 0x3B, 0x6B need dummy bytes
+  reg [1:0] scan_width = 0; // 0:x1 1:x2 2:x4 bits per clock of data bytes
+  reg [2:0] scan_dummy = 0; // dummy bytes remaining after address
+
+  /////////////////////////
+  /// FLASH STREAM
+  /////////////////////////
+  // scanner can also pass the data to the PC in a multi-packet IN data stage,
+  // SPI clock stops while the ring buffer is full
+  reg scan_stream = 0; // scanned bytes go to stream_buf
+  reg [7:0] stream_buf [0:63];
+  reg [6:0] stream_addr_spi = 0; // bit 6 tells full from empty
+  reg [6:0] stream_addr_usb = 0;
+  wire stream_empty = stream_addr_spi == stream_addr_usb;
+  wire [6:0] stream_level = stream_addr_spi - stream_addr_usb;
+  wire scan_hold = scan_stream && stream_level >= 63; // room for the byte in flight
+  reg send_stream = 0; // IN sends stream_buf
+
+  // checked stream ends the data stage with CRC32 of the data bytes
+  // and can leave chip select low, so the next request continues the
+  // same read without command and address
+  reg stream_check = 0; // last 4 bytes of the data stage are CRC32
+  reg scan_open = 0; // chip select held low by a checked stream
+  reg [1:0] scan_restart = 0; // cycles to release chip select before a new command
+  wire stream_crc_phase = stream_check && bytes_sent >= rom_length - 13'd4;
+  wire [1:0] stream_crc_byte = bytes_sent[1:0] - rom_length[1:0]; // 0-3 LSB first
+  wire [31:0] stream_crc = ~scan_crc;
+
+  // CRC32 (zlib, reflected polynomial 0xEDB88320) of one byte
+  function [31:0] crc32_byte;
+    input [31:0] crc;
+    input [7:0] data;
+    integer i;
+    begin
+      crc32_byte = crc ^ data;
+      for (i = 0; i < 8; i = i + 1)
+        crc32_byte = crc32_byte[0] ? (crc32_byte >> 1) ^ 32'hEDB88320 : crc32_byte >> 1;
+    end
+  endfunction
+
+  /////////////////////////
+  /// PAGE PROGRAM ENGINE
+  /////////////////////////
+  // USB fills one of two page buffers while gateware programs the other:
+  // write enable (0x06), page program (0x02) and status polling (0x05)
+  // until WIP clears, the PC only asks for busy/error once per sector.
+  // A data stage with wIndex[14] set carries sequence number wIndex[13:8],
+  // it is accepted only if it is the next one, so the PC can retransmit
+  // pages from the number returned by IN after a failed transfer.
+  reg [7:0] page_buf [0:511]; // buffer 0: 0-255, buffer 1: 256-511
+  reg [1:0] page_full = 0; // buffer waits for or is in page program
+  reg [23:0] page_addr [0:1]; // flash address of buffer
+  reg [8:0] page_length [0:1]; // 1-256 bytes in buffer
+  reg [23:0] page_fill_addr = 0; // from setup, buffer may still be in page program
+  reg page_mode = 0; // OUT data stage goes to page_buf, not out_buf
+  reg page_fill = 0; // buffer filled by USB
+  reg [8:0] page_usb = 0; // bytes in the buffer being filled
+  reg page_rle = 0; // OUT data stage is RLE coded like bRequest 7
+  reg [7:0] page_rle_count = 0; // 0: next byte is a token
+  reg page_rle_repeat = 0;
+  reg [7:0] page_rle_byte = 0;
+  reg page_expand = 0; // repeated byte written one per cycle, USB waits
+  reg prog_active = 0; // SPI is driven by the page program engine
+  reg page_prog = 0; // buffer being programmed
+  reg [1:0] prog_phase = 0; // 0:write enable 1:page program 2:status polling
+  reg [8:0] prog_count = 0; // bytes of current phase done
+  reg prog_error = 0; // page program did not start, write protected
+  reg [2:0] prog_status = 0; // IN of bRequest 8: 1:busy 2:error 4:sequence gap
+  reg [5:0] page_seq = 0; // sequence number of the next accepted page
+  reg page_skip = 0; // data stage is a duplicate or out of order, dropped
+  reg seq_error = 0; // a data stage with a later sequence number was dropped
+  wire prog_data_phase = prog_active && prog_phase == 1 && prog_count >= 4;
+  wire [8:0] prog_data_addr = {page_prog, prog_count[7:0] - 8'd4};
+
+  reg [7:0] scan_tx_byte; // read command, address, then dummy bytes
+  always @(*) begin
+    if (prog_active)
+      case (prog_phase)
+        0: scan_tx_byte = 8'h06;
+        1: case (prog_count[1:0]) // data bytes come from page_buf
+             0: scan_tx_byte = 8'h02;
+             1: scan_tx_byte = page_addr[page_prog][23:16];
+             2: scan_tx_byte = page_addr[page_prog][15:8];
+             default: scan_tx_byte = page_addr[page_prog][7:0];
+           endcase
+        default: scan_tx_byte = 8'h05; // flash ignores input while it sends status
+      endcase
+    else
+      case (scan_header)
+        4: scan_tx_byte = scan_opcode;
+        3: scan_tx_byte = scan_start[23:16];
+        2: scan_tx_byte = scan_start[15:8];
+        1: scan_tx_byte = scan_start[7:0];
+        default: scan_tx_byte = 8'hFF;
+      endcase
+  end
+
+  // SPI clock is clk/2/(spi_div+1). MISO is sampled at the rising edge
+  // or spi_sample_delay cycles later, for boards with long traces.
+  reg [7:0] spi_div = SPI_DIV;
+  reg [7:0] spi_sample_delay = 0; // 0-spi_div
+  reg [7:0] spi_div_count = 0; // cycles until the next SPI clock edge
+  wire spi_edge = spi_div_count == 0;
+  wire spi_sample = spi_sample_delay == 0 ? spi_clk == 0 && spi_edge :
+    spi_clk == 1 && spi_div_count == spi_div + 8'd1 - spi_sample_delay;
   
   // help with assembling the SPI byte
   reg [7:0] spi_miso_byte; // host input, device output
   wire [7:0] spi_miso_byte_next;
-  assign spi_miso_byte_next = {spi_miso_byte[6:0], spi_miso}; // input with shifting, MSB enters shift-register first
+  // single bit bytes first, then dual or quad output read from the flash
+  wire [1:0] spi_data_width = scan_active || scan_open ? scan_width : spi_width;
+  wire spi_wide = spi_data_width != 0 && (scan_active || scan_open ? scan_header == 0 : spi_header == 0);
+  wire [2:0] spi_step = !spi_wide ? 1 : spi_data_width == 1 ? 2 : 4; // bits per clock
+  wire spi_byte_last = (spi_bit_counter[2:0] | (spi_step - 3'd1)) == 7; // last clock of a byte
+  assign spi_miso_byte_next = // input with shifting, MSB enters shift-register first
+    !spi_wide ? {spi_miso_byte[6:0], spi_miso} :
+    spi_data_width == 1 ? {spi_miso_byte[5:0], spi_miso, spi_dq[0]} :
+    {spi_miso_byte[3:0], spi_dq[3:2], spi_miso, spi_dq[0]};
+  // flash drives IO0 in wide mode, IO2 and IO3 in quad mode
+  assign spi_dq_oe[0] = !(spi_wide && !spi_csn);
+  assign spi_dq_oe[1] = 1'b0;
+  assign spi_dq_oe[3:2] = spi_wide && !spi_csn && spi_data_width == 2 ? 2'b00 : 2'b11;
   reg [7:0] spi_mosi_byte; // host output, device input
   wire [7:0] spi_mosi_byte_next;
   assign spi_mosi_byte_next = {spi_mosi_byte[6:0], 1'b0}; // input with shifting, MSB enters shift-register first
@@ -89,9 +245,13 @@ module usb_sp_ctrl_ep (
   assign dev_addr = dev_addr_i;
 
   assign out_ep_req = out_ep_data_avail;
-  assign out_ep_data_get = out_ep_data_avail;
   reg out_ep_data_valid = 0;
-  always @(posedge clk) out_ep_data_valid <= out_ep_data_avail && out_ep_grant;
+  wire page_rx = page_mode && ctrl_xfr_state == DATA_OUT && out_ep_data_valid && !out_ep_setup;
+  wire page_rx_repeat = page_rx && page_rle && page_rle_count != 0 && page_rle_repeat;
+  wire page_rx_literal = page_rx && !(page_rle && (page_rle_count == 0 || page_rle_repeat));
+  wire page_ready = !page_full[page_fill] && !page_expand && !page_rx_repeat; // no byte in flight during expand
+  assign out_ep_data_get = out_ep_data_avail && (out_ep_setup || (page_mode ? page_ready || page_skip : !out_buf_full && !out_spi_wait));
+  always @(posedge clk) out_ep_data_valid <= out_ep_data_get && out_ep_grant;
 
   // need to record the setup data
   reg [3:0] setup_data_addr = 0;
@@ -102,6 +262,7 @@ module usb_sp_ctrl_ep (
   wire [15:0] wValue = {raw_setup_data[3][7:0], raw_setup_data[2][7:0]};
   wire [15:0] wIndex = {raw_setup_data[5][7:0], raw_setup_data[4][7:0]};
   wire [15:0] wLength = {raw_setup_data[7][7:0], raw_setup_data[6][7:0]};
+  wire page_seq_drop = wIndex[14] && wIndex[13:8] != page_seq;
 
   // keep track of new out data start and end
   wire pkt_start;
@@ -119,6 +280,10 @@ module usb_sp_ctrl_ep (
     .out(pkt_end)
   );
 
+  // last setup byte (wLength[15:8]) is stored one cycle after pkt_end
+  reg setup_pkt_end = 0;
+  always @(posedge clk) setup_pkt_end <= pkt_end;
+
   assign out_ep_stall = 1'b0;
 
   wire setup_pkt_start = pkt_start && out_ep_setup;
@@ -131,8 +296,8 @@ module usb_sp_ctrl_ep (
   wire in_data_stage;
   assign in_data_stage = has_data_stage && bmRequestType[7];
 
-  reg [7:0] bytes_sent = 0;
-  reg [6:0] rom_length = 0;
+  reg [12:0] bytes_sent = 0;
+  reg [12:0] rom_length = 0;
 
   wire all_data_sent = 
     (bytes_sent >= rom_length) ||
@@ -151,8 +316,11 @@ module usb_sp_ctrl_ep (
 
   assign in_ep_data_done = (in_data_transfer_done && ctrl_xfr_state == DATA_IN) || send_zero_length_data_pkt;
 
-  assign in_ep_req = ctrl_xfr_state == DATA_IN && more_data_to_send;
-  assign in_ep_data_put = ctrl_xfr_state == DATA_IN && more_data_to_send && in_ep_data_free;
+  // stream waits for SPI, the PC gets NAK meanwhile
+  wire in_data_ready = !send_stream || !stream_empty || stream_crc_phase;
+
+  assign in_ep_req = ctrl_xfr_state == DATA_IN && more_data_to_send && in_data_ready;
+  assign in_ep_data_put = ctrl_xfr_state == DATA_IN && more_data_to_send && in_data_ready && in_ep_data_free;
 
 
   reg [6:0] rom_addr = 0;
@@ -173,6 +341,7 @@ module usb_sp_ctrl_ep (
 
     case (ctrl_xfr_state)
       IDLE : begin
+        out_data_received <= 0;
         if (setup_pkt_start) begin
           ctrl_xfr_state_next <= SETUP;
         end else begin
@@ -181,7 +350,7 @@ module usb_sp_ctrl_ep (
       end
 
       SETUP : begin
-        if (pkt_end) begin
+        if (setup_pkt_end) begin
           setup_stage_end <= 1;
 
           if (in_data_stage) begin
@@ -217,7 +386,13 @@ module usb_sp_ctrl_ep (
 
       DATA_OUT : begin
         // if (out_ep_acked) begin
-        if (pkt_end) begin
+        // data stage can have many packets, last byte may still be in flight
+        if (pkt_end && out_bytes_received + out_ep_data_valid >= wLength)
+          out_data_received <= 1;
+        // status stage is NAKed until SPI has sent all the data,
+        // so the next request finds SPI free
+        if (out_data_received && out_buf_addr_usb == out_buf_addr_spi && !page_expand) begin
+          out_data_received <= 0;
           ctrl_xfr_state_next <= STATUS_IN;
           send_zero_length_data_pkt <= 1;
           data_stage_end <= 1;
@@ -270,6 +445,13 @@ module usb_sp_ctrl_ep (
     end
 
     if (setup_stage_end) begin
+    send_status <= 0;
+    send_stream <= 0;
+    stream_check <= 0;
+    page_mode <= 0;
+    out_spi <= 0;
+    out_spi_wait <= 0;
+    out_bytes_received <= 0;
     case (bmRequestType[6:5]) // 2 bits describing request type
       0: begin // 0: standard request
       send_in_buf <= 0; // not vendor-specific
@@ -286,7 +468,7 @@ module usb_sp_ctrl_ep (
             2 : begin
               // CONFIGURATION
               rom_addr    <= 18; 
-              rom_length  <= 18;
+              rom_length  <= SPI_BULK ? 32 : 18;
             end 
 
             6 : begin
@@ -323,7 +505,8 @@ module usb_sp_ctrl_ep (
       2: begin // 2: vendor specific request
         case (bRequest)
           0: begin // write or read SPI data block
-            spi_continue <= wValue[0];
+            if (!out_data_stage)
+              spi_continue <= wValue[0];
             if (in_data_stage)
             begin
               send_in_buf <= 1; // this is vendor-specific request, send data from RAM buffer, not descriptor ROM
@@ -332,15 +515,9 @@ module usb_sp_ctrl_ep (
               bytes_sent <= 0;
             end
             if (out_data_stage)
-            begin
-              if (spi_bytes_sent != spi_length)
-                debug_led <= debug_led + 1; // indicate overrun, new packet arrived before SPI finished
-              else
-              begin
-                send_in_buf <= 0;
-                spi_length <= wLength;
-                spi_bytes_sent <= 0;
-              end
+            begin // started when SPI is free, see out_spi_wait
+              out_spi <= 1;
+              out_spi_wait <= 1;
             end
           end // end bRequest 0
           
@@ -350,7 +527,7 @@ module usb_sp_ctrl_ep (
             if (in_data_stage)
             begin
               send_in_buf <= 0;
-              if (spi_bytes_sent == spi_length)
+              if (spi_bytes_sent == spi_length && !scan_active && page_full == 0)
                 rom_addr <= 5; // must point to 0 in ROM descriptor
               else
                 rom_addr <= 1; // must point to 1 in ROM descriptor
@@ -359,7 +536,197 @@ module usb_sp_ctrl_ep (
             end
           end
 
-          default begin // catch all other bRequest != 0
+          2, 3: begin // flash scan 2:CRC32 3:blank check
+            // OUT without data stage starts reading flash,
+            // wValue: start address in 256-byte pages, wIndex: length in pages.
+            // IN returns 5 bytes: busy (0:done 1:busy), 32-bit result LSB first
+            if (in_data_stage)
+            begin
+              send_in_buf <= 0;
+              send_status <= 1;
+              rom_addr <= 0;
+              rom_length <= 5;
+              bytes_sent <= 0;
+            end
+            else
+            begin
+              if (spi_bytes_sent != spi_length || scan_active)
+                debug_led <= debug_led + 1; // indicate overrun, SPI is not free
+              else
+              begin
+                spi_continue <= 0; // release chip select when done
+                scan_open <= 0;
+                scan_active <= wIndex != 0;
+                scan_stream <= 0;
+                scan_blank <= bRequest[0];
+                scan_header <= 4;
+                scan_opcode <= 8'h03;
+                scan_width <= 0;
+                scan_dummy <= 0;
+                scan_start <= {wValue, 8'h00};
+                scan_addr <= {wValue, 8'h00};
+                scan_count <= {wIndex, 8'h00};
+                scan_crc <= 32'hFFFFFFFF;
+                scan_result <= bRequest[0] ? 32'hFFFFFFFF : 32'h00000000; // empty range
+              end
+            end
+          end
+
+          4: begin // capabilities IN request, 1 byte
+            // bit 0: x1 with header (fast read), 1: dual output, 2: quad output, 3: checked stream,
+            // 4: compressed SPI OUT, 5: page program engine, 6: page sequence numbers, 7: SPI clock
+            if (in_data_stage)
+            begin
+              send_in_buf <= 0;
+              send_status <= 1;
+              rom_addr <= 5;
+              rom_length <= 1;
+              bytes_sent <= 0;
+            end
+          end
+
+          5: begin // stream flash read IN request, up to 4096 bytes
+            // gateware sends read command, address and dummy bytes
+            // wValue: address[15:0], wIndex[7:0]: address[23:16],
+            // wIndex[15:8]: read command 0x03, 0x0B (fast), 0x3B (dual), 0x6B (quad)
+            if (in_data_stage)
+            begin
+              send_in_buf <= 0;
+              send_stream <= 1;
+              rom_length <= wLength;
+              bytes_sent <= 0;
+              stream_addr_spi <= 0;
+              stream_addr_usb <= 0;
+              if (spi_bytes_sent != spi_length || scan_active)
+                debug_led <= debug_led + 1; // indicate overrun, SPI is not free
+              else
+              begin
+                spi_continue <= 0; // release chip select when done
+                scan_open <= 0;
+                scan_active <= 1;
+                scan_stream <= 1;
+                scan_blank <= 0;
+                scan_header <= 4;
+                scan_opcode <= wIndex[15:8];
+                case (wIndex[15:8])
+                  8'h0B: begin scan_width <= 0; scan_dummy <= 1; end
+                  8'h3B: begin scan_width <= SPI_DUAL || SPI_QUAD ? 1 : 0; scan_dummy <= 2; end
+                  8'h6B: begin scan_width <= SPI_QUAD ? 2 : 0; scan_dummy <= 4; end
+                  default: begin scan_width <= 0; scan_dummy <= 0; end
+                endcase
+                scan_start <= {wIndex[7:0], wValue};
+                scan_addr <= {wIndex[7:0], wValue};
+                scan_count <= wLength;
+              end
+            end
+          end
+
+          6: begin // checked stream flash read IN request, up to 4096 bytes
+            // data stage is wLength-4 flash bytes and their CRC32, LSB first.
+            // wIndex[15:8] != 0 starts a read like 5, chip select stays low.
+            // wIndex[15:8] == 0 continues the open read without command,
+            // wValue[0] 1:keep chip select low 0:release it after the data
+            if (in_data_stage)
+            begin
+              send_in_buf <= 0;
+              send_stream <= 1;
+              stream_check <= 1;
+              rom_length <= wLength;
+              bytes_sent <= 0;
+              stream_addr_spi <= 0;
+              stream_addr_usb <= 0;
+              if (spi_bytes_sent != spi_length || scan_active)
+                debug_led <= debug_led + 1; // indicate overrun, SPI is not free
+              else
+              begin
+                spi_continue <= wIndex[15:8] != 0 || wValue[0];
+                scan_open <= wIndex[15:8] != 0 || wValue[0];
+                scan_active <= wLength > 4;
+                scan_stream <= 1;
+                scan_blank <= 0;
+                scan_crc <= 32'hFFFFFFFF;
+                scan_count <= wLength - 4;
+                if (wIndex[15:8] != 0)
+                begin
+                  scan_restart <= scan_open ? 1 : 0;
+                  scan_header <= 4;
+                  scan_opcode <= wIndex[15:8];
+                  case (wIndex[15:8])
+                    8'h0B: begin scan_width <= 0; scan_dummy <= 1; end
+                    8'h3B: begin scan_width <= SPI_DUAL || SPI_QUAD ? 1 : 0; scan_dummy <= 2; end
+                    8'h6B: begin scan_width <= SPI_QUAD ? 2 : 0; scan_dummy <= 4; end
+                    default: begin scan_width <= 0; scan_dummy <= 0; end
+                  endcase
+                  scan_start <= {wIndex[7:0], wValue};
+                  scan_addr <= {wIndex[7:0], wValue};
+                end
+                else
+                begin
+                  scan_header <= 0; // width and address continue from the open read
+                  scan_dummy <= 0;
+                end
+              end
+            end
+          end
+
+          7: begin // compressed SPI OUT, data stage is RLE coded
+            // wValue[0]: continuation like 0, wIndex: decoded length,
+            // single bit only, no IN of the received data
+            if (out_data_stage)
+            begin // started when SPI is free, see out_spi_wait
+              out_spi <= 1;
+              out_spi_wait <= 1;
+            end
+          end
+
+          8: begin // page program engine
+            // OUT: data stage of 1-256 bytes for one page, NAKed while both
+            // buffers are busy, wValue: address[23:8], wIndex[7:0]: address[7:0],
+            // wIndex[15] 1: data stage is RLE coded like 7.
+            // wIndex[14] 1: wIndex[13:8] is the sequence number.
+            // IN returns 1 byte: bit 0 busy, bit 1 error, bit 2 sequence gap
+            // since the last IN, 2nd byte: sequence number of the next page
+            if (in_data_stage)
+            begin
+              send_in_buf <= 0;
+              send_status <= 1;
+              rom_addr <= 6;
+              rom_length <= 2;
+              bytes_sent <= 0;
+              prog_status <= {seq_error, prog_error, page_full != 0 || prog_active};
+              prog_error <= 0;
+              seq_error <= 0;
+            end
+            if (out_data_stage)
+            begin
+              page_mode <= 1;
+              page_usb <= 0;
+              page_skip <= page_seq_drop; // consumed without writing page_buf
+              if (page_seq_drop && wIndex[13:8] != page_seq - 6'd1)
+                seq_error <= 1; // not a repeated page, one before it is missing
+              page_rle <= wIndex[15] && !page_seq_drop;
+              page_rle_count <= 0;
+              page_fill_addr <= {wValue, wIndex[7:0]};
+            end
+          end
+
+          9: begin // SPI clock, OUT without data stage
+            // wValue[7:0]: divider, SPI clock is clk/2/(divider+1)
+            // wIndex[7:0]: MISO sample delay in clk cycles after the
+            // rising edge, limited to the divider. USB reset restores SPI_DIV.
+            if (!in_data_stage)
+            begin
+              if (spi_bytes_sent != spi_length || scan_active)
+                debug_led <= debug_led + 1; // indicate overrun, SPI is not free
+              else
+              begin
+                spi_div <= wValue[7:0];
+                spi_sample_delay <= wIndex[7:0] > wValue[7:0] ? wValue[7:0] : wIndex[7:0];
+              end
+            end
+          end
+
+          default begin // catch all other bRequest
           end
         endcase
       end // end 2: vendor specific request
@@ -368,60 +735,241 @@ module usb_sp_ctrl_ep (
     endcase
     end
 
-    if ( (ctrl_xfr_state == DATA_IN) && more_data_to_send && in_ep_grant && in_ep_data_free) begin
+    if ( (ctrl_xfr_state == DATA_IN) && more_data_to_send && in_data_ready && in_ep_grant && in_ep_data_free) begin
       rom_addr <= rom_addr + 1;
       bytes_sent <= bytes_sent + 1;
+      if (send_stream && !stream_crc_phase)
+        stream_addr_usb <= stream_addr_usb + 1;
     end
 
     if ( (ctrl_xfr_state == DATA_OUT) && out_ep_data_valid && ~out_ep_setup) begin
-      out_buf[out_buf_addr_usb] <= out_ep_data;
-      out_buf_addr_usb <= out_buf_addr_usb + 1;
+      if (out_spi)
+      begin
+        out_buf[out_buf_addr_usb] <= out_ep_data;
+        out_buf_addr_usb <= out_buf_addr_usb + 1;
+      end
+      out_bytes_received <= out_bytes_received + 1;
+    end
+
+    // page buffer gets literal bytes from USB or repeated bytes, one per cycle
+    if ((page_rx_literal || page_expand) && !page_usb[8] && !page_skip)
+      page_buf[{page_fill, page_usb[7:0]}] <= page_expand ? page_rle_byte : out_ep_data;
+    if (page_rx_literal || page_expand)
+    begin
+      page_usb <= page_usb + 1;
+      if (page_rle)
+        page_rle_count <= page_rle_count - 1;
+      if (page_expand && page_rle_count == 1)
+        page_expand <= 0;
+    end
+    else if (page_rx_repeat)
+    begin
+      page_rle_byte <= out_ep_data;
+      page_expand <= 1;
+    end
+    else if (page_rx)
+    begin // token
+      page_rle_count <= out_ep_data[6:0] + 1;
+      page_rle_repeat <= out_ep_data[7];
+    end
+    if (data_stage_end && page_mode)
+    begin // page complete, programmed when SPI is free
+      page_mode <= 0;
+      page_skip <= 0;
+      if (page_usb != 0 && !page_skip)
+      begin
+        page_full[page_fill] <= 1;
+        page_addr[page_fill] <= page_fill_addr;
+        page_length[page_fill] <= page_usb;
+        page_fill <= ~page_fill;
+        page_seq <= page_seq + 1;
+      end
     end
 
-    //superslow <= superslow + 1;
-    //if (superslow == 0)
-    if (spi_bytes_sent == spi_length)
+    if (scan_restart != 0)
+    begin // new command while chip select is held low
+      scan_restart <= scan_restart - 1;
+      spi_clk <= 1;
+      spi_csn <= 1;
+      spi_bit_counter <= 12;
+      spi_div_count <= 0;
+    end
+    else if (spi_bytes_sent == spi_length && !scan_active)
     begin // nothing to send
       if (spi_continue == 0)
       begin
         spi_clk <= 1; // clock inactive
         spi_csn <= 1; // disable chip
         spi_bit_counter <= 12; // skip first few clock cycles
+        spi_div_count <= 0;
       end
     end
-    else // spi_bytes_sent != spi_length
+    else // spi_bytes_sent != spi_length or scanning
     begin
       spi_csn <= 0; // enable chip
-      if(out_buf_addr_usb != out_buf_addr_spi) // more spi data
+      if (!scan_active && rle_mode && rle_count == 0)
+      begin // RLE token, SPI clock waits
+        if (out_buf_addr_usb != out_buf_addr_spi)
+        begin
+          rle_count <= out_buf[out_buf_addr_spi][6:0] + 1;
+          rle_repeat <= out_buf[out_buf_addr_spi][7];
+          out_buf_addr_spi <= out_buf_addr_spi + 1;
+        end
+      end
+      else if(scan_active ? !scan_hold : out_buf_addr_usb != out_buf_addr_spi) // more spi data
       begin
         if (spi_bit_counter[3])
           spi_bit_counter <= spi_bit_counter + 1; // skip some cycles, flash needs small delay from csn=0 to clk
         else // spi_bit_counter < 8
         begin
-          if (spi_clk == 1)
+          if (spi_clk == 1 && spi_edge)
           begin // clock=0: send data to SPI chip
             if (spi_bit_counter[2:0] == 0)
-              spi_mosi_byte <= out_buf[out_buf_addr_spi]; // new byte from buffer
+              spi_mosi_byte <= prog_data_phase ? page_buf[prog_data_addr] :
+                scan_active ? scan_tx_byte : out_buf[out_buf_addr_spi]; // new byte from buffer
             else
               spi_mosi_byte <= spi_mosi_byte_next; // shift bit output to SPI chip
           end
-          if (spi_clk == 0)
-          begin // clock=1: read data from SPI chip
+          if (spi_sample)
+          begin // clock=1 or later: read data from SPI chip
             spi_miso_byte <= spi_miso_byte_next; // shift input from SPI chip
-            if (spi_bit_counter[2:0] == 7) // byte completed
+            if (spi_byte_last) // byte completed
             begin
-              in_buf[spi_bytes_sent] <= spi_miso_byte_next; // complete byte to IN buffer, later sent
-              spi_bytes_sent <= spi_bytes_sent + 1;
-              out_buf_addr_spi <= out_buf_addr_spi + 1; // catch up
+              if (prog_active)
+              begin
+                prog_count <= prog_count + 1;
+                if (prog_phase == 0 || (prog_phase == 1 && prog_count == page_length[page_prog] + 9'd3))
+                begin // next command
+                  prog_phase <= prog_phase + 1;
+                  prog_count <= 0;
+                  scan_restart <= 3; // chip select high at least 50 ns
+                end
+                else if (prog_phase == 2 && prog_count != 0)
+                begin
+                  prog_count <= 2;
+                  if (prog_count == 1 && !spi_miso_byte_next[0])
+                    prog_error <= 1; // WIP never set
+                  if (!spi_miso_byte_next[0])
+                  begin // page done, buffer is free
+                    prog_active <= 0;
+                    scan_active <= 0;
+                    scan_restart <= 3; // end status read, chip select high before the next command
+                    page_full[page_prog] <= 0;
+                    page_prog <= ~page_prog;
+                  end
+                end
+              end
+              else if (scan_active)
+              begin
+                if (scan_header != 0)
+                  scan_header <= scan_header - 1;
+                else if (scan_dummy != 0)
+                  scan_dummy <= scan_dummy - 1;
+                else if (scan_stream)
+                begin
+                  scan_crc <= crc32_byte(scan_crc, spi_miso_byte_next);
+                  stream_buf[stream_addr_spi[5:0]] <= spi_miso_byte_next;
+                  stream_addr_spi <= stream_addr_spi + 1;
+                  scan_count <= scan_count - 1;
+                  if (scan_count == 1)
+                    scan_active <= 0;
+                end
+                else
+                begin
+                  scan_crc <= crc32_byte(scan_crc, spi_miso_byte_next);
+                  scan_addr <= scan_addr + 1;
+                  scan_count <= scan_count - 1;
+                  if (scan_blank && spi_miso_byte_next != 8'hFF)
+                  begin // first non-blank byte found, no need to read further
+                    scan_result <= scan_addr;
+                    scan_active <= 0;
+                  end
+                  else if (scan_count == 1)
+                  begin
+                    if (!scan_blank)
+                      scan_result <= ~crc32_byte(scan_crc, spi_miso_byte_next);
+                    scan_active <= 0;
+                  end
+                end
+              end
+              else
+              begin
+                if (spi_header != 0)
+                  spi_header <= spi_header - 1;
+                in_buf[spi_bytes_sent[4:0]] <= spi_miso_byte_next; // complete byte to IN buffer, later sent
+                spi_bytes_sent <= spi_bytes_sent + 1;
+                if (rle_mode)
+                  rle_count <= rle_count - 1;
+                if (!rle_mode || !rle_repeat || rle_count == 1)
+                  out_buf_addr_spi <= out_buf_addr_spi + 1; // catch up, repeated byte stays until its run ends
+              end
             end
-            spi_bit_counter[2:0] <= spi_bit_counter[2:0] + 1;
+            spi_bit_counter[2:0] <= spi_bit_counter[2:0] + spi_step;
           end
-          spi_clk <= ~spi_clk;
+          if (spi_edge)
+          begin
+            spi_clk <= ~spi_clk;
+            spi_div_count <= spi_div;
+          end
+          else
+            spi_div_count <= spi_div_count - 1;
         end // spi bit counter < 8
       end // more_spi_data
     end // spi_bytes_sent != spi_length
 
 
+    if (!prog_active && page_full[page_prog] && !setup_stage_end &&
+      spi_bytes_sent == spi_length && !scan_active && !spi_continue)
+    begin // SPI is free, program the next page
+      prog_active <= 1;
+      prog_phase <= 0;
+      prog_count <= 0;
+      scan_active <= 1;
+      scan_stream <= 0;
+      scan_open <= 0;
+      scan_header <= 0;
+      scan_dummy <= 0;
+      scan_width <= 0;
+    end
+
+    if (out_spi_wait && !setup_stage_end && spi_bytes_sent == spi_length && !scan_active &&
+      (page_full == 0 || spi_continue))
+    begin // SPI is free, start OUT request 0 or 7, its data stage is no longer NAKed.
+      // Pages wait while chip select is held by a continued transfer.
+      out_spi_wait <= 0;
+      spi_continue <= wValue[0];
+      send_in_buf <= 0;
+      scan_open <= 0;
+      spi_bytes_sent <= 0;
+      if (bRequest == 7)
+      begin
+        rle_mode <= 1;
+        rle_count <= 0;
+        spi_length <= wIndex[12:0];
+        spi_header <= 0;
+        spi_width <= 0;
+      end
+      else
+      begin
+        rle_mode <= 0;
+        spi_length <= wLength;
+        // wIndex[3:0]: single bit header bytes, wIndex[7:6]: width of the rest
+        spi_header <= wIndex[3:0];
+        if (wIndex[7:6] == 1 && (SPI_DUAL || SPI_QUAD))
+          spi_width <= 1;
+        else if (wIndex[7:6] == 2 && SPI_QUAD)
+          spi_width <= 2;
+        else
+          spi_width <= 0;
+      end
+    end
+
+    if (setup_stage_end)
+    begin // drop bytes left by an aborted or refused data stage
+      out_buf_addr_usb <= 0;
+      out_buf_addr_spi <= 0;
+    end
+
     if (status_stage_end) begin
       setup_data_addr <= 0;      
       bytes_sent <= 0;
@@ -440,15 +988,58 @@ module usb_sp_ctrl_ep (
       setup_data_addr <= 0;
       save_dev_addr <= 0;
       send_in_buf <= 0;
+      send_status <= 0;
+      send_stream <= 0;
+      scan_active <= 0;
+      scan_stream <= 0;
+      scan_open <= 0;
+      scan_restart <= 0;
+      rle_mode <= 0;
+      rle_count <= 0;
+      page_mode <= 0;
+      out_spi <= 0;
+      out_spi_wait <= 0;
+      out_buf_addr_usb <= 0;
+      out_buf_addr_spi <= 0;
+      page_full <= 0;
+      page_fill <= 0;
+      page_expand <= 0;
+      page_prog <= 0;
+      prog_active <= 0;
+      prog_error <= 0;
+      page_skip <= 0;
+      page_seq <= 0;
+      seq_error <= 0;
+      spi_header <= 0;
+      spi_width <= 0;
       spi_length <= 0;
       spi_bytes_sent <= 0;
+      spi_div <= SPI_DIV;
+      spi_sample_delay <= 0;
       debug_led <= 0;
     end
   end
 
-  assign in_ep_data = (send_in_buf ? in_buf[rom_addr[4:0]] : descriptor_rom[rom_addr]);
+  reg [7:0] status_in_data; // 0-4: scan busy, scan_result LSB first 5: capabilities 6-7: page program
+  always @(*) begin
+    case (rom_addr[2:0])
+      0: status_in_data = {7'b0, scan_active};
+      1: status_in_data = scan_result[7:0];
+      2: status_in_data = scan_result[15:8];
+      3: status_in_data = scan_result[23:16];
+      4: status_in_data = scan_result[31:24];
+      6: status_in_data = {5'b0, prog_status};
+      7: status_in_data = {2'b0, page_seq};
+      default: status_in_data = {5'b11111, SPI_QUAD != 0, SPI_DUAL != 0 || SPI_QUAD != 0, 1'b1};
+    endcase
+  end
+
+  assign in_ep_data =
+    send_stream ? (stream_crc_phase ? stream_crc[stream_crc_byte * 8 +: 8] : stream_buf[stream_addr_usb[5:0]]) :
+    send_status ? status_in_data :
+    send_in_buf ? in_buf[rom_addr[4:0]] : descriptor_rom[rom_addr];
 
-  wire [7:0] descriptor_rom [0:35];
+  wire [7:0] descriptor_rom [0:49];
     assign descriptor_rom[0] = 18; // bLength
       assign descriptor_rom[1] = 1; // bDescriptorType
       assign descriptor_rom[2] = 'h10; // bcdUSB[0]
@@ -463,7 +1054,7 @@ module usb_sp_ctrl_ep (
       assign descriptor_rom[10] = 'hdc; // idProduct[0]
       assign descriptor_rom[11] = 'h05; // idProduct[1]
       
-      assign descriptor_rom[12] = 1; // bcdDevice[0] version minor
+      assign descriptor_rom[12] = 9; // bcdDevice[0] version minor: 2 flash scan, 3 dual/quad read, 4 multi-packet, 5 checked stream, 6 RLE, 7 page program engine, 8 page sequence numbers, 9 SPI clock
       assign descriptor_rom[13] = 0; // bcdDevice[1] version major
       assign descriptor_rom[14] = 0; // iManufacturer
       assign descriptor_rom[15] = 0; // iProduct
@@ -473,7 +1064,7 @@ module usb_sp_ctrl_ep (
       // configuration descriptor
       assign descriptor_rom[18] = 9; // bLength
       assign descriptor_rom[19] = 2; // bDescriptorType
-      assign descriptor_rom[20] = 18; // wTotalLength[0] 
+      assign descriptor_rom[20] = SPI_BULK ? 32 : 18; // wTotalLength[0] 
       assign descriptor_rom[21] = 0; // wTotalLength[1]
       assign descriptor_rom[22] = 1; // bNumInterfaces (must have at least 1 interface)
       assign descriptor_rom[23] = 1; // bConfigurationValue
@@ -486,12 +1077,30 @@ module usb_sp_ctrl_ep (
       assign descriptor_rom[28] = 4; // bDescriptorType
       assign descriptor_rom[29] = 0; // bInterfaceNumber
       assign descriptor_rom[30] = 0; // bAlternateSetting
-      assign descriptor_rom[31] = 0; // bNumEndpoints
+      assign descriptor_rom[31] = SPI_BULK ? 2 : 0; // bNumEndpoints
       assign descriptor_rom[32] = 0; // bInterfaceClass
       assign descriptor_rom[33] = 0; // bInterfaceSubClass
       assign descriptor_rom[34] = 0; // bInterfaceProtocol
       assign descriptor_rom[35] = 0; // iInterface
 
+      // endpoint descriptor, USB spec 9.6.6, page 269-271, Table 9-13
+      // sent only with SPI_BULK, framed SPI commands of usb_spi_bridge_ep
+      assign descriptor_rom[36] = 7; // bLength
+      assign descriptor_rom[37] = 5; // bDescriptorType
+      assign descriptor_rom[38] = 'h01; // bEndpointAddress EP1 OUT
+      assign descriptor_rom[39] = 'h02; // bmAttributes (0x02=bulk)
+      assign descriptor_rom[40] = 32; // wMaxPacketSize[0]
+      assign descriptor_rom[41] = 0; // wMaxPacketSize[1]
+      assign descriptor_rom[42] = 0; // bInterval
+
+      assign descriptor_rom[43] = 7; // bLength
+      assign descriptor_rom[44] = 5; // bDescriptorType
+      assign descriptor_rom[45] = 'h81; // bEndpointAddress EP1 IN
+      assign descriptor_rom[46] = 'h02; // bmAttributes (0x02=bulk)
+      assign descriptor_rom[47] = 32; // wMaxPacketSize[0]
+      assign descriptor_rom[48] = 0; // wMaxPacketSize[1]
+      assign descriptor_rom[49] = 0; // bInterval
+
 endmodule
 
 /* TODO
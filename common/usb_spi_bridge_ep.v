@@ -57,10 +57,24 @@ module usb_spi_bridge_ep (
   reg [8:0] spi_out_data = 0;
   reg [8:0] spi_in_data = 0;
 
+  reg [7:0] poll_cmd = 0;
+  reg [7:0] poll_mask = 0;
+  reg [2:0] poll_delay = 0;
+  reg [21:0] poll_count = 0; // status reads of a poll, about 4 s at 48 MHz
+
 
   ////////////////////////////////////////////////////////////////////////////////
   // command sequencer
   ////////////////////////////////////////////////////////////////////////////////
+  // commands, one after the other in the OUT data, so a script of several
+  // SPI transactions is one OUT payload and their IN bytes one response:
+  //   0x00                          boot user design
+  //   0x01 out_len[15:0] in_len[15:0] out bytes
+  //                                 SPI transaction, in_len bytes to IN
+  //   0x02 cmd mask                 poll: repeat SPI transaction cmd, read
+  //                                 1 byte until (byte & mask) == 0, that
+  //                                 byte to IN (e.g. 0x05 0x01 waits for WIP),
+  //                                 still busy after 4M reads (about 4 s)
   reg [3:0] cmd_state = 0;
   reg [3:0] cmd_state_next = 0;
 
@@ -75,12 +89,21 @@ module usb_spi_bridge_ep (
   localparam CMD_SAVE_DIL_HI = 6;
   localparam CMD_DO_OUT = 7;
   localparam CMD_DO_IN = 9;
+  localparam CMD_SAVE_POLL_CMD = 10;
+  localparam CMD_SAVE_POLL_MASK = 11;
+  localparam CMD_POLL_OUT = 12;
+  localparam CMD_POLL_IN = 13;
+  localparam CMD_POLL_WAIT = 14;
+  localparam CMD_POLL_CHECK = 15;
 
   reg get_cmd_out_data = 0;
   reg get_cmd_out_data_q = 0;
   reg spi_has_more_in_bytes = 0;
   reg spi_has_more_out_bytes = 0;
   reg spi_start_new_xfr = 0;
+  reg spi_poll_out = 0; // send poll_cmd, not a byte of the OUT data
+  reg poll_start = 0;
+  reg spi_poll_check = 0; // SPI holds its end state while the status is checked
 
 
   ////////////////////////////////////////////////////////////////////////////////
@@ -101,6 +124,7 @@ module usb_spi_bridge_ep (
   reg put_spi_in_data = 0;
   reg reset_spi_bit_counter = 0;
   reg update_spi_byte_counters = 0;
+  reg load_poll_cmd = 0;
 
   reg [3:0] spi_bit_counter = 0;
 
@@ -112,7 +136,7 @@ module usb_spi_bridge_ep (
   assign out_ep_data_get = (get_spi_out_data || get_cmd_out_data) && out_ep_grant; 
   
   reg in_ep_req_i = 0;
-  always @(posedge clk) in_ep_req_i <= (spi_has_more_in_bytes || spi_put_last_in_byte) && in_ep_data_free;
+  always @(posedge clk) in_ep_req_i <= (spi_has_more_in_bytes || spi_put_last_in_byte || spi_poll_check) && in_ep_data_free;
   always @(posedge clk) in_ep_req <= in_ep_req_i;
   always @(posedge clk) in_ep_data_put <= put_spi_in_data;
   assign in_ep_data = spi_in_data[7:0];
@@ -128,10 +152,15 @@ module usb_spi_bridge_ep (
 
   wire out_data_ready = out_ep_grant && out_ep_data_avail; 
   reg out_data_valid = 0;
-  always @(posedge clk) out_data_valid <= out_data_ready;
+  // only a command byte fetched in the last cycle, not SPI OUT data
+  always @(posedge clk) out_data_valid <= get_cmd_out_data && out_data_ready;
 
   reg spi_dir_transition = 0;
 
+  // status byte of a poll, complete in CMD_POLL_CHECK
+  wire [7:0] poll_status = spi_in_data[7:0];
+  wire poll_busy = (poll_status & poll_mask) != 8'h0 && poll_count != 22'h3fffff;
+
   ////////////////////////////////////////////////////////////////////////////////
   // command sequencer
   ////////////////////////////////////////////////////////////////////////////////
@@ -144,6 +173,9 @@ module usb_spi_bridge_ep (
     spi_has_more_out_bytes <= 1'b0;
     in_ep_data_done_i <= 1'b0;
     spi_start_new_xfr <= 1'b0;
+    spi_poll_out <= 1'b0;
+    poll_start <= 1'b0;
+    spi_poll_check <= 1'b0;
 
     case (cmd_state)
       CMD_IDLE : begin
@@ -154,6 +186,9 @@ module usb_spi_bridge_ep (
         end else if (out_data_valid && out_ep_data == 8'h1) begin  
           cmd_state_next <= CMD_SAVE_DOL_LO;    
   
+        end else if (out_data_valid && out_ep_data == 8'h2) begin
+          cmd_state_next <= CMD_SAVE_POLL_CMD;
+
         end else begin
           cmd_state_next <= CMD_IDLE;
         end
@@ -234,6 +269,75 @@ module usb_spi_bridge_ep (
         end
       end
 
+      CMD_SAVE_POLL_CMD : begin
+        get_cmd_out_data <= out_data_ready;
+        if (out_data_valid) begin
+          cmd_state_next <= CMD_SAVE_POLL_MASK;
+
+        end else begin
+          cmd_state_next <= CMD_SAVE_POLL_CMD;
+        end
+      end
+
+      CMD_SAVE_POLL_MASK : begin
+        if (out_data_valid) begin
+          cmd_state_next <= CMD_POLL_OUT;
+          spi_start_new_xfr <= 1'b1;
+          poll_start <= 1'b1;
+
+        end else begin
+          get_cmd_out_data <= out_data_ready;
+          cmd_state_next <= CMD_SAVE_POLL_MASK;
+        end
+      end
+
+      // one status read: 1 byte out, 1 byte in
+      CMD_POLL_OUT : begin
+        if (data_out_length == 16'h0) begin
+          cmd_state_next <= CMD_POLL_IN;
+          spi_dir_transition <= 1'b1;
+
+        end else begin
+          cmd_state_next <= CMD_POLL_OUT;
+          spi_poll_out <= 1'b1;
+        end
+      end
+
+      CMD_POLL_IN : begin
+        if (data_in_length == 0) begin
+          // last bit of the status is shifted in now
+          cmd_state_next <= CMD_POLL_CHECK;
+          spi_poll_check <= 1'b1;
+
+        end else begin
+          cmd_state_next <= CMD_POLL_IN;
+          spi_has_more_in_bytes <= 1'b1;
+        end
+      end
+
+      CMD_POLL_CHECK : begin
+        if (poll_busy) begin
+          // status is dropped, chip select goes high before the next read
+          cmd_state_next <= CMD_POLL_WAIT;
+
+        end else begin
+          cmd_state_next <= CMD_IDLE;
+          spi_put_last_in_byte <= 1'b1;
+          in_ep_data_done_i <= 1'b1;
+        end
+      end
+
+      CMD_POLL_WAIT : begin
+        if (spi_state == SPI_IDLE && poll_delay == 3'h7) begin
+          cmd_state_next <= CMD_POLL_OUT;
+          spi_start_new_xfr <= 1'b1;
+          poll_start <= 1'b1;
+
+        end else begin
+          cmd_state_next <= CMD_POLL_WAIT;
+        end
+      end
+
       default begin
         cmd_state_next <= CMD_IDLE;
       end
@@ -250,16 +354,38 @@ module usb_spi_bridge_ep (
         CMD_SAVE_DOL_HI : data_out_length[15:8] <= out_ep_data;
         CMD_SAVE_DIL_LO : data_in_length[7:0] <= out_ep_data;
         CMD_SAVE_DIL_HI : data_in_length[15:8] <= out_ep_data;
+        CMD_SAVE_POLL_CMD : poll_cmd <= out_ep_data;
+        CMD_SAVE_POLL_MASK : poll_mask <= out_ep_data;
       endcase
     end
 
+    if (poll_start) begin
+      data_out_length <= 16'h1;
+      data_in_length <= 16'h1;
+    end
+
     if (update_spi_byte_counters) begin
       case (cmd_state)
         CMD_DO_OUT : data_out_length <= data_out_length - 16'h1;
         CMD_DO_IN : data_in_length <= data_in_length - 16'h1;
+        CMD_POLL_OUT : data_out_length <= data_out_length - 16'h1;
+        CMD_POLL_IN : data_in_length <= data_in_length - 16'h1;
       endcase
     end
 
+    if (cmd_state == CMD_SAVE_POLL_MASK) begin
+      poll_count <= 22'h0;
+    end else if (cmd_state == CMD_POLL_CHECK) begin
+      poll_count <= poll_count + 22'h1;
+    end
+
+    // chip select high time between two status reads
+    if (cmd_state == CMD_POLL_WAIT && spi_state == SPI_IDLE) begin
+      poll_delay <= poll_delay + 3'h1;
+    end else begin
+      poll_delay <= 3'h0;
+    end
+
   end
 
   ////////////////////////////////////////////////////////////////////////////////
@@ -272,6 +398,7 @@ module usb_spi_bridge_ep (
     put_spi_in_data <= 1'b0;
     reset_spi_bit_counter <= 1'b0;
     update_spi_byte_counters <= 1'b0;
+    load_poll_cmd <= 1'b0;
 
     case (spi_state)
       SPI_IDLE : begin
@@ -295,6 +422,10 @@ module usb_spi_bridge_ep (
           get_spi_out_data <= 1'b1;
           spi_state_next <= SPI_SEND_BIT;
           
+        end else if (spi_poll_out) begin
+          load_poll_cmd <= 1'b1;
+          spi_state_next <= SPI_SEND_BIT;
+
         end else if (spi_has_more_in_bytes || spi_dir_transition) begin
           spi_state_next <= SPI_SEND_BIT;
 
@@ -338,7 +469,7 @@ module usb_spi_bridge_ep (
 	    spi_state_next <= SPI_END;
           end
 
-        end else if (spi_dir_transition) begin
+        end else if (spi_poll_out || spi_dir_transition) begin
           spi_state_next <= SPI_START;
 
         end else if (spi_has_more_in_bytes) begin
@@ -357,6 +488,9 @@ module usb_spi_bridge_ep (
             spi_state_next <= SPI_END;
           end
 
+        end else if (spi_poll_check) begin
+          spi_state_next <= SPI_END;
+
         end else begin
           spi_state_next <= SPI_IDLE;
         end
@@ -373,6 +507,9 @@ module usb_spi_bridge_ep (
   reg get_spi_out_data_q = 0;
   always @(posedge clk) get_spi_out_data_q <= get_spi_out_data;
 
+  reg load_poll_cmd_q = 0;
+  always @(posedge clk) load_poll_cmd_q <= load_poll_cmd;
+
   reg spi_get_bit_q = 0;
   always @(posedge clk) spi_get_bit_q <= spi_get_bit;
   always @(posedge clk) begin
@@ -390,6 +527,8 @@ module usb_spi_bridge_ep (
     if (spi_send_bit) begin
       if (get_spi_out_data_q) begin
         spi_out_data <= {out_ep_data[7:0], 1'b0};
+      end else if (load_poll_cmd_q) begin
+        spi_out_data <= {poll_cmd, 1'b0};
       end else begin
         spi_out_data <= {spi_out_data[7:0], 1'b0};
       end
@@ -0,0 +1,46 @@
+#!/bin/sh
+# throughput benchmark of tinyfpgasp against the emulated device
+# usage: benchmark.sh [bytes] [address]
+# environment EMU_* sets device latencies, see libusb_emu.c
+# BENCH_ARGS are passed to every tinyfpgasp run, e.g. "-q 0" or "-t bulk"
+# the flash content cache is off unless BENCH_ARGS has "-C dir", the SPI
+# clock is not tuned: runs compare the transfers, not the calibration
+
+set -e
+program=./tinyfpgasp-emu
+bytes=${1:-1048576}
+address=${2:-0x200000}
+dir=bench.tmp
+
+rm -rf $dir
+mkdir $dir
+export EMU_FLASH=$dir/flash.bin
+export EMU_BYTES=$bytes
+
+# random image and a copy with a few 4K sectors changed
+head -c $bytes /dev/urandom > $dir/image1.bin
+cp $dir/image1.bin $dir/image2.bin
+for sector in 3 17 18 40; do
+  if [ $((sector * 4096 + 4096)) -le $bytes ]; then
+    head -c 4096 /dev/urandom | dd of=$dir/image2.bin bs=4096 seek=$sector conv=notrunc 2>/dev/null
+  fi
+done
+
+run()
+{
+  printf "%-10s " "$1"
+  shift
+  $program -C off -k off $BENCH_ARGS -a $address "$@" 2>&1 >$dir/log.txt | grep -o "emu: .*" | sed -e "s/^emu: //"
+}
+
+run "write" -w $dir/image1.bin
+run "rewrite" -w $dir/image2.bin
+run "verify" -w $dir/image2.bin
+run "read" -l $bytes -r $dir/read.bin
+if cmp -s $dir/image2.bin $dir/read.bin; then
+  echo "read back matches"
+else
+  echo "read back differs"
+  exit 1
+fi
+rm -rf $dir
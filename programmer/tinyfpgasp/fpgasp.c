@@ -0,0 +1,3659 @@
+#include <stdio.h>
+
+// uint types
+#include <unistd.h>
+
+// malloc
+#include <stdlib.h>
+
+// memcpy
+#include <memory.h>
+
+// clock_gettime for throughput measurement
+#include <time.h>
+
+// file handling
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <errno.h>
+
+// host side of the write pipeline
+#include <pthread.h>
+
+// USB
+#include <libusb-1.0/libusb.h>
+
+#include "fpgasp.h"
+
+// **** handle ****
+// everything a session needs, one handle per device
+struct fpgasp
+{
+  libusb_context *usb;
+  uint8_t libusb_initialized, interface_claimed;
+  struct libusb_device_handle *device_handle;
+  int usb_queue_depth; // USB transfers in flight, 0: synchronous
+  int usb_bulk; // 1: SPI through bulk endpoints instead of control transfers
+  uint16_t gateware_version; // bcdDevice of the bootloader bitstream
+  struct usb_queue_slot *usb_queue; // USB_QUEUE_MAX slots
+  int usb_queue_head; // next slot to submit
+  int usb_queue_error; // sticky error until usb_queue_flush()
+  uint8_t bulk_ep_out, bulk_ep_in; // 0: not in descriptor
+  struct flash_info *flash; // chip geometry and opcodes, from SFDP
+  const struct read_mode *flash_read_mode;
+  uint32_t write_raw_bytes, write_usb_bytes; // page program data before and after RLE
+  struct page_record *page_sent; // queued pages not yet confirmed by gateware
+  int page_pending; // number of them
+  uint8_t page_seq; // sequence number of page_sent[0]
+  uint8_t page_seq_known; // 0: read it from gateware first
+  struct flash_cache *cache; // NULL: no flash content cache
+  struct hotplug *hotplug; // NULL: not waiting for devices
+  char *journal_file; // NULL: writes have no journal
+  int journal_resume; // 1: skip sectors the journal lists as verified
+  int journal_fd; // of the running write, -1: none
+  struct fpgasp_stats *stats;
+  fpgasp_progress_fn progress;
+  void *progress_user;
+};
+
+static void progress(struct fpgasp *sp, uint32_t done, uint32_t total)
+{
+  if(sp->progress)
+    sp->progress(sp->progress_user, done, total);
+}
+
+void cmd_addr(uint8_t *buf, uint8_t cmd, uint32_t addr)
+{
+  buf[0] = cmd;
+  buf[1] = 0xFF & (addr >> 16);
+  buf[2] = 0xFF & (addr >> 8);
+  buf[3] = 0XFF & addr;
+}
+
+// monotonic time in seconds, for throughput measurement
+double time_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+void print_throughput(struct fpgasp *sp, const char *what, uint32_t bytes, double seconds)
+{
+  if(seconds <= 0.0)
+    seconds = 1.0e-9;
+  printf("%s %d bytes in %.2f s, %.1f KB/s (%s, %d in flight)\n",
+    what, bytes, seconds, bytes / seconds / 1024.0,
+    sp->usb_bulk ? "bulk" : sp->usb_queue_depth ? "async" : "sync", sp->usb_queue_depth);
+}
+
+// **** statistics ****
+// counters and times of the hot paths, reported with --stats (text|json).
+// USB latency is from submit to completion, for queued transfers
+// it includes the transfers ahead in the queue.
+// histogram bucket i counts latencies of 2^i to 2^(i+1)-1 us.
+#define STATS_HIST 24
+
+enum stats_phase
+{
+  PHASE_PREREAD, // read or scan the range before writing
+  PHASE_DIFF, // classify sectors and plan erases
+  PHASE_ERASE,
+  PHASE_PROGRAM,
+  PHASE_VERIFY,
+  PHASE_READ, // flash to file
+  PHASE_COUNT
+};
+static const char *stats_phase_name[PHASE_COUNT] = {"preread", "diff", "erase", "program", "verify", "read"};
+
+enum stats_busy
+{
+  BUSY_ERASE,
+  BUSY_PROGRAM,
+  BUSY_COUNT
+};
+static const char *stats_busy_name[BUSY_COUNT] = {"erase", "program"};
+
+struct stats_usb
+{
+  unsigned long transfers, bytes;
+  double seconds, max_seconds;
+  unsigned long hist[STATS_HIST];
+};
+
+struct fpgasp_stats
+{
+  struct stats_usb usb[2]; // 0:OUT 1:IN
+  unsigned long busy_polls[BUSY_COUNT]; // status reads until flash is ready
+  double busy_seconds[BUSY_COUNT];
+  unsigned long retries_read, retries_write; // 4K chunks read again, sectors erased again
+  unsigned long retries_packet; // transfers sent again
+  double phase_seconds[PHASE_COUNT];
+};
+
+static void stats_usb_transfer(struct fpgasp *sp, int in, uint32_t bytes, double seconds)
+{
+  struct stats_usb *u = &sp->stats->usb[in != 0];
+  int i = 0;
+  u->transfers++;
+  u->bytes += bytes;
+  u->seconds += seconds;
+  if(seconds > u->max_seconds)
+    u->max_seconds = seconds;
+  for(uint64_t us = seconds * 1.0e6; us > 1 && i < STATS_HIST - 1; us >>= 1)
+    i++;
+  u->hist[i]++;
+}
+
+void stats_print_text(struct fpgasp *sp)
+{
+  for(int d = 0; d < 2; d++)
+  {
+    struct stats_usb *u = &sp->stats->usb[d];
+    printf("stats: USB %-3s %lu transfers, %lu bytes, latency avg %.0f us, max %.0f us\n", d ? "IN" : "OUT",
+      u->transfers, u->bytes, u->transfers ? u->seconds * 1.0e6 / u->transfers : 0.0, u->max_seconds * 1.0e6);
+    printf("stats: USB %-3s latency histogram (us:count)", d ? "IN" : "OUT");
+    for(int i = 0; i < STATS_HIST; i++)
+      if(u->hist[i])
+        printf(" %lu:%lu", 1ul << i, u->hist[i]);
+    printf("\n");
+  }
+  for(int b = 0; b < BUSY_COUNT; b++)
+    printf("stats: flash busy %-7s %.3f s, %lu status polls\n",
+      stats_busy_name[b], sp->stats->busy_seconds[b], sp->stats->busy_polls[b]);
+  printf("stats: retries read %lu, write %lu, packet %lu\n",
+    sp->stats->retries_read, sp->stats->retries_write, sp->stats->retries_packet);
+  printf("stats: phase");
+  for(int p = 0; p < PHASE_COUNT; p++)
+    printf(" %s %.3f s%s", stats_phase_name[p], sp->stats->phase_seconds[p], p < PHASE_COUNT - 1 ? "," : "\n");
+}
+
+// one line, so it can be picked out of the other output
+void stats_print_json(struct fpgasp *sp, const char *path)
+{
+  printf("{\"device\": \"%s\", \"gateware\": %u, \"transport\": \"%s\", \"queue\": %d, \"usb\": {",
+    path ? path : "", sp->gateware_version, sp->usb_bulk ? "bulk" : sp->usb_queue_depth ? "async" : "sync", sp->usb_queue_depth);
+  for(int d = 0; d < 2; d++)
+  {
+    struct stats_usb *u = &sp->stats->usb[d];
+    printf("%s\"%s\": {\"transfers\": %lu, \"bytes\": %lu, \"seconds\": %.6f, \"max_us\": %.0f, \"hist_us\": {",
+      d ? ", " : "", d ? "in" : "out", u->transfers, u->bytes, u->seconds, u->max_seconds * 1.0e6);
+    const char *sep = "";
+    for(int i = 0; i < STATS_HIST; i++)
+      if(u->hist[i])
+      {
+        printf("%s\"%lu\": %lu", sep, 1ul << i, u->hist[i]);
+        sep = ", ";
+      }
+    printf("}}");
+  }
+  printf("}, \"busy\": {");
+  for(int b = 0; b < BUSY_COUNT; b++)
+    printf("%s\"%s\": {\"seconds\": %.6f, \"polls\": %lu}", b ? ", " : "",
+      stats_busy_name[b], sp->stats->busy_seconds[b], sp->stats->busy_polls[b]);
+  printf("}, \"retries\": {\"read\": %lu, \"write\": %lu, \"packet\": %lu}, \"phases\": {",
+    sp->stats->retries_read, sp->stats->retries_write, sp->stats->retries_packet);
+  for(int p = 0; p < PHASE_COUNT; p++)
+    printf("%s\"%s\": %.6f", p ? ", " : "", stats_phase_name[p], sp->stats->phase_seconds[p]);
+  printf("}}\n");
+}
+
+// **** asynchronous USB transfer engine ****
+// vendor control transfers are submitted to libusb and kept in flight,
+// up to usb_queue_depth at a time, so next packet's setup stage doesn't
+// wait for a round trip to userspace. Control endpoint 0 completes
+// transfers in the order of submission, so slots form a ring and IN
+// payload is copied to its destination from the completion callback.
+// usb_queue_depth = 0 falls back to synchronous libusb_control_transfer.
+// gateware from GATEWARE_MULTI_PACKET accepts data stage of many packets,
+// older gateware only a single packet.
+#define USB_PACKET_MAX 32
+#define USB_TRANSFER_MAX 4096 // usbfs limit for control transfer
+
+struct usb_queue_slot
+{
+  struct libusb_transfer *transfer;
+  struct fpgasp *sp;
+  uint8_t buf[LIBUSB_CONTROL_SETUP_SIZE + USB_TRANSFER_MAX];
+  uint8_t *in_data; // IN: destination of received payload, NULL for OUT
+  uint16_t in_skip; // IN: skip that many bytes at start of payload
+  uint16_t length; // expected payload length
+  double submit_time; // for latency statistics
+  volatile uint8_t busy; // submitted and not yet completed
+};
+
+static const uint16_t usb_queue_timeout_ms = 1000; // queued transfers wait for others ahead
+static const uint16_t usb_timeout_ms = 10; // 10 ms waiting for response
+
+static void LIBUSB_CALL usb_queue_callback(struct libusb_transfer *transfer)
+{
+  struct usb_queue_slot *slot = (struct usb_queue_slot *)transfer->user_data;
+  struct fpgasp *sp = slot->sp;
+  if(transfer->status != LIBUSB_TRANSFER_COMPLETED)
+  {
+    if(sp->usb_queue_error == 0)
+      fprintf(stderr, "queue %s: transfer status %d\n", slot->in_data ? "IN" : "OUT", transfer->status);
+    sp->usb_queue_error = -1;
+  }
+  else if(transfer->actual_length != slot->length)
+  {
+    if(sp->usb_queue_error == 0)
+      fprintf(stderr, "queue %s: short transfer %d/%d\n", slot->in_data ? "IN" : "OUT",
+        transfer->actual_length, slot->length);
+    sp->usb_queue_error = -1;
+  }
+  else if(slot->in_data)
+    memcpy(slot->in_data, libusb_control_transfer_get_data(transfer) + slot->in_skip, slot->length - slot->in_skip);
+  stats_usb_transfer(sp, slot->in_data != NULL, transfer->actual_length, time_now() - slot->submit_time);
+  slot->busy = 0;
+}
+
+// wait until given slot completes
+static int usb_queue_wait(struct fpgasp *sp, struct usb_queue_slot *slot)
+{
+  while(slot->busy)
+  {
+    int rc = libusb_handle_events(sp->usb);
+    if(rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED)
+    {
+      fprintf(stderr, "queue events: %s\n", libusb_error_name(rc));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int usb_queue_transfer(struct fpgasp *sp, uint8_t direction, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+  uint8_t *data, uint16_t length, uint16_t skip)
+{
+  uint8_t request_type = (uint8_t)(direction|LIBUSB_REQUEST_TYPE_VENDOR);
+  if(length > (sp->gateware_version < GATEWARE_MULTI_PACKET ? USB_PACKET_MAX : USB_TRANSFER_MAX))
+    return -1;
+  if(sp->usb_queue_depth == 0)
+  { // synchronous
+    uint8_t buf[USB_TRANSFER_MAX];
+    if(direction == LIBUSB_ENDPOINT_OUT)
+      memcpy(buf, data, length);
+    double submit_time = time_now();
+    int response = libusb_control_transfer(sp->device_handle, request_type,
+      bRequest, wValue, wIndex, buf, length, usb_timeout_ms);
+    stats_usb_transfer(sp, direction == LIBUSB_ENDPOINT_IN, response < 0 ? 0 : response, time_now() - submit_time);
+    if(response != length)
+    {
+      fprintf(stderr, "%s: %s\n", direction == LIBUSB_ENDPOINT_OUT ? "OUT" : "IN",
+        response < 0 ? libusb_error_name(response) : "short transfer");
+      return -1; // something went wrong with USB
+    }
+    if(direction == LIBUSB_ENDPOINT_IN)
+      memcpy(data, buf + skip, length - skip);
+    return 0;
+  }
+  struct usb_queue_slot *slot = &sp->usb_queue[sp->usb_queue_head];
+  if(usb_queue_wait(sp, slot) < 0)
+    return -1;
+  if(sp->usb_queue_error)
+    return -1; // don't submit more after a failure
+  if(slot->transfer == NULL)
+  {
+    slot->transfer = libusb_alloc_transfer(0);
+    if(slot->transfer == NULL)
+      return -1;
+  }
+  slot->sp = sp;
+  libusb_fill_control_setup(slot->buf, request_type, bRequest, wValue, wIndex, length);
+  if(direction == LIBUSB_ENDPOINT_OUT)
+  {
+    memcpy(slot->buf + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+    slot->in_data = NULL;
+  }
+  else
+    slot->in_data = data;
+  slot->in_skip = skip;
+  slot->length = length;
+  libusb_fill_control_transfer(slot->transfer, sp->device_handle, slot->buf,
+    usb_queue_callback, slot, usb_queue_timeout_ms);
+  slot->busy = 1;
+  slot->submit_time = time_now();
+  int rc = libusb_submit_transfer(slot->transfer);
+  if(rc < 0)
+  {
+    slot->busy = 0;
+    fprintf(stderr, "queue submit: %s\n", libusb_error_name(rc));
+    return -1;
+  }
+  sp->usb_queue_head = (sp->usb_queue_head + 1) % sp->usb_queue_depth;
+  return 0;
+}
+
+// submit one vendor control transfer to the queue
+// OUT: data[0..length-1] is copied to the slot, caller may reuse data
+// IN: received payload without first "skip" bytes is later written to data
+// a failure, also of a synchronous transfer, is kept for usb_queue_flush()
+// and later transfers are refused until then
+static int usb_queue_submit(struct fpgasp *sp, uint8_t direction, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+  uint8_t *data, uint16_t length, uint16_t skip)
+{
+  if(sp->usb_queue_error)
+    return -1;
+  if(usb_queue_transfer(sp, direction, bRequest, wValue, wIndex, data, length, skip) < 0)
+  {
+    sp->usb_queue_error = -1;
+    return -1;
+  }
+  return 0;
+}
+
+int usb_queue_out(struct fpgasp *sp, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t length)
+{
+  return usb_queue_submit(sp, LIBUSB_ENDPOINT_OUT, bRequest, wValue, wIndex, data, length, 0);
+}
+
+int usb_queue_in(struct fpgasp *sp, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, uint8_t *data, uint16_t length, uint16_t skip)
+{
+  return usb_queue_submit(sp, LIBUSB_ENDPOINT_IN, bRequest, wValue, wIndex, data, length, skip);
+}
+
+// wait for all queued transfers to complete
+// returns 0 if all of them succeeded, -1 on error
+int usb_queue_flush(struct fpgasp *sp)
+{
+  int rc = 0;
+  for(int i = 0; i < sp->usb_queue_depth; i++)
+    if(usb_queue_wait(sp, &sp->usb_queue[i]) < 0)
+      rc = -1;
+  if(sp->usb_queue_error)
+    rc = -1;
+  sp->usb_queue_error = 0;
+  sp->usb_queue_head = 0;
+  return rc;
+}
+
+
+// **** bulk SPI bridge ****
+// gateware built with SPI_BULK lists EP1 bulk OUT/IN in the configuration
+// descriptor. OUT carries frames {1, out length LSB first, in length LSB first,
+// out bytes}: chip select is asserted, out bytes are shifted, then in bytes
+// are read (MOSI 0) and sent to bulk IN, chip select is released.
+// Many frames can be sent in one OUT transfer.
+#define BULK_FRAME_HEADER 5
+#define BULK_READ_MAX 32768
+
+// write frame header, return where out bytes start
+static uint8_t *bulk_frame(uint8_t *buf, uint16_t out_len, uint16_t in_len)
+{
+  buf[0] = 1;
+  buf[1] = out_len & 0xFF;
+  buf[2] = out_len >> 8;
+  buf[3] = in_len & 0xFF;
+  buf[4] = in_len >> 8;
+  return buf + BULK_FRAME_HEADER;
+}
+
+static int bulk_transfer(struct fpgasp *sp, uint8_t endpoint, uint8_t *data, int length)
+{
+  int transferred = 0;
+  double submit_time = time_now();
+  int rc = libusb_bulk_transfer(sp->device_handle, endpoint, data, length, &transferred, usb_queue_timeout_ms);
+  stats_usb_transfer(sp, endpoint & LIBUSB_ENDPOINT_IN, transferred, time_now() - submit_time);
+  if(rc < 0 || transferred != length)
+  {
+    fprintf(stderr, "bulk %s: %s\n", endpoint & LIBUSB_ENDPOINT_IN ? "IN" : "OUT",
+      rc < 0 ? libusb_error_name(rc) : "short transfer");
+    return -1;
+  }
+  return 0;
+}
+
+// bridge is half duplex, in bytes are read after out bytes.
+// full duplex callers of txrx(sp) send a command byte followed by
+// dummy bytes, so only the command is sent and the response is
+// read in place of the dummy bytes.
+int bulk_txrx(struct fpgasp *sp, uint8_t *out_data, uint32_t out_len, uint8_t *in_data, uint32_t in_len)
+{
+  uint8_t buf[BULK_FRAME_HEADER + USB_PACKET_MAX];
+  uint32_t send = in_len ? 1 : out_len;
+  if(out_len > USB_PACKET_MAX)
+    return -1;
+  memcpy(bulk_frame(buf, send, in_len ? in_len - 1 : 0), out_data, send);
+  if(bulk_transfer(sp, sp->bulk_ep_out, buf, BULK_FRAME_HEADER + send) < 0)
+    return -1;
+  if(in_len > 1)
+    if(bulk_transfer(sp, sp->bulk_ep_in, in_data + 1, in_len - 1) < 0)
+      return -1;
+  if(in_len)
+    in_data[0] = 0xFF; // nothing is read during command byte
+  return 0;
+}
+
+// command with address and dummy bytes, then read length bytes
+int bulk_command_read(struct fpgasp *sp, const uint8_t *cmd, uint16_t cmd_len, uint8_t *data, uint32_t length)
+{
+  uint8_t buf[BULK_FRAME_HEADER + USB_PACKET_MAX];
+  if(cmd_len > USB_PACKET_MAX)
+    return -1;
+  memcpy(bulk_frame(buf, cmd_len, length), cmd, cmd_len);
+  if(bulk_transfer(sp, sp->bulk_ep_out, buf, BULK_FRAME_HEADER + cmd_len) < 0)
+    return -1;
+  return bulk_transfer(sp, sp->bulk_ep_in, data, length);
+}
+
+// choose bulk if gateware has it, or the transport given by name
+int usb_select_transport(struct fpgasp *sp, const char *name)
+{
+  int available = sp->bulk_ep_out != 0 && sp->bulk_ep_in != 0;
+  if(strcmp(name, "auto") == 0)
+    sp->usb_bulk = available;
+  else if(strcmp(name, "control") == 0)
+    sp->usb_bulk = 0;
+  else if(strcmp(name, "bulk") == 0)
+  {
+    if(!available)
+    {
+      fprintf(stderr, "bootloader has no bulk endpoints\n");
+      return -1;
+    }
+    sp->usb_bulk = 1;
+  }
+  else
+  {
+    fprintf(stderr, "unknown transport %s\n", name);
+    return -1;
+  }
+  printf("USB transport: %s\n", sp->usb_bulk ? "bulk" : "control");
+  return 0;
+}
+
+// up to 32 byte single packet in/out exchange.
+// a failed exchange is repeated, SPI commands sent by it
+// can be sent twice: flash ignores them while busy
+#define TXRX_RETRY 3
+
+int txrx(struct fpgasp *sp, uint8_t *out_data, uint32_t out_len, uint8_t *in_data, uint32_t in_len)
+{
+  if(sp->usb_bulk)
+    return bulk_txrx(sp, out_data, out_len, in_data, in_len);
+  uint8_t bRequest = 0; // currently no use
+  uint16_t wIndex = 0; // currently no use
+  uint16_t wValue = 0; // wValue: 0-no continuation, 1-continuation
+
+  for(int i = 0; i <= TXRX_RETRY; i++)
+  {
+    if(i)
+      sp->stats->retries_packet++;
+    int rc = usb_queue_out(sp, bRequest, wValue, wIndex, out_data, out_len);
+    if(rc == 0 && in_data != NULL && in_len != 0)
+      rc = usb_queue_in(sp, bRequest, wValue, wIndex, in_data, in_len, 0);
+    if(usb_queue_flush(sp) == 0 && rc == 0)
+      return 0;
+  }
+  fprintf(stderr, "txrx failed\n");
+  return -1; // something went wrong with USB
+}
+
+int flash_read_id(struct fpgasp *sp)
+{
+  uint8_t buf[5];
+  cmd_addr(buf, 0xAB, 0);
+  int rc = txrx(sp, buf, sizeof(buf), buf, sizeof(buf));
+  if(rc < 0)
+    return rc;
+  return buf[4];
+}
+
+// JEDEC manufacturer, memory type, capacity
+int flash_read_jedec_id(struct fpgasp *sp, uint8_t *id)
+{
+  uint8_t buf[4];
+  buf[0] = 0x9F;
+  int rc = txrx(sp, buf, sizeof(buf), buf, sizeof(buf));
+  if(rc < 0)
+    return rc;
+  memcpy(id, buf+1, 3);
+  return 0;
+}
+
+int flash_read_status(struct fpgasp *sp)
+{
+  uint8_t buf[2];
+  buf[0] = 0x05;
+  int rc = txrx(sp, buf, sizeof(buf), buf, sizeof(buf));
+  if(rc < 0)
+    return rc;
+  return buf[1];
+}
+
+// kind: BUSY_ERASE or BUSY_PROGRAM, only for statistics
+// typical_ms: typical time of the operation, 0: unknown.
+// first status poll of a long operation is after most of its typical
+// time, later polls are spaced too instead of back to back USB transfers.
+// operations of a few USB round trips (page program) are polled at once.
+#define POLL_FIRST 0.75 // of typical time
+#define POLL_STEPS 32 // polls per typical time after the first
+#define POLL_TYPICAL_MIN_MS 5.0
+
+int flash_wait_while_busy(struct fpgasp *sp, int kind, double typical_ms)
+{
+  double time_start = time_now();
+  useconds_t step_us = 0;
+  int status;
+  if(typical_ms >= POLL_TYPICAL_MIN_MS)
+  {
+    usleep(typical_ms * POLL_FIRST * 1000.0);
+    step_us = typical_ms * 1000.0 / POLL_STEPS;
+  }
+  for(;;)
+  {
+    sp->stats->busy_polls[kind]++;
+    status = flash_read_status(sp);
+    if(status < 0 || (status & 1) == 0)
+      break;
+    if(step_us)
+      usleep(step_us);
+  }
+  sp->stats->busy_seconds[kind] += time_now() - time_start;
+  return status < 0 ? -1 : 0;
+}
+
+int flash_write_enable(struct fpgasp *sp)
+{
+  uint8_t buf[1];
+  buf[0] = 0x06;
+  int rc = txrx(sp, buf, sizeof(buf), NULL, 0);
+  if(rc < 0)
+    return rc;
+  return 0;
+}
+
+int flash_write_disable(struct fpgasp *sp)
+{
+  uint8_t buf[1];
+  buf[0] = 0x04;
+  int rc = txrx(sp, buf, sizeof(buf), NULL, 0);
+  if(rc < 0)
+    return rc;
+  return 0;
+}
+
+
+// **** read modes ****
+// gateware from GATEWARE_READ_MODES sends first wIndex[3:0] bytes
+// of a packet single bit (command, address), the rest with
+// wIndex[7:6] 0:x1 1:x2 2:x4 bits per clock. 8 dummy clocks follow
+// the address, which are 1, 2 or 4 dummy bytes depending on width.
+// opcodes and dummy clocks of the flash are taken from its SFDP table.
+struct read_mode
+{
+  const char *name;
+  uint8_t opcode;
+  uint8_t width; // 0:x1 1:x2 2:x4
+  uint8_t dummy_bytes; // 8 dummy clocks
+};
+
+static const struct read_mode read_modes[] =
+{
+  {"slow", 0x03, 0, 0},
+  {"fast", 0x0B, 0, 1},
+  {"dual", 0x3B, 1, 2},
+  {"quad", 0x6B, 2, 4},
+};
+enum {READ_SLOW, READ_FAST, READ_DUAL, READ_QUAD, READ_MODES};
+
+
+// **** flash geometry ****
+// erase types, page size, read opcodes and addressing of the chip.
+// flash_probe() reads them once per session from the SFDP table
+// (JESD216, command 0x5A), a flash without SFDP gets the values
+// of common 3-byte address NOR flash up to 16 MB.
+// flash above 16 MB is reached through its extended address (or bank)
+// register: all 3-byte commands of host and gateware then address
+// the selected 16 MB bank, so the gateware needs no 4-byte commands.
+#define SFDP_READ 0x5A
+#define SFDP_SIGNATURE 0x50444653 // "SFDP" LSB first
+#define SFDP_HEADERS_MAX 8
+#define SFDP_DWORDS_MAX 23 // of the basic flash parameter table
+#define ERASE_TYPES 4
+#define BANK_SIZE (16*1024*1024) // reach of 3-byte addresses
+
+// SFDP erase time units: 1 ms, 16 ms, 128 ms, 1 s
+static const double sfdp_erase_unit_ms[] = {1.0, 16.0, 128.0, 1000.0};
+
+struct erase_type
+{
+  uint32_t size; // bytes, power of 2
+  uint8_t opcode;
+  double typical_ms;
+};
+
+enum
+{
+  ADDR4_NONE = 0, // 3-byte addresses only, up to 16 MB
+  ADDR4_EAR = 1, // extended address register, write 0xC5 after write enable
+  ADDR4_BANK = 2, // bank register, write 0x17
+};
+
+enum
+{ // SFDP quad enable requirement
+  QE_NONE = 0, // no QE bit
+  QE_SR2_BIT1 = 1, // status register 2 bit 1, read 0x35
+  QE_SR1_BIT6 = 2, // status register 1 bit 6
+  QE_SR2_BIT7 = 3, // status register 2 bit 7, read 0x3F
+  QE_UNKNOWN = 0xFF,
+};
+
+struct flash_info
+{
+  uint8_t probed; // 1: read from this chip
+  uint8_t sfdp; // 1: from SFDP table, 0: defaults
+  uint8_t jedec_id[3];
+  uint32_t size; // bytes
+  uint32_t page_size;
+  double page_program_ms; // typical
+  struct erase_type erase[ERASE_TYPES]; // ascending size
+  int num_erase;
+  struct read_mode read_modes[READ_MODES]; // opcodes and dummy bytes of this chip
+  uint8_t read_supported; // bit per read mode
+  uint8_t quad_enable; // QE_*
+  uint8_t addr4; // ADDR4_*
+  int bank; // 16 MB bank selected in the flash, -1: not known
+};
+
+static const struct erase_type default_erase[] =
+{
+  {4*1024, 0x20, 45.0},
+  {32*1024, 0x52, 120.0},
+  {64*1024, 0xD8, 150.0},
+};
+
+static int flash_write_wait(struct fpgasp *sp);
+
+static void flash_info_defaults(struct flash_info *f)
+{
+  memset(f, 0, sizeof(*f));
+  f->size = BANK_SIZE;
+  f->page_size = 256;
+  f->page_program_ms = 0.7;
+  f->num_erase = sizeof(default_erase) / sizeof(default_erase[0]);
+  memcpy(f->erase, default_erase, sizeof(default_erase));
+  memcpy(f->read_modes, read_modes, sizeof(read_modes));
+  f->read_supported = 1 << READ_SLOW | 1 << READ_FAST;
+  f->quad_enable = QE_UNKNOWN;
+  f->addr4 = ADDR4_NONE;
+  f->bank = 0;
+}
+
+// read SFDP bytes, 3 address bytes and 8 dummy clocks
+static int sfdp_read(struct fpgasp *sp, uint32_t addr, uint8_t *data, uint32_t length)
+{
+  uint8_t buf[USB_PACKET_MAX];
+  while(length > 0)
+  {
+    uint32_t n = length < sizeof(buf) - 5 ? length : sizeof(buf) - 5;
+    memset(buf, 0, sizeof(buf));
+    cmd_addr(buf, SFDP_READ, addr);
+    if(sp->usb_bulk) // bulk_txrx would not send the address
+    {
+      if(bulk_command_read(sp, buf, 5, data, n) < 0)
+        return -1;
+    }
+    else if(txrx(sp, buf, 5 + n, buf, 5 + n) < 0)
+      return -1;
+    else
+      memcpy(data, buf + 5, n);
+    data += n;
+    addr += n;
+    length -= n;
+  }
+  return 0;
+}
+
+// DWORD i (from 1 as numbered in JESD216) of a parameter table
+static uint32_t sfdp_dword(const uint8_t *table, int i)
+{
+  const uint8_t *p = table + 4 * (i - 1);
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// dummy clocks of a read mode as dummy bytes at its width, 0: not representable
+static uint8_t sfdp_dummy_bytes(uint32_t mode_dummy, int width)
+{
+  uint32_t clocks = (mode_dummy & 0x1F) + ((mode_dummy >> 5) & 7);
+  uint32_t bits = clocks << width;
+  return bits % 8 ? 0 : bits / 8;
+}
+
+static void sfdp_add_erase(struct flash_info *f, uint32_t size, uint8_t opcode, double typical_ms)
+{
+  if(size < 4*1024 || (size & (size - 1)) || f->num_erase == ERASE_TYPES)
+    return; // the planner works in 4K sectors
+  for(int i = 0; i < f->num_erase; i++)
+    if(f->erase[i].size == size)
+      return;
+  int i = f->num_erase++;
+  for(; i > 0 && f->erase[i-1].size > size; i--)
+    f->erase[i] = f->erase[i-1];
+  f->erase[i].size = size;
+  f->erase[i].opcode = opcode;
+  f->erase[i].typical_ms = typical_ms;
+}
+
+// basic flash parameter table, n DWORDs
+static void sfdp_parse_basic(struct flash_info *f, const uint8_t *t, int n)
+{
+  uint32_t dw1 = sfdp_dword(t, 1), dw2 = sfdp_dword(t, 2);
+  if(dw2 & 0x80000000)
+  {
+    uint32_t log2_bits = dw2 & 0x7FFFFFFF;
+    if(log2_bits >= 3) // smaller than a byte is corrupt, keep the JEDEC size
+      f->size = log2_bits >= 35 ? 0x80000000 : 1u << (log2_bits - 3);
+  }
+  else
+    f->size = dw2 / 8 + 1;
+  f->read_supported = 1 << READ_SLOW | 1 << READ_FAST;
+  if(dw1 & (1 << 16)) // 1-1-2 fast read
+  {
+    uint32_t dw4 = sfdp_dword(t, 4);
+    f->read_modes[READ_DUAL].opcode = dw4 >> 8;
+    f->read_modes[READ_DUAL].dummy_bytes = sfdp_dummy_bytes(dw4, 1);
+    if(f->read_modes[READ_DUAL].dummy_bytes)
+      f->read_supported |= 1 << READ_DUAL;
+  }
+  if(dw1 & (1 << 22)) // 1-1-4 fast read
+  {
+    uint32_t dw3 = sfdp_dword(t, 3);
+    f->read_modes[READ_QUAD].opcode = dw3 >> 24;
+    f->read_modes[READ_QUAD].dummy_bytes = sfdp_dummy_bytes(dw3 >> 16, 2);
+    if(f->read_modes[READ_QUAD].dummy_bytes)
+      f->read_supported |= 1 << READ_QUAD;
+  }
+  // erase types with typical times, JESD216A and later
+  uint32_t dw10 = n >= 10 ? sfdp_dword(t, 10) : 0;
+  f->num_erase = 0;
+  for(int i = 0; i < 4 && n >= 9; i++)
+  {
+    uint32_t type = sfdp_dword(t, 8 + i / 2) >> (16 * (i % 2));
+    uint32_t time = dw10 >> (4 + 7 * i);
+    double typical_ms = ((time & 0x1F) + 1) * sfdp_erase_unit_ms[(time >> 5) & 3];
+    if((type & 0xFF) == 0 || (type & 0xFF) >= 32)
+      continue;
+    uint32_t size = 1u << (type & 0xFF);
+    if(dw10 == 0) // JESD216 without times, the usual ones
+      typical_ms = size <= 4*1024 ? 45.0 : size <= 32*1024 ? 120.0 : 150.0 * size / (64*1024);
+    sfdp_add_erase(f, size, type >> 8, typical_ms);
+  }
+  if((dw1 & 3) == 1) // 4K erase listed in DWORD 1 only
+    sfdp_add_erase(f, 4*1024, dw1 >> 8, default_erase[0].typical_ms);
+  if(n >= 11)
+  {
+    uint32_t dw11 = sfdp_dword(t, 11);
+    f->page_size = 1u << ((dw11 >> 4) & 0xF);
+    f->page_program_ms = (((dw11 >> 8) & 0x1F) + 1) * (dw11 & (1 << 13) ? 0.064 : 0.008);
+  }
+  if(n >= 15)
+  {
+    uint32_t qer = (sfdp_dword(t, 15) >> 20) & 7;
+    f->quad_enable = qer == 0 ? QE_NONE : qer == 2 ? QE_SR1_BIT6 : qer == 3 ? QE_SR2_BIT7 : QE_SR2_BIT1;
+  }
+  // 4-byte address entry methods, JESD216B and later
+  uint32_t enter4 = n >= 16 ? sfdp_dword(t, 16) >> 24 : 0;
+  f->addr4 = enter4 & 0x04 ? ADDR4_EAR : enter4 & 0x08 ? ADDR4_BANK : ADDR4_NONE;
+  if(((dw1 >> 17) & 3) == 2)
+  {
+    fprintf(stderr, "flash has 4-byte addresses only, gateware sends 3-byte addresses\n");
+    f->size = BANK_SIZE;
+  }
+}
+
+// read SFDP header and basic flash parameter table
+// return 0: found, -1: flash without SFDP or USB error
+static int sfdp_probe(struct fpgasp *sp, struct flash_info *f)
+{
+  uint8_t header[8 + 8 * SFDP_HEADERS_MAX], table[4 * SFDP_DWORDS_MAX];
+  if(sfdp_read(sp, 0, header, 8) < 0 || sfdp_dword(header, 1) != SFDP_SIGNATURE)
+    return -1;
+  int headers = header[6] + 1;
+  if(headers > SFDP_HEADERS_MAX)
+    headers = SFDP_HEADERS_MAX;
+  if(sfdp_read(sp, 8, header + 8, 8 * headers) < 0)
+    return -1;
+  // the basic table comes first, a longer later revision of it may follow
+  int best = -1;
+  for(int i = 0; i < headers; i++)
+  {
+    const uint8_t *h = header + 8 + 8 * i;
+    if(h[0] == 0x00 && h[7] == 0xFF && (best < 0 || h[3] > header[8 + 8 * best + 3]))
+      best = i;
+  }
+  if(best < 0)
+    return -1;
+  const uint8_t *h = header + 8 + 8 * best;
+  int n = h[3] < SFDP_DWORDS_MAX ? h[3] : SFDP_DWORDS_MAX;
+  uint32_t pointer = h[4] | (h[5] << 8) | (h[6] << 16);
+  if(n < 9 || sfdp_read(sp, pointer, table, 4 * n) < 0)
+    return -1;
+  sfdp_parse_basic(f, table, n);
+  f->sfdp = 1;
+  return 0;
+}
+
+static const char *addr4_names[] = {"none", "extended address register", "bank register"};
+
+// JEDEC ID and SFDP of the flash, once per session
+int flash_probe(struct fpgasp *sp)
+{
+  struct flash_info *f = sp->flash;
+  if(f->probed)
+    return 0;
+  flash_info_defaults(f);
+  if(flash_read_jedec_id(sp, f->jedec_id) < 0)
+    return -1;
+  // dual output read 0x3B is supported by all the listed vendors
+  if(f->jedec_id[0] == 0x9D || f->jedec_id[0] == 0xC2 || f->jedec_id[0] == 0xEF
+  || f->jedec_id[0] == 0x01 || f->jedec_id[0] == 0x20)
+    f->read_supported |= 1 << READ_DUAL;
+  sfdp_probe(sp, f); // without SFDP the defaults stay
+  f->probed = 1;
+  if(f->size > BANK_SIZE && f->addr4 == ADDR4_NONE)
+  {
+    fprintf(stderr, "flash of %u MB has no extended address register, using the first 16 MB\n", f->size >> 20);
+    f->size = BANK_SIZE;
+  }
+  f->bank = f->size > BANK_SIZE ? -1 : 0; // register may be left set by an earlier session
+  if(f->sfdp)
+  {
+    printf("FLASH SFDP: %u KB, page %u bytes, erase", f->size >> 10, f->page_size);
+    for(int i = 0; i < f->num_erase; i++)
+      printf(" %uK/%.0fms", f->erase[i].size >> 10, f->erase[i].typical_ms);
+    printf(", above 16 MB: %s\n", f->size > BANK_SIZE ? addr4_names[f->addr4] : "-");
+  }
+  return 0;
+}
+
+// select the 16 MB bank of addr, commands then use addr % BANK_SIZE
+static int flash_bank(struct fpgasp *sp, uint32_t addr)
+{
+  struct flash_info *f = sp->flash;
+  int bank = addr / BANK_SIZE;
+  if(bank == f->bank)
+    return 0;
+  if(addr >= f->size || f->addr4 == ADDR4_NONE)
+  {
+    fprintf(stderr, "address 0x%08X beyond flash size\n", addr);
+    return -1;
+  }
+  // pages still programmed by the gateware are in the old bank
+  if(!sp->usb_bulk && sp->gateware_version >= GATEWARE_PAGE_ENGINE && flash_write_wait(sp) < 0)
+    return -1;
+  uint8_t buf[2];
+  buf[0] = f->addr4 == ADDR4_EAR ? 0xC5 : 0x17;
+  buf[1] = bank;
+  if(f->addr4 == ADDR4_EAR && flash_write_enable(sp) < 0)
+    return -1;
+  if(txrx(sp, buf, sizeof(buf), NULL, 0) < 0)
+    return -1;
+  f->bank = bank;
+  return 0;
+}
+
+// index of the erase type with this size, -1: flash can't erase it
+static int flash_erase_type(struct fpgasp *sp, uint32_t size)
+{
+  for(int i = 0; i < sp->flash->num_erase; i++)
+    if(sp->flash->erase[i].size == size)
+      return i;
+  return -1;
+}
+
+
+// capability bits of the gateware, bit 0:fast 1:dual 2:quad
+// fast read is single bit, older gateware can do it too
+int gateware_read_capabilities(struct fpgasp *sp)
+{
+  uint8_t caps = 1;
+  if(sp->gateware_version < GATEWARE_READ_MODES)
+    return caps;
+  int rc = usb_queue_in(sp, 4, 0, 0, &caps, 1, 0);
+  if(usb_queue_flush(sp) < 0 || rc < 0)
+    return 1;
+  return caps;
+}
+
+// quad output read needs QE bit, which is at different place
+// for each vendor. It is only checked here, never changed.
+// SFDP tells where it is, else it is known for a few vendors.
+// return 1 if QE is set, 0 if not or unknown flash
+int flash_quad_enabled(struct fpgasp *sp)
+{
+  uint8_t buf[2];
+  uint8_t qe = sp->flash->quad_enable;
+  if(qe == QE_UNKNOWN)
+    switch(sp->flash->jedec_id[0])
+    {
+      case 0x9D: // ISSI
+      case 0xC2: // Macronix
+        qe = QE_SR1_BIT6;
+        break;
+      case 0xEF: // Winbond
+      case 0x01: // Spansion/Cypress
+        qe = QE_SR2_BIT1;
+        break;
+    }
+  switch(qe)
+  {
+    case QE_NONE:
+      return 1;
+    case QE_SR1_BIT6:
+      buf[0] = 0x05; // status register bit 6
+      if(txrx(sp, buf, sizeof(buf), buf, sizeof(buf)) < 0)
+        return 0;
+      return (buf[1] >> 6) & 1;
+    case QE_SR2_BIT1:
+      buf[0] = 0x35; // status register 2 (configuration) bit 1
+      if(txrx(sp, buf, sizeof(buf), buf, sizeof(buf)) < 0)
+        return 0;
+      return (buf[1] >> 1) & 1;
+    case QE_SR2_BIT7:
+      buf[0] = 0x3F; // status register 2 bit 7
+      if(txrx(sp, buf, sizeof(buf), buf, sizeof(buf)) < 0)
+        return 0;
+      return (buf[1] >> 7) & 1;
+  }
+  return 0;
+}
+
+// stream reads of the gateware send dummy clocks by opcode,
+// only the standard opcodes and dummy clocks can be used there
+static int read_mode_fits_gateware(struct fpgasp *sp, int mode)
+{
+  const struct read_mode *m = &sp->flash->read_modes[mode];
+  if(sp->usb_bulk || sp->gateware_version < GATEWARE_MULTI_PACKET)
+    return 1; // host sends the dummy bytes
+  return m->opcode == read_modes[mode].opcode && m->dummy_bytes == read_modes[mode].dummy_bytes;
+}
+
+// choose fastest mode supported by both gateware and flash
+// or the mode given by name
+int flash_select_read_mode(struct fpgasp *sp, const char *name)
+{
+  int caps = gateware_read_capabilities(sp);
+  int mode = READ_SLOW;
+  if(flash_probe(sp) < 0)
+    return -1;
+  struct flash_info *f = sp->flash;
+  if(strcmp(name, "auto") == 0)
+  {
+    for(int m = READ_FAST; m < READ_MODES; m++)
+      if((caps & (1 << (m - 1))) && (f->read_supported & (1 << m)) && read_mode_fits_gateware(sp, m)
+      && (m != READ_QUAD || flash_quad_enabled(sp)))
+        mode = m;
+  }
+  else
+  {
+    for(mode = 0; mode < READ_MODES; mode++)
+      if(strcmp(name, read_modes[mode].name) == 0)
+        break;
+    if(mode == READ_MODES)
+    {
+      fprintf(stderr, "unknown read mode %s\n", name);
+      return -1;
+    }
+    if(mode != READ_SLOW && ((caps & (1 << (mode - 1))) == 0 || !read_mode_fits_gateware(sp, mode)))
+    {
+      fprintf(stderr, "read mode %s not supported by bootloader\n", name);
+      return -1;
+    }
+  }
+  sp->flash_read_mode = &f->read_modes[mode];
+  printf("FLASH JEDEC ID: %02X %02X %02X, read mode %s (0x%02X)\n",
+    f->jedec_id[0], f->jedec_id[1], f->jedec_id[2], sp->flash_read_mode->name, sp->flash_read_mode->opcode);
+  return 0;
+}
+
+
+// read is pipelined: all OUT/IN packets are queued first and then flushed.
+// write to USB read command followed with dummy bytes
+// in order to read, we must first write command and the
+// contiue writing anything to SPI
+// every written byte will also result in reading a byte.
+// up to 32 read bytes are buffered inside of the USB device.
+// this USB buffer can be retrieved by subsequent IN command later.
+// control transfers on endpoint 0 are processed in order, so IN of
+// each packet is completed before the next OUT overwrites the buffer.
+// gateware from GATEWARE_MULTI_PACKET sends read command itself
+// and streams up to 4096 bytes in one IN transfer
+#define STREAM_READ 5
+
+int flash_read_stream(struct fpgasp *sp, uint8_t *data, uint32_t addr, uint32_t length)
+{
+  while(length > 0)
+  {
+    uint16_t request_size = length > USB_TRANSFER_MAX ? USB_TRANSFER_MAX : length;
+    // wValue: address[15:0], wIndex: read command, address[23:16]
+    uint16_t wValue = addr & 0xFFFF;
+    uint16_t wIndex = (sp->flash_read_mode->opcode << 8) | ((addr >> 16) & 0xFF);
+    if(usb_queue_in(sp, STREAM_READ, wValue, wIndex, data, request_size, 0) < 0)
+      break;
+    data += request_size;
+    addr += request_size;
+    length -= request_size;
+  }
+  return usb_queue_flush(sp); // 0 on success
+}
+
+// bulk read is single bit fast read 0x0B, USB is slower than SPI anyway
+int flash_read_bulk(struct fpgasp *sp, uint8_t *data, uint32_t addr, uint32_t length)
+{
+  uint8_t cmd[5];
+  while(length > 0)
+  {
+    uint32_t request_size = length > BULK_READ_MAX ? BULK_READ_MAX : length;
+    cmd_addr(cmd, 0x0B, addr);
+    cmd[4] = 0; // dummy byte
+    if(bulk_command_read(sp, cmd, sizeof(cmd), data, request_size) < 0)
+      return -1;
+    data += request_size;
+    addr += request_size;
+    length -= request_size;
+  }
+  return 0;
+}
+
+int flash_read(struct fpgasp *sp, uint8_t *data, uint32_t addr, uint32_t length)
+{
+  // a read across 16 MB banks is one read per bank
+  uint32_t bank_remaining = BANK_SIZE - addr % BANK_SIZE;
+  if(length > bank_remaining)
+  {
+    if(flash_read(sp, data, addr, bank_remaining) < 0)
+      return -1;
+    return flash_read(sp, data + bank_remaining, addr + bank_remaining, length - bank_remaining);
+  }
+  if(flash_bank(sp, addr) < 0)
+    return -1;
+  if(sp->usb_bulk)
+    return flash_read_bulk(sp, data, addr, length);
+  if(sp->gateware_version >= GATEWARE_MULTI_PACKET)
+    return flash_read_stream(sp, data, addr, length);
+  uint8_t buf[USB_PACKET_MAX]; // USB I/O buffer
+  uint32_t accumulated_read = 0; // accumulate total read
+  // initial payload starts after command, address and dummy bytes
+  uint32_t payload_start = 4 + sp->flash_read_mode->dummy_bytes;
+  uint8_t bRequest = 0; // currently no use
+  uint16_t wIndex = (sp->flash_read_mode->width << 6) | 4; // 4 single bit header bytes, then width
+  uint16_t wValue = length <= sizeof(buf)-payload_start ? 0 : 1; // wValue: 0-no continuation, 1-continuation
+
+  memset(buf, 0, sizeof(buf)); // dummy bytes
+  cmd_addr(buf, sp->flash_read_mode->opcode, addr);
+  
+  while(accumulated_read < length)
+  {
+    if(usb_queue_out(sp, bRequest, wValue, wIndex, buf, sizeof(buf)) < 0)
+      break;
+    // calculate next request length (how much to read from USB)
+    uint32_t request_size;
+    if(accumulated_read + sizeof(buf) - payload_start >= length)
+    {
+      // end packet, trim request size to how much we really need
+      request_size = length + payload_start - accumulated_read;
+      wValue = 0; // terminate continuation
+    }
+    else
+      request_size = sizeof(buf);
+    if(usb_queue_in(sp, bRequest, wValue, wIndex, data, request_size, payload_start) < 0)
+      break;
+    uint32_t response_size = request_size - payload_start;
+    data += response_size;
+    accumulated_read += response_size;
+    if(payload_start) // contination will result in full 32-byte payload
+    {
+      payload_start = 0;
+      wIndex &= ~0xF; // no header in continuation packets
+      memset(buf, 0, sizeof(buf)); // only dummy bytes follow
+    }
+  }
+  return usb_queue_flush(sp); // 0 on success
+}
+
+// only the erase sizes of the flash are possible
+int flash_erase_sector(struct fpgasp *sp, uint32_t addr, uint32_t len)
+{
+  int type = flash_erase_type(sp, len);
+  if(type < 0)
+    return -1; // unsupported length
+  if(flash_bank(sp, addr) < 0)
+    return -1;
+  flash_write_enable(sp);
+  uint8_t buf[4];
+  cmd_addr(buf, sp->flash->erase[type].opcode, addr);
+  int rc = txrx(sp, buf, sizeof(buf), NULL, 0);
+  if(rc < 0)
+    return -1; // error in txrx
+  return flash_wait_while_busy(sp, BUSY_ERASE, sp->flash->erase[type].typical_ms);
+}
+
+// write enable, page program and first status read
+// are frames of one bulk OUT transfer
+int flash_write_bulk(struct fpgasp *sp, uint8_t *data, uint32_t addr, uint32_t length)
+{
+  uint8_t buf[3 * BULK_FRAME_HEADER + 1 + 4 + USB_TRANSFER_MAX + 1];
+  uint8_t status = 1;
+  if(length > USB_TRANSFER_MAX)
+    return -1;
+  uint8_t *p = bulk_frame(buf, 1, 0);
+  *p++ = 0x06; // write enable
+  p = bulk_frame(p, 4 + length, 0);
+  cmd_addr(p, 0x02, addr); // FLASH write (should be previous erased to 0xFF)
+  memcpy(p + 4, data, length);
+  p += 4 + length;
+  double time_start = 0.0; // flash is busy after the first transfer
+  while(status & 1)
+  {
+    p = bulk_frame(p, 1, 1);
+    *p++ = 0x05; // read status
+    if(bulk_transfer(sp, sp->bulk_ep_out, buf, p - buf) < 0)
+      return -1;
+    if(bulk_transfer(sp, sp->bulk_ep_in, &status, 1) < 0)
+      return -1;
+    if(time_start == 0.0)
+      time_start = time_now();
+    sp->stats->busy_polls[BUSY_PROGRAM]++;
+    p = buf;
+  }
+  sp->stats->busy_seconds[BUSY_PROGRAM] += time_now() - time_start;
+  return 0;
+}
+
+// **** compressed page program ****
+// gateware from GATEWARE_RLE_WRITE expands RLE coded SPI OUT data.
+// Token byte: bit 7=0: run length literal bytes follow,
+// bit 7=1: the next byte is sent run length times,
+// run length is token bits 6-0 plus 1 (1-128)
+#define RLE_WRITE 7
+#define RLE_RUN_MAX 128
+#define RLE_REPEAT_MIN 3 // shorter runs are cheaper as literals
+
+// returns coded length, 0 if it would not be shorter than max
+uint32_t rle_encode(const uint8_t *src, uint32_t length, uint8_t *dst, uint32_t max)
+{
+  uint32_t i = 0, n = 0;
+  while(i < length)
+  {
+    uint32_t run = 1;
+    while(i + run < length && run < RLE_RUN_MAX && src[i + run] == src[i])
+      run++;
+    if(run >= RLE_REPEAT_MIN)
+    {
+      if(n + 2 > max)
+        return 0;
+      dst[n++] = 0x80 | (run - 1);
+      dst[n++] = src[i];
+      i += run;
+      continue;
+    }
+    // literal run ends where a repeat is worth a token
+    uint32_t literal = 1;
+    while(i + literal < length && literal < RLE_RUN_MAX)
+    {
+      const uint8_t *p = src + i + literal;
+      if(i + literal + RLE_REPEAT_MIN <= length && p[1] == p[0] && p[2] == p[0])
+        break;
+      literal++;
+    }
+    if(n + 1 + literal > max)
+      return 0;
+    dst[n++] = literal - 1;
+    memcpy(dst + n, src + i, literal);
+    n += literal;
+    i += literal;
+  }
+  return n < max ? n : 0;
+}
+
+// command, address and page data in one RLE coded transfer if it is shorter
+static int flash_write_rle(struct fpgasp *sp, uint8_t *data, uint32_t addr, uint32_t length)
+{
+  uint8_t raw[4 + USB_TRANSFER_MAX], coded[USB_TRANSFER_MAX];
+  uint8_t write_enable[1] = {0x06};
+  if(4 + length > USB_TRANSFER_MAX)
+    return -1;
+  cmd_addr(raw, 0x02, addr);
+  memcpy(raw + 4, data, length);
+  uint32_t coded_length = rle_encode(raw, 4 + length, coded, 4 + length);
+  // programming the same data again is harmless, so a failed page is repeated
+  for(int i = 0; i <= TXRX_RETRY; i++)
+  {
+    if(i)
+      sp->stats->retries_packet++;
+    int rc = usb_queue_out(sp, 0, 0, 0, write_enable, sizeof(write_enable));
+    if(rc == 0 && coded_length)
+      rc = usb_queue_out(sp, RLE_WRITE, 0, 4 + length, coded, coded_length);
+    else if(rc == 0)
+      rc = usb_queue_out(sp, 0, 0, 0, raw, 4 + length); // incompressible, raw
+    sp->write_raw_bytes += 4 + length;
+    sp->write_usb_bytes += coded_length ? coded_length : 4 + length;
+    if(usb_queue_flush(sp) == 0 && rc == 0)
+      return flash_wait_while_busy(sp, BUSY_PROGRAM, sp->flash->page_program_ms);
+  }
+  return -1;
+}
+
+// **** page program engine ****
+// gateware from GATEWARE_PAGE_ENGINE has two page buffers. It sends
+// write enable, page program and polls WIP itself while USB fills
+// the other buffer, the data stage is NAKed while both are busy.
+// OUT wValue: address[23:8], wIndex[7:0]: address[7:0], wIndex[15]: RLE coded.
+// IN 1 byte: bit 0 busy, bit 1 error since the last IN
+// gateware from GATEWARE_PAGE_SEQUENCE numbers pages: OUT wIndex[14] set,
+// wIndex[13:8] sequence number, only the next number is accepted.
+// IN 2nd byte is the next number, so after a failed transfer only
+// the pages which did not arrive are sent again.
+#define PAGE_PROGRAM 8
+#define PAGE_PROGRAM_RLE 0x8000
+#define PAGE_PROGRAM_SEQ 0x4000
+#define PAGE_PROGRAM_MAX 256 // gateware page buffer
+#define PAGE_SEQ_MASK 0x3F
+#define PAGE_SEQ_WINDOW 32 // pages in flight, less than half of the sequence numbers
+#define PAGE_RETRY 8
+
+// page data stays in the caller's buffer until gateware confirms it
+struct page_record
+{
+  uint8_t *data;
+  uint32_t addr, length;
+};
+
+static int page_submit(struct fpgasp *sp, uint8_t *data, uint32_t addr, uint32_t length, uint8_t seq)
+{
+  uint8_t coded[PAGE_PROGRAM_MAX];
+  uint16_t wIndex = addr & 0xFF;
+  if(sp->gateware_version >= GATEWARE_PAGE_SEQUENCE)
+    wIndex |= PAGE_PROGRAM_SEQ | (seq & PAGE_SEQ_MASK) << 8;
+  uint32_t coded_length = rle_encode(data, length, coded, length);
+  sp->write_raw_bytes += length;
+  sp->write_usb_bytes += coded_length ? coded_length : length;
+  if(coded_length)
+    return usb_queue_out(sp, PAGE_PROGRAM, (addr >> 8) & 0xFFFF, PAGE_PROGRAM_RLE | wIndex, coded, coded_length);
+  return usb_queue_out(sp, PAGE_PROGRAM, (addr >> 8) & 0xFFFF, wIndex, data, length);
+}
+
+// busy/error and the next sequence number, status read is repeated if it fails
+static int page_status(struct fpgasp *sp, uint8_t *status)
+{
+  uint16_t length = sp->gateware_version >= GATEWARE_PAGE_SEQUENCE ? 2 : 1;
+  for(int i = 0; i < PAGE_RETRY; i++)
+  {
+    int rc = usb_queue_in(sp, PAGE_PROGRAM, 0, 0, status, length, 0);
+    if(usb_queue_flush(sp) == 0 && rc == 0)
+      return 0;
+  }
+  return -1;
+}
+
+// queue one page, no waiting for the flash.
+// a failed transfer is sent again by flash_write_wait()
+static int flash_write_queued(struct fpgasp *sp, uint8_t *data, uint32_t addr, uint32_t length)
+{
+  uint8_t status[2];
+  if(length == 0 || (addr & 0xFF) + length > PAGE_PROGRAM_MAX)
+    return -1;
+  if(flash_bank(sp, addr) < 0)
+    return -1;
+  if(sp->gateware_version >= GATEWARE_PAGE_SEQUENCE && !sp->page_seq_known)
+  {
+    if(page_status(sp, status) < 0)
+      return -1;
+    sp->page_seq = status[1];
+    sp->page_seq_known = 1;
+  }
+  if(sp->page_pending == PAGE_SEQ_WINDOW && flash_write_wait(sp) < 0)
+    return -1;
+  struct page_record *page = &sp->page_sent[sp->page_pending];
+  page->data = data;
+  page->addr = addr;
+  page->length = length;
+  uint8_t seq = sp->page_seq + sp->page_pending;
+  sp->page_pending++;
+  if(page_submit(sp, data, addr, length, seq) < 0)
+    return flash_write_wait(sp); // sends again what did not arrive
+  return 0;
+}
+
+// remove confirmed pages, gateware expects sequence number next_seq.
+// returns how many pages must be sent again, -1 if the number is not
+// one of the pending pages
+static int page_confirm(struct fpgasp *sp, uint8_t next_seq)
+{
+  int accepted = (next_seq - sp->page_seq) & PAGE_SEQ_MASK;
+  if(accepted > sp->page_pending)
+  {
+    fprintf(stderr, "page sequence %d, expected %d-%d\n", next_seq,
+      sp->page_seq, (sp->page_seq + sp->page_pending) & PAGE_SEQ_MASK);
+    return -1;
+  }
+  sp->page_pending -= accepted;
+  sp->page_seq = next_seq;
+  memmove(sp->page_sent, sp->page_sent + accepted, sp->page_pending * sizeof(sp->page_sent[0]));
+  return sp->page_pending;
+}
+
+// without sequence numbers: send one page again until its flush confirms it
+static int page_resend(struct fpgasp *sp, struct page_record *page)
+{
+  for(int i = 0; i < PAGE_RETRY; i++)
+  {
+    sp->stats->retries_packet++;
+    int rc = page_submit(sp, page->data, page->addr, page->length, 0);
+    if(usb_queue_flush(sp) == 0 && rc == 0)
+      return 0;
+  }
+  return -1;
+}
+
+// one status query after all queued pages, repeated only while
+// gateware still programs the last page
+// pages which did not arrive are sent again. Without sequence numbers
+// it is unknown which queued transfer failed, so all pages since the
+// last wait are sent again one by one, programming the same data twice
+// is harmless.
+static int flash_write_wait(struct fpgasp *sp)
+{
+  uint8_t status[2];
+  int resend = 0, retries = 0, rc = 0;
+  int sequence = sp->gateware_version >= GATEWARE_PAGE_SEQUENCE;
+  double time_start = time_now();
+  do
+  {
+    int lost = usb_queue_flush(sp) < 0; // a queued page may not have arrived
+    sp->stats->busy_polls[BUSY_PROGRAM]++;
+    if(page_status(sp, status) < 0)
+    {
+      rc = -1;
+      break;
+    }
+    if(status[0] & 2)
+    {
+      fprintf(stderr, "page program did not start, flash write protected?\n");
+      rc = -1;
+      break;
+    }
+    if(sequence && sp->page_seq_known)
+      resend = page_confirm(sp, status[1]);
+    for(int i = 0; !sequence && lost && i < sp->page_pending && rc == 0; i++)
+      rc = page_resend(sp, &sp->page_sent[i]);
+    if(rc < 0)
+    {
+      fprintf(stderr, "page program: %d pages not confirmed\n", sp->page_pending);
+      break;
+    }
+    if(resend < 0 || (resend > 0 && retries++ == PAGE_RETRY))
+    {
+      fprintf(stderr, "page program: %d pages not confirmed\n", sp->page_pending);
+      rc = -1;
+      break;
+    }
+    for(int i = 0; i < resend; i++)
+    {
+      struct page_record *page = &sp->page_sent[i];
+      sp->stats->retries_packet++;
+      if(page_submit(sp, page->data, page->addr, page->length, sp->page_seq + i) < 0)
+      { // later pages would be out of sequence, next status tells where to go on
+        usb_queue_flush(sp);
+        break;
+      }
+    }
+  } while((status[0] & 1) || resend > 0);
+  sp->stats->busy_seconds[BUSY_PROGRAM] += time_now() - time_start;
+  if(!sequence)
+    sp->page_pending = 0; // confirmed by a flush or given up
+  if(rc < 0)
+  { // next page starts again from the gateware's number
+    sp->page_pending = 0;
+    sp->page_seq_known = 0;
+    return -1;
+  }
+  return 0;
+}
+
+// write enable and all page program packets are queued,
+// flushed and then flash status is polled until write completes.
+// with GATEWARE_MULTI_PACKET a page is programmed by a single transfer.
+int flash_write(struct fpgasp *sp, uint8_t *data, uint32_t addr, uint32_t length)
+{
+  if(flash_bank(sp, addr) < 0)
+    return -1;
+  if(sp->usb_bulk)
+    return flash_write_bulk(sp, data, addr, length);
+  if(sp->gateware_version >= GATEWARE_RLE_WRITE)
+    return flash_write_rle(sp, data, addr, length);
+  uint8_t buf[USB_TRANSFER_MAX]; // USB I/O buffer
+  uint32_t packet_size = sp->gateware_version < GATEWARE_MULTI_PACKET ? USB_PACKET_MAX : sizeof(buf);
+  uint32_t accumulated_write = 0; // accumulate total read
+  uint32_t payload_start = 4; // initial payload starts at byte 4 without continuation
+  uint8_t bRequest = 0; // currently no use
+  uint16_t wIndex = 0; // currently no use
+  uint16_t wValue = length <= packet_size-payload_start ? 0 : 1; // wValue: 0-no continuation, 1-continuation
+  uint8_t write_enable[1] = {0x06};
+
+  if(usb_queue_out(sp, bRequest, 0, wIndex, write_enable, sizeof(write_enable)) < 0)
+  {
+    usb_queue_flush(sp);
+    return -1;
+  }
+
+  cmd_addr(buf, 0x02, addr); // FLASH write (should be previous erased to 0xFF)
+  while(accumulated_write < length)
+  {
+    // calculate next request length (how much to read from USB)
+    uint32_t request_size;
+    if(accumulated_write + packet_size - payload_start >= length)
+    {
+      // end packet, trim request size to how much we really need
+      request_size = length + payload_start - accumulated_write;
+      wValue = 0; // terminate continuation
+    }
+    else
+      request_size = packet_size;
+    uint32_t payload_size = request_size - payload_start;
+    memcpy(buf+payload_start, data, payload_size);
+
+    // write to USB the flash write command followed with data
+    if(usb_queue_out(sp, bRequest, wValue, wIndex, buf, request_size) < 0)
+      break;
+
+    data += payload_size;
+    accumulated_write += payload_size;
+    if(payload_start) // contination will result in full 32-byte payload
+      payload_start = 0;
+  }
+  if(usb_queue_flush(sp) < 0)
+    return -1;
+  return flash_wait_while_busy(sp, BUSY_PROGRAM, sp->flash->page_program_ms); // 0 on success
+}
+
+
+// 64-bit unique ID as hex, command 0x4B with 4 dummy bytes
+// (Winbond, ISSI, Spansion). empty string if it can't be read.
+int flash_read_uid(struct fpgasp *sp, char *hex)
+{
+  uint8_t buf[5 + 8];
+  memset(buf, 0, sizeof(buf));
+  buf[0] = 0x4B;
+  hex[0] = '\0';
+  if(txrx(sp, buf, sizeof(buf), buf, sizeof(buf)) < 0)
+    return -1;
+  for(int i = 0; i < 8; i++)
+    sprintf(hex + 2 * i, "%02X", buf[5 + i]);
+  return 0;
+}
+
+
+// **** gateware flash scan ****
+// gateware reads flash range itself and returns only 4 bytes:
+// CRC32 of the data or the first address which is not 0xFF.
+// range is given in 256-byte pages.
+#define SCAN_CRC32 2
+#define SCAN_BLANK 3
+#define SCAN_PAGE 256
+
+static uint32_t crc32_table[256];
+
+// zlib compatible CRC32, start with crc = 0
+uint32_t crc32(uint32_t crc, const uint8_t *data, uint32_t length)
+{
+  if(crc32_table[1] == 0)
+  {
+    for(uint32_t i = 0; i < 256; i++)
+    {
+      uint32_t c = i;
+      for(int j = 0; j < 8; j++)
+        c = c & 1 ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+      crc32_table[i] = c;
+    }
+  }
+  crc = ~crc;
+  while(length--)
+    crc = crc32_table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+// start scan and poll until gateware finishes
+// return value 0: ok, result is written, -1: error
+int flash_scan(struct fpgasp *sp, uint8_t bRequest, uint32_t addr, uint32_t length, uint32_t *result)
+{
+  uint8_t buf[5]; // busy, 32-bit result LSB first
+  if(sp->gateware_version < GATEWARE_FLASH_SCAN)
+    return -1; // not supported by bitstream
+  if(addr % SCAN_PAGE != 0 || length % SCAN_PAGE != 0 || length / SCAN_PAGE > 0xFFFF)
+    return -1;
+  if(addr % BANK_SIZE + length > BANK_SIZE || flash_bank(sp, addr) < 0)
+    return -1; // range in one 16 MB bank
+  int rc = usb_queue_out(sp, bRequest, addr % BANK_SIZE / SCAN_PAGE, length / SCAN_PAGE, buf, 0); // no data stage
+  do
+  {
+    if(rc == 0)
+      rc = usb_queue_in(sp, bRequest, 0, 0, buf, sizeof(buf), 0);
+    if(usb_queue_flush(sp) < 0 || rc < 0)
+    {
+      fprintf(stderr, "flash scan failed\n");
+      return -1;
+    }
+  } while(buf[0] & 1);
+  *result = buf[1] | (buf[2] << 8) | (buf[3] << 16) | ((uint32_t)buf[4] << 24);
+  return 0;
+}
+
+// 1 if flash content CRC32 equals CRC32 of data, 0 if different, -1: error
+int flash_crc32_match(struct fpgasp *sp, const uint8_t *data, uint32_t addr, uint32_t length)
+{
+  uint32_t flash_crc;
+  if(flash_scan(sp, SCAN_CRC32, addr, length, &flash_crc) < 0)
+    return -1;
+  return flash_crc == crc32(0, data, length);
+}
+
+// 1 if all flash bytes in range are 0xFF, 0 if not, -1: error
+int flash_is_blank(struct fpgasp *sp, uint32_t addr, uint32_t length)
+{
+  uint32_t first_nonblank;
+  if(flash_scan(sp, SCAN_BLANK, addr, length, &first_nonblank) < 0)
+    return -1;
+  return first_nonblank == 0xFFFFFFFF;
+}
+
+
+// **** checked stream read ****
+// gateware from GATEWARE_CHECKED_READ ends each stream data stage
+// with CRC32 of its data. The first request sends read command and
+// address, the next ones continue the same SPI read with chip select
+// held low (wValue bit 0 like SPI continuation), so the whole range
+// is read in one pass. Only chunks with CRC32 error are read again.
+#define CHECKED_READ 6
+#define CHECKED_READ_CRC 4 // CRC32 LSB first after the data
+#define CHECKED_READ_DATA (USB_TRANSFER_MAX - CHECKED_READ_CRC)
+#define CHECKED_READ_WINDOW 64 // chunks in memory before they are checked and written
+
+// start: send read command with addr, else continue the open read
+// keep: hold chip select low after the data
+static int checked_read_queue(struct fpgasp *sp, uint8_t *buf, uint32_t addr, uint32_t size, int start, int keep)
+{
+  uint16_t wValue = start ? addr & 0xFFFF : keep;
+  uint16_t wIndex = start ? (sp->flash_read_mode->opcode << 8) | ((addr >> 16) & 0xFF) : 0;
+  return usb_queue_in(sp, CHECKED_READ, wValue, wIndex, buf, size + CHECKED_READ_CRC, 0);
+}
+
+// request without data releases chip select, returns only CRC32 0
+static int checked_read_close(struct fpgasp *sp)
+{
+  uint8_t crc[CHECKED_READ_CRC];
+  int rc = checked_read_queue(sp, crc, 0, 0, 0, 0);
+  return usb_queue_flush(sp) < 0 ? -1 : rc;
+}
+
+static int checked_read_crc_ok(const uint8_t *buf, uint32_t size)
+{
+  const uint8_t *c = buf + size;
+  uint32_t crc = c[0] | (c[1] << 8) | (c[2] << 16) | ((uint32_t)c[3] << 24);
+  return crc == crc32(0, buf, size);
+}
+
+// read range to the file at file_offset, failed chunks are read again up to "retry" times
+// range must be in one 16 MB bank
+int flash_read_checked_file(struct fpgasp *sp, int file_descriptor, uint32_t addr, uint32_t length, uint32_t file_offset, int retry)
+{
+  uint32_t chunks = (length + CHECKED_READ_DATA - 1) / CHECKED_READ_DATA;
+  uint8_t *buf = (uint8_t *)malloc(CHECKED_READ_WINDOW * USB_TRANSFER_MAX);
+  uint32_t *failed = (uint32_t *)malloc((chunks + 1) * sizeof(uint32_t)); // chunk index
+  uint32_t num_failed = 0;
+  int stream_open = 0; // chip select held low by the read
+  int rc = 0;
+  for(uint32_t first = 0; first < chunks; first += CHECKED_READ_WINDOW)
+  {
+    uint32_t n = chunks - first < CHECKED_READ_WINDOW ? chunks - first : CHECKED_READ_WINDOW;
+    uint32_t queued;
+    for(queued = 0; queued < n; queued++)
+    {
+      uint32_t offset = (first + queued) * CHECKED_READ_DATA;
+      uint32_t size = length - offset < CHECKED_READ_DATA ? length - offset : CHECKED_READ_DATA;
+      if(checked_read_queue(sp, buf + queued * USB_TRANSFER_MAX, addr + offset, size, !stream_open, 1) < 0)
+        break;
+      stream_open = 1;
+    }
+    int usb_ok = usb_queue_flush(sp) == 0 && queued == n;
+    if(!usb_ok)
+      stream_open = 0; // next request starts a new read, gateware releases chip select first
+    for(uint32_t i = 0; i < n; i++)
+    {
+      uint32_t offset = (first + i) * CHECKED_READ_DATA;
+      uint32_t size = length - offset < CHECKED_READ_DATA ? length - offset : CHECKED_READ_DATA;
+      uint8_t *data = buf + i * USB_TRANSFER_MAX;
+      if(usb_ok && checked_read_crc_ok(data, size))
+        pwrite(file_descriptor, data, size, file_offset + offset);
+      else
+        failed[num_failed++] = first + i;
+    }
+    progress(sp, (first + n) * CHECKED_READ_DATA < length ? (first + n) * CHECKED_READ_DATA : length, length);
+  }
+  checked_read_close(sp); // harmless if already released after USB error
+  for(uint32_t k = 0; k < num_failed && rc == 0; k++)
+  {
+    uint32_t offset = failed[k] * CHECKED_READ_DATA;
+    uint32_t size = length - offset < CHECKED_READ_DATA ? length - offset : CHECKED_READ_DATA;
+    int i;
+    for(i = 0; i < retry; i++)
+    {
+      checked_read_queue(sp, buf, addr + offset, size, 1, 1);
+      if(checked_read_close(sp) == 0 && checked_read_crc_ok(buf, size))
+        break;
+    }
+    if(i == retry)
+    {
+      fprintf(stderr, "\nfailure at 0x%06X after %d retries\n", addr + offset, retry);
+      rc = -1;
+    }
+    else
+      pwrite(file_descriptor, buf, size, file_offset + offset);
+  }
+  if(num_failed)
+    printf("read again %u chunks after CRC32 error\n", num_failed);
+  sp->stats->retries_read += num_failed;
+  free(failed);
+  free(buf);
+  return rc;
+}
+
+// read from addr, length bytes and write to file
+int read_flash_write_file(struct fpgasp *sp, const char *filename, uint32_t addr, uint32_t length)
+{
+  if(!sp->usb_bulk && sp->gateware_version >= GATEWARE_CHECKED_READ)
+  {
+    int file_descriptor = open(filename, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+    if(file_descriptor < 0)
+    {
+      perror(filename);
+      return -1;
+    }
+    double time_start = time_now();
+    int rc = 0;
+    for(uint32_t offset = 0; offset < length && rc == 0; )
+    { // one checked read per 16 MB bank
+      uint32_t size = BANK_SIZE - (addr + offset) % BANK_SIZE;
+      if(size > length - offset)
+        size = length - offset;
+      rc = flash_bank(sp, addr + offset);
+      if(rc == 0)
+        rc = flash_read_checked_file(sp, file_descriptor, addr + offset, size, offset, 1000);
+      offset += size;
+    }
+    fprintf(stderr, "\n");
+    close(file_descriptor);
+    sp->stats->phase_seconds[PHASE_READ] += time_now() - time_start;
+    if(rc == 0)
+      print_throughput(sp, "read", length, time_now() - time_start);
+    return rc;
+  }
+  // printf("reading\n");
+  // synchronous: not much speed improvement in increasing this
+  // async: larger chunks keep more transfers in flight
+  const int bufsize = sp->usb_bulk ? BULK_READ_MAX : sp->usb_queue_depth || sp->gateware_version >= GATEWARE_MULTI_PACKET ? 4096 : 28;
+  uint8_t *buf[2]; // 2 buffers, both must match
+  uint32_t accumulated_read = 0;
+  int file_descriptor = open(filename, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+  const int retry = 1000;
+  uint32_t next_progress = 0, progress_step = length / 100;
+  buf[0] = (uint8_t *)malloc(2 * bufsize);
+  buf[1] = buf[0] + bufsize;
+  double time_start = time_now();
+  while(accumulated_read < length)
+  {
+    int match; // repeat reading until 2 subsequent readings match
+    int ib = 0; // buffer index 0/1 to match
+    uint32_t requested_size = accumulated_read + bufsize >= length ? length - accumulated_read : bufsize;
+    match = 0;
+    const int match_required = 2;
+    // printf("accumulated_read %d\n", accumulated_read);
+    for(int i = 0; i < retry && match < match_required; i++)
+    {
+      buf[ib][0] = ~buf[ib^1][0]; // damage first byte for the match to initially fail unless read correct
+      buf[ib][requested_size-1] = ~buf[ib^1][requested_size-1]; // damage first byte for the match to initially fail unless read correct
+      int rc = flash_read(sp, buf[ib], addr, requested_size);
+      if(rc == 0 && memcmp(buf[ib], buf[ib^1], requested_size) == 0)
+        match++;
+      else
+      {
+        match = 0;
+        if(i > 0)
+        {
+          printf("read verify error %d\n", i);
+          sp->stats->retries_read++;
+        }
+      }
+      ib ^= 1; // switch buffer
+    }
+    if(match < match_required)
+    {
+      fprintf(stderr, "failure after %d retries\n", retry);
+      free(buf[0]);
+      return -1;
+    }
+    write(file_descriptor, buf[0], requested_size);
+    accumulated_read += requested_size;
+    addr += requested_size;
+    if(accumulated_read > next_progress)
+    {
+      progress(sp, accumulated_read, length);
+      next_progress += progress_step;
+    }
+  }
+  progress(sp, accumulated_read, length);
+  fprintf(stderr, "\n");
+  close(file_descriptor);
+  free(buf[0]);
+  sp->stats->phase_seconds[PHASE_READ] += time_now() - time_start;
+  print_throughput(sp, "read", accumulated_read, time_now() - time_start);
+  return 0;
+}
+
+
+// **** image files ****
+// files are mmap'd, not read. Raw binary (.bin, .bit, anything else)
+// is one segment at offset 0. Intel HEX (.hex starting with ':') and
+// Lattice .mcs are parsed into segments at their record addresses,
+// .mcs bytes are bit mirrored (ECP5 Diamond output, like tinyprog).
+// .hex without ':' is whitespace separated hex bytes, as tinyprog reads it.
+// offsets are relative to the region address, the region is written
+// up to the end of the last segment and gaps are 0xFF.
+
+struct image_segment
+{
+  uint32_t offset, length;
+  const uint8_t *data;
+};
+
+struct image
+{
+  uint8_t *map; // mmap'd file
+  size_t map_size;
+  uint8_t *decoded; // data of parsed formats, segments point into it
+  struct image_segment *segment; // ascending offset
+  int num_segment, max_segment;
+  uint32_t length; // end of the last segment
+};
+
+static uint8_t bit_mirror[256];
+
+static void bit_mirror_init(void)
+{
+  for(int i = 0; i < 256; i++)
+  {
+    uint8_t m = 0;
+    for(int b = 0; b < 8; b++)
+      m |= ((i >> b) & 1) << (7 - b);
+    bit_mirror[i] = m;
+  }
+}
+
+static int hex_nibble(uint8_t c)
+{
+  if(c >= '0' && c <= '9')
+    return c - '0';
+  if(c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  if(c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+// two hex digits, -1 if not hex or past the end
+static int hex_byte(const uint8_t *p, const uint8_t *end)
+{
+  if(p + 2 > end)
+    return -1;
+  int hi = hex_nibble(p[0]), lo = hex_nibble(p[1]);
+  return hi < 0 || lo < 0 ? -1 : hi << 4 | lo;
+}
+
+static int image_add_segment(struct image *img, uint32_t offset, const uint8_t *data, uint32_t length)
+{
+  struct image_segment *last = img->num_segment ? &img->segment[img->num_segment - 1] : NULL;
+  if(last && last->offset + last->length == offset && last->data + last->length == data)
+  { // next record continues the segment
+    last->length += length;
+    return 0;
+  }
+  if(img->num_segment == img->max_segment)
+  {
+    int max = img->max_segment ? 2 * img->max_segment : 16;
+    struct image_segment *s = (struct image_segment *)realloc(img->segment, max * sizeof(*s));
+    if(s == NULL)
+      return -1;
+    img->segment = s;
+    img->max_segment = max;
+  }
+  img->segment[img->num_segment].offset = offset;
+  img->segment[img->num_segment].data = data;
+  img->segment[img->num_segment].length = length;
+  img->num_segment++;
+  return 0;
+}
+
+static int segment_compare(const void *a, const void *b)
+{
+  const struct image_segment *sa = (const struct image_segment *)a;
+  const struct image_segment *sb = (const struct image_segment *)b;
+  return sa->offset < sb->offset ? -1 : sa->offset > sb->offset;
+}
+
+// Intel HEX records: data 00, end 01, segment base 02, linear base 04
+static int image_parse_intel_hex(struct image *img, const char *filename, int mirror)
+{
+  const uint8_t *p = img->map, *end = img->map + img->map_size;
+  uint8_t *out = img->decoded;
+  uint32_t base = 0;
+  int line = 0;
+  while(p < end)
+  {
+    if(*p == '\n')
+      line++;
+    if(*p != ':')
+    {
+      if(*p > ' ')
+        break; // garbage between records
+      p++;
+      continue;
+    }
+    p++;
+    int count = hex_byte(p, end);
+    if(count < 0 || p + 10 + 2 * count > end)
+      break;
+    uint8_t record[4 + 255 + 1]; // count, address, type, data, checksum
+    uint8_t sum = 0;
+    int i;
+    for(i = 0; i < 5 + count; i++)
+    {
+      int b = hex_byte(p + 2 * i, end);
+      if(b < 0)
+        break;
+      record[i] = b;
+      sum += b;
+    }
+    if(i < 5 + count || sum != 0)
+    {
+      fprintf(stderr, "%s:%d: bad Intel HEX record\n", filename, line + 1);
+      return -1;
+    }
+    p += 2 * i;
+    uint32_t addr = record[1] << 8 | record[2];
+    switch(record[3])
+    {
+      case 0x00:
+        for(int k = 0; k < count; k++)
+          out[k] = mirror ? bit_mirror[record[4 + k]] : record[4 + k];
+        if(image_add_segment(img, base + addr, out, count) < 0)
+          return -1;
+        out += count;
+        break;
+      case 0x01:
+        p = end;
+        break;
+      case 0x02:
+        base = (record[4] << 8 | record[5]) << 4;
+        break;
+      case 0x04:
+        base = (uint32_t)(record[4] << 8 | record[5]) << 16;
+        break;
+    } // 03, 05: start address, not used
+  }
+  if(p < end)
+  {
+    fprintf(stderr, "%s:%d: not an Intel HEX record\n", filename, line + 1);
+    return -1;
+  }
+  return 0;
+}
+
+// whitespace separated hex bytes
+static int image_parse_hex_dump(struct image *img, const char *filename)
+{
+  const uint8_t *p = img->map, *end = img->map + img->map_size;
+  uint8_t *out = img->decoded;
+  while(p < end)
+  {
+    if(*p <= ' ')
+    {
+      p++;
+      continue;
+    }
+    int value = 0, digits = 0;
+    for(; p < end && *p > ' '; p++, digits++)
+    {
+      int n = hex_nibble(*p);
+      if(n < 0 || digits == 2)
+      {
+        fprintf(stderr, "%s: bad hex byte at offset %ld\n", filename, (long)(p - img->map));
+        return -1;
+      }
+      value = value << 4 | n;
+    }
+    *out++ = value;
+  }
+  return image_add_segment(img, 0, img->decoded, out - img->decoded);
+}
+
+static void image_close(struct image *img)
+{
+  if(img->map)
+    munmap(img->map, img->map_size);
+  free(img->decoded);
+  free(img->segment);
+  memset(img, 0, sizeof(*img));
+}
+
+// map the file and find its segments
+static int image_open(struct image *img, const char *filename)
+{
+  memset(img, 0, sizeof(*img));
+  int file_descriptor = open(filename, O_RDONLY);
+  struct stat st;
+  if(file_descriptor < 0 || fstat(file_descriptor, &st) < 0)
+  {
+    perror(filename);
+    if(file_descriptor >= 0)
+      close(file_descriptor);
+    return -1;
+  }
+  img->map_size = st.st_size;
+  if(img->map_size)
+    img->map = (uint8_t *)mmap(NULL, img->map_size, PROT_READ, MAP_PRIVATE, file_descriptor, 0);
+  close(file_descriptor);
+  if(img->map == MAP_FAILED)
+  {
+    perror(filename);
+    img->map = NULL;
+    return -1;
+  }
+  if(img->map_size == 0)
+    return 0; // nothing to write
+  const char *ext = strrchr(filename, '.');
+  int mcs = ext && strcasecmp(ext, ".mcs") == 0;
+  int hex = ext && strcasecmp(ext, ".hex") == 0;
+  if(!mcs && !hex)
+  {
+    madvise(img->map, img->map_size, MADV_SEQUENTIAL);
+    image_add_segment(img, 0, img->map, img->map_size);
+  }
+  else
+  {
+    int rc;
+    img->decoded = (uint8_t *)malloc(img->map_size / 2 + 1);
+    if(img->decoded == NULL)
+      rc = -1;
+    else if(mcs || img->map[0] == ':')
+    {
+      if(bit_mirror[1] == 0)
+        bit_mirror_init();
+      rc = image_parse_intel_hex(img, filename, mcs);
+    }
+    else
+      rc = image_parse_hex_dump(img, filename);
+    if(rc < 0)
+    {
+      image_close(img);
+      return -1;
+    }
+    qsort(img->segment, img->num_segment, sizeof(img->segment[0]), segment_compare);
+    for(int i = 0; i + 1 < img->num_segment; i++)
+      if(img->segment[i].offset + img->segment[i].length > img->segment[i+1].offset)
+      {
+        fprintf(stderr, "%s: records overlap at 0x%06X\n", filename, img->segment[i+1].offset);
+        image_close(img);
+        return -1;
+      }
+    uint32_t bytes = 0;
+    for(int i = 0; i < img->num_segment; i++)
+      bytes += img->segment[i].length;
+    printf("%s: %d segments, %u data bytes\n", filename, img->num_segment, bytes);
+  }
+  if(img->num_segment)
+  {
+    struct image_segment *last = &img->segment[img->num_segment - 1];
+    img->length = last->offset + last->length;
+  }
+  return 0;
+}
+
+// copy image bytes [offset, offset+length) into buf, gaps are 0xFF
+static void image_copy(struct image *img, uint8_t *buf, uint32_t offset, uint32_t length)
+{
+  uint32_t end = offset + length, filled = offset;
+  int lo = 0, hi = img->num_segment;
+  while(lo < hi)
+  { // first segment which ends after offset
+    int mid = (lo + hi) / 2;
+    if(img->segment[mid].offset + img->segment[mid].length <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for(int i = lo; i < img->num_segment && img->segment[i].offset < end; i++)
+  {
+    struct image_segment *seg = &img->segment[i];
+    uint32_t a = seg->offset > offset ? seg->offset : offset;
+    uint32_t b = seg->offset + seg->length < end ? seg->offset + seg->length : end;
+    memset(buf + filled - offset, 0xFF, a - filled);
+    memcpy(buf + a - offset, seg->data + a - seg->offset, b - a);
+    filled = b;
+  }
+  memset(buf + filled - offset, 0xFF, end - filled);
+}
+
+
+// **** flash content cache ****
+// shadow of the flash on disk, one file per board named by JEDEC ID
+// and flash unique ID. The file has a header, a table with CRC32 of
+// each 4K sector whose content is known and the sector contents at
+// their flash offsets (sparse, unknown sectors take no disk space).
+// A cached sector replaces a pre-read only when gateware CRC32 of the
+// flash and CRC32 of the cached data both equal the table entry, so a
+// board written by another tool costs a read, never a wrong plan.
+#define CACHE_MAGIC "FPGASPC1"
+#define CACHE_SECTOR (4*1024)
+
+struct cache_header
+{
+  char magic[8];
+  uint8_t jedec_id[3];
+  uint8_t reserved;
+  uint32_t flash_size;
+};
+
+struct cache_entry
+{
+  uint32_t crc; // of the sector content
+  uint32_t known; // 1: content and crc valid
+};
+
+struct flash_cache
+{
+  int fd;
+  uint8_t *map;
+  size_t map_size;
+  struct cache_entry *entry; // one per sector
+  uint8_t *data; // flash content
+  uint32_t sectors;
+};
+
+// mkdir -p
+static int mkdir_parents(const char *dir)
+{
+  char path[1024];
+  snprintf(path, sizeof(path), "%s", dir);
+  for(char *p = path + 1; ; p++)
+  {
+    if(*p == '/' || *p == '\0')
+    {
+      char c = *p;
+      *p = '\0';
+      if(mkdir(path, 0755) < 0 && errno != EEXIST)
+        return -1;
+      if(c == '\0')
+        return 0;
+      *p = c;
+    }
+  }
+}
+
+void flash_cache_close(struct fpgasp *sp)
+{
+  struct flash_cache *c = sp->cache;
+  if(c == NULL)
+    return;
+  munmap(c->map, c->map_size);
+  close(c->fd);
+  free(c);
+  sp->cache = NULL;
+}
+
+// open or create the cache file of the opened board in dir.
+// without a readable unique ID boards can't be told apart, no cache.
+int flash_cache_open(struct fpgasp *sp, const char *dir)
+{
+  struct flash_info *f = sp->flash;
+  char uid[17], filename[1024];
+  flash_cache_close(sp);
+  if(flash_probe(sp) < 0 || flash_read_uid(sp, uid) < 0)
+    return -1;
+  if(strspn(uid, "0") == 16 || strspn(uid, "F") == 16)
+  {
+    printf("flash unique ID unknown, no content cache\n");
+    return 0;
+  }
+  if(mkdir_parents(dir) < 0)
+  {
+    perror(dir);
+    return -1;
+  }
+  snprintf(filename, sizeof(filename), "%s/%02X%02X%02X-%s.cache", dir,
+    f->jedec_id[0], f->jedec_id[1], f->jedec_id[2], uid);
+  struct flash_cache *c = (struct flash_cache *)calloc(1, sizeof(*c));
+  if(c == NULL)
+    return -1;
+  c->sectors = f->size / CACHE_SECTOR;
+  uint32_t table = (c->sectors * sizeof(struct cache_entry) + CACHE_SECTOR - 1) / CACHE_SECTOR * CACHE_SECTOR;
+  c->map_size = CACHE_SECTOR + table + f->size;
+  c->fd = open(filename, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  struct stat st;
+  if(c->fd < 0 || fstat(c->fd, &st) < 0)
+  {
+    perror(filename);
+    if(c->fd >= 0)
+      close(c->fd);
+    free(c);
+    return -1;
+  }
+  struct cache_header header;
+  int valid = st.st_size == c->map_size
+    && pread(c->fd, &header, sizeof(header), 0) == sizeof(header)
+    && memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) == 0
+    && memcmp(header.jedec_id, f->jedec_id, sizeof(header.jedec_id)) == 0
+    && header.flash_size == f->size;
+  if(!valid && (ftruncate(c->fd, 0) < 0 || ftruncate(c->fd, c->map_size) < 0))
+  {
+    perror(filename);
+    close(c->fd);
+    free(c);
+    return -1;
+  }
+  c->map = mmap(NULL, c->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+  if(c->map == MAP_FAILED)
+  {
+    perror(filename);
+    close(c->fd);
+    free(c);
+    return -1;
+  }
+  c->entry = (struct cache_entry *)(c->map + CACHE_SECTOR);
+  c->data = c->map + CACHE_SECTOR + table;
+  if(!valid)
+  { // new file is all zero: no sector known
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    memcpy(header.jedec_id, f->jedec_id, sizeof(header.jedec_id));
+    header.flash_size = f->size;
+    memcpy(c->map, &header, sizeof(header));
+  }
+  sp->cache = c;
+  uint32_t known = 0;
+  for(uint32_t s = 0; s < c->sectors; s++)
+    known += c->entry[s].known == 1;
+  printf("content cache %s: %u of %u sectors known\n", filename, known, c->sectors);
+  return 0;
+}
+
+// 1 if the sector at addr is cached and its data is intact, crc is set
+// to its CRC32. A gateware CRC32 of the flash equal to it confirms it.
+static int flash_cache_check(struct fpgasp *sp, uint32_t addr, uint32_t *crc)
+{
+  struct flash_cache *c = sp->cache;
+  uint32_t s = addr / CACHE_SECTOR;
+  if(c == NULL || s >= c->sectors || c->entry[s].known != 1)
+    return 0;
+  *crc = c->entry[s].crc;
+  return crc32(0, c->data + s * CACHE_SECTOR, CACHE_SECTOR) == *crc; // else file damaged
+}
+
+// copy checked sector at addr to data
+static void flash_cache_copy(struct fpgasp *sp, uint32_t addr, uint8_t *data)
+{
+  struct flash_cache *c = sp->cache;
+  memcpy(data, c->data + addr / CACHE_SECTOR * CACHE_SECTOR, CACHE_SECTOR);
+}
+
+// remember content of the 4K sector at addr, read or verified, crc is its CRC32
+static void flash_cache_store(struct fpgasp *sp, uint32_t addr, const uint8_t *data, uint32_t crc)
+{
+  struct flash_cache *c = sp->cache;
+  uint32_t s = addr / CACHE_SECTOR;
+  if(c == NULL || s >= c->sectors)
+    return;
+  if(c->entry[s].known == 1 && c->entry[s].crc == crc)
+    return; // already there, page stays clean
+  c->entry[s].known = 0; // content and table are not written at once
+  memcpy(c->data + s * CACHE_SECTOR, data, CACHE_SECTOR);
+  c->entry[s].crc = crc;
+  c->entry[s].known = 1;
+}
+
+
+// **** SPI clock ****
+// gateware from GATEWARE_SPI_CLOCK divides the SPI clock of the control
+// endpoint and can sample MISO later than the rising edge, for boards
+// whose traces are too long for the full clock. Calibration reads the
+// same range at each setting from slow to fast and compares it with a
+// read at the slowest clock and latest sample point. Bits sampled a
+// clock late pass the CRC32 of a checked read, only the comparison
+// finds them.
+#define SPI_CLOCK 9 // bRequest
+#define SPI_CLOCK_MHZ 24.0 // at divider 0
+#define SPI_DIV_SLOW 3 // slowest divider tried, 6 MHz
+#define SPI_CAL_ADDR 0 // bootloader image, never blank on a working board
+#define SPI_CAL_BYTES (32*1024)
+#define SPI_CHECK_BYTES (4*1024) // check of a saved setting
+
+int spi_clock_set(struct fpgasp *sp, int divider, int delay)
+{
+  if(sp->gateware_version < GATEWARE_SPI_CLOCK)
+  {
+    fprintf(stderr, "bootloader can't change SPI clock\n");
+    return -1;
+  }
+  if(divider < 0 || divider > 255 || delay < 0 || delay > divider)
+  {
+    fprintf(stderr, "SPI clock divider 0-255, sample delay 0-divider\n");
+    return -1;
+  }
+  int rc = usb_queue_out(sp, SPI_CLOCK, divider, delay, NULL, 0); // no data stage
+  return usb_queue_flush(sp) < 0 ? -1 : rc;
+}
+
+// read length bytes at the current setting, 1: equal to ref, 0: not, -1: error
+static int spi_clock_check(struct fpgasp *sp, const uint8_t *ref, uint8_t *buf, uint32_t length)
+{
+  if(flash_read(sp, buf, SPI_CAL_ADDR, length) < 0)
+    return -1;
+  return memcmp(buf, ref, length) == 0;
+}
+
+static void spi_clock_print(const char *what, int divider, int delay)
+{
+  printf("SPI clock %s: divider %d (%.1f MHz), sample delay %d\n",
+    what, divider, SPI_CLOCK_MHZ / (divider + 1), delay);
+}
+
+// from the slowest divider down, find the delays at which reads are
+// right. The fastest divider where any delay works is one step beyond
+// the limit only when a faster one failed; then the next slower one is
+// taken. The delay is the middle of its working window.
+// return value 0: set, 1: flash range without data, clock unchanged, -1: error
+int spi_clock_calibrate(struct fpgasp *sp, int *divider, int *delay)
+{
+  int window[SPI_DIV_SLOW + 1][2]; // first and last working delay
+  int fastest = -1, failed = 0, rc = 0;
+  uint32_t varied = 0;
+  if(sp->gateware_version < GATEWARE_SPI_CLOCK || sp->usb_bulk)
+  {
+    fprintf(stderr, "SPI clock calibration needs control transport and bootloader %04X\n", GATEWARE_SPI_CLOCK);
+    return -1;
+  }
+  uint8_t *ref = (uint8_t *)malloc(SPI_CAL_BYTES);
+  uint8_t *buf = (uint8_t *)malloc(SPI_CAL_BYTES);
+  if(ref == NULL || buf == NULL)
+    rc = -1;
+  // blank or constant flash can't show a wrong sample point
+  if(rc == 0)
+    rc = flash_read(sp, ref, SPI_CAL_ADDR, SPI_CAL_BYTES);
+  for(uint32_t i = 0; i < SPI_CAL_BYTES && rc == 0; i++)
+    varied += ref[i] != 0x00 && ref[i] != 0xFF;
+  if(rc == 0 && varied < SPI_CAL_BYTES / 16)
+  {
+    printf("flash at 0x%06X has too little data, SPI clock not calibrated\n", SPI_CAL_ADDR);
+    rc = 1;
+  }
+  if(rc == 0 && (spi_clock_set(sp, SPI_DIV_SLOW, SPI_DIV_SLOW) < 0 || flash_read(sp, ref, SPI_CAL_ADDR, SPI_CAL_BYTES) < 0))
+    rc = -1;
+  for(int div = SPI_DIV_SLOW; div >= 0 && rc == 0 && !failed; div--)
+  {
+    window[div][0] = window[div][1] = -1;
+    for(int d = 0; d <= div && rc == 0; d++)
+    {
+      int pass = spi_clock_set(sp, div, d) < 0 ? -1 : spi_clock_check(sp, ref, buf, SPI_CAL_BYTES);
+      if(pass < 0)
+        rc = -1;
+      else if(pass && (window[div][0] < 0 || window[div][1] == d - 1))
+      {
+        if(window[div][0] < 0)
+          window[div][0] = d;
+        window[div][1] = d;
+      }
+    }
+    if(window[div][0] < 0)
+      failed = 1;
+    else
+      fastest = div;
+  }
+  if(rc == 0 && fastest < 0)
+  {
+    fprintf(stderr, "flash reads differ even at the slowest SPI clock\n");
+    rc = -1;
+  }
+  if(rc == 0)
+  {
+    *divider = failed && fastest < SPI_DIV_SLOW ? fastest + 1 : fastest;
+    *delay = (window[*divider][0] + window[*divider][1]) / 2;
+    rc = spi_clock_set(sp, *divider, *delay);
+    if(rc == 0)
+      spi_clock_print("calibrated", *divider, *delay);
+  }
+  free(ref);
+  free(buf);
+  return rc;
+}
+
+// apply the setting saved in filename ("divider delay") after a short
+// check read, else calibrate and save. filename NULL: calibrate only.
+// a board whose flash has too little data to calibrate is saved as
+// "default" and keeps the reset clock until it is recalibrated.
+// without gateware support or with bulk transport the clock is fixed.
+int spi_clock_tune(struct fpgasp *sp, const char *filename, int recalibrate)
+{
+  int divider = -1, delay = -1, rc;
+  if(sp->gateware_version < GATEWARE_SPI_CLOCK || sp->usb_bulk)
+    return 0;
+  FILE *f = filename && !recalibrate ? fopen(filename, "r") : NULL;
+  if(f)
+  {
+    char word[16];
+    int is_default = fscanf(f, "%15s", word) == 1 && strcmp(word, "default") == 0;
+    rewind(f);
+    if(fscanf(f, "%d %d", &divider, &delay) != 2)
+      divider = -1;
+    fclose(f);
+    if(is_default)
+    {
+      printf("SPI clock of the board: default, not calibrated\n");
+      return 0;
+    }
+  }
+  if(divider >= 0 && divider <= SPI_DIV_SLOW && delay >= 0 && delay <= divider)
+  {
+    uint8_t *ref = (uint8_t *)malloc(SPI_CHECK_BYTES);
+    uint8_t *buf = (uint8_t *)malloc(SPI_CHECK_BYTES);
+    int pass = ref && buf
+      && spi_clock_set(sp, SPI_DIV_SLOW, SPI_DIV_SLOW) == 0
+      && flash_read(sp, ref, SPI_CAL_ADDR, SPI_CHECK_BYTES) == 0
+      && spi_clock_set(sp, divider, delay) == 0
+      && spi_clock_check(sp, ref, buf, SPI_CHECK_BYTES) == 1;
+    free(ref);
+    free(buf);
+    if(pass)
+    {
+      spi_clock_print("of the board", divider, delay);
+      return 0;
+    }
+    printf("saved SPI clock of the board fails, calibrating again\n");
+  }
+  rc = spi_clock_calibrate(sp, &divider, &delay);
+  if(rc >= 0 && filename)
+  {
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", filename);
+    char *slash = strrchr(dir, '/');
+    if(slash && slash != dir)
+    {
+      *slash = '\0';
+      mkdir_parents(dir);
+    }
+    f = fopen(filename, "w");
+    if(f == NULL || (rc == 1 ? fprintf(f, "default\n") : fprintf(f, "%d %d\n", divider, delay)) < 0)
+      perror(filename);
+    if(f)
+      fclose(f);
+  }
+  return rc < 0 ? -1 : 0;
+}
+
+// **** write journal ****
+// a write records which sectors it has verified in a small journal
+// file, with a hash of the flash, the range and the images. When the
+// write is interrupted (unplug, USB reset), a resumed write of the same
+// images leaves the verified sectors out: they are not read, erased or
+// programmed again. The journal is removed when the write succeeds.
+#define JOURNAL_MAGIC "FPGASPJ1"
+
+struct journal_header
+{
+  char magic[8];
+  uint32_t hash;
+  uint32_t start; // address of sector 0
+  uint32_t sectors;
+};
+
+int fpgasp_set_journal(struct fpgasp *sp, const char *filename, int resume)
+{
+  free(sp->journal_file);
+  sp->journal_file = filename ? strdup(filename) : NULL;
+  sp->journal_resume = resume;
+  return filename && sp->journal_file == NULL ? -1 : 0;
+}
+
+// flash JEDEC ID and unique ID, range, addresses and content of regions.
+// region data is in buf, which holds the range from start.
+static uint32_t journal_hash(struct fpgasp *sp, struct flash_region *regions, int n,
+  const uint8_t *buf, uint32_t start, uint32_t sectors)
+{
+  char uid[17];
+  uint32_t range[2] = {start, sectors};
+  if(flash_read_uid(sp, uid) < 0)
+    uid[0] = '\0';
+  uint32_t hash = crc32(0, sp->flash->jedec_id, sizeof(sp->flash->jedec_id));
+  hash = crc32(hash, (const uint8_t *)uid, strlen(uid));
+  hash = crc32(hash, (const uint8_t *)range, sizeof(range));
+  for(int i = 0; i < n; i++)
+  {
+    uint32_t region[3] = {regions[i].addr, regions[i].length,
+      crc32(0, buf + regions[i].addr - start, regions[i].length)};
+    hash = crc32(hash, (const uint8_t *)region, sizeof(region));
+  }
+  return hash;
+}
+
+// open the journal of the write with this hash. When resuming and the
+// journal matches, verified[s] is set for each sector it lists, else
+// a new journal is started. return value: verified sectors, -1: error
+static int journal_open(struct fpgasp *sp, uint32_t hash, uint32_t start, uint32_t sectors, uint8_t *verified)
+{
+  struct journal_header header;
+  int count = 0;
+  char dir[1024];
+  snprintf(dir, sizeof(dir), "%s", sp->journal_file);
+  char *slash = strrchr(dir, '/');
+  if(slash && slash != dir)
+  {
+    *slash = '\0';
+    mkdir_parents(dir);
+  }
+  sp->journal_fd = open(sp->journal_file, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  if(sp->journal_fd < 0)
+  {
+    perror(sp->journal_file);
+    return -1;
+  }
+  int match = pread(sp->journal_fd, &header, sizeof(header), 0) == sizeof(header)
+    && memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0
+    && header.hash == hash && header.start == start && header.sectors == sectors
+    && pread(sp->journal_fd, verified, sectors, sizeof(header)) == sectors;
+  if(sp->journal_resume && match)
+  {
+    for(uint32_t s = 0; s < sectors; s++)
+      count += verified[s] = verified[s] == 1;
+    return count;
+  }
+  if(sp->journal_resume)
+    printf("no journal of this write in %s, writing all sectors\n", sp->journal_file);
+  memset(verified, 0, sectors);
+  memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+  header.hash = hash;
+  header.start = start;
+  header.sectors = sectors;
+  if(ftruncate(sp->journal_fd, 0) < 0
+  || pwrite(sp->journal_fd, &header, sizeof(header), 0) != sizeof(header)
+  || pwrite(sp->journal_fd, verified, sectors, sizeof(header)) != sectors)
+  {
+    perror(sp->journal_file);
+    close(sp->journal_fd);
+    sp->journal_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+// sector s is verified
+static void journal_mark(struct fpgasp *sp, uint32_t s)
+{
+  const uint8_t done = 1;
+  if(sp->journal_fd >= 0 && pwrite(sp->journal_fd, &done, 1, sizeof(struct journal_header) + s) != 1)
+    perror(sp->journal_file);
+}
+
+// a finished write needs no journal
+static void journal_close(struct fpgasp *sp, int finished)
+{
+  if(sp->journal_fd < 0)
+    return;
+  close(sp->journal_fd);
+  sp->journal_fd = -1;
+  if(finished)
+    unlink(sp->journal_file);
+}
+
+
+// **** erase planner ****
+// whole target range is first read and diffed against the file
+// in 4K sector units. Each sector is then either left unchanged,
+// programmed without erase (only 1->0 bit changes) or erased.
+// Erases are grouped into the cheapest mix of the flash's erase types
+// (4K/32K/64K without SFDP), costed with their typical times.
+// A larger block is only used when it lies completely inside of
+// the pre-read range, because all of its content must be rewritten.
+// Many regions (files at their addresses) share one plan, sectors
+// between them which hold no region data are neither read nor written.
+
+#define SECTOR_SIZE (4*1024)
+#define PAGE_SIZE 256
+
+// USB transfer of a page for plan cost estimation (ms),
+// added to the typical page program time
+#define COST_PAGE_USB_MS 0.8
+
+enum sector_action
+{
+  SECTOR_UNCHANGED = 0, // flash content already equals the file
+  SECTOR_PROGRAM = 1, // only 1->0 bit changes, program without erase
+  SECTOR_ERASE = 2, // must be erased before programming
+};
+
+// what the host knows of a touched sector before its pre-read
+#define SECTOR_STATE_COVERED 1 // completely covered with data of one region
+#define SECTOR_STATE_BLANK 2 // covered and wanted content is all 0xFF
+#define SECTOR_STATE_CACHED 4 // intact in the content cache, CRC32 in cache_crc
+#define SECTOR_STATE_READ 8 // pre-read over USB
+
+struct erase_plan
+{
+  uint32_t start; // 4K aligned start address of planned range
+  uint32_t sectors; // number of 4K sectors in planned range
+  uint8_t *flash; // pre-read flash content
+  uint8_t *file; // wanted content (file data merged into flash content)
+  uint8_t *action; // sector_action of each 4K sector
+  uint8_t *touched; // 1 if sector holds region data
+  uint8_t *state; // SECTOR_STATE_ bits of each sector, set by the host pipeline
+  uint32_t *file_crc; // CRC32 of wanted content of covered sectors, after classification of all touched
+  uint32_t *cache_crc; // CRC32 of the cached sector
+  uint8_t *erased; // 1 if sector is erased by the plan (by any size)
+  uint32_t *erase_addr; // planned erase operations
+  uint32_t *erase_size;
+  uint32_t num_erase;
+  const struct erase_type *erase_type; // of the flash, 4K first
+  int num_erase_type;
+  uint32_t count_erase[ERASE_TYPES]; // planned erases of each type
+  uint32_t count_page; // planned page programs
+  double cost_page_ms; // page program + USB transfer
+  double cost_ms; // estimated execution time
+};
+
+// compare kernels work on 64-bit words without early exit,
+// so the compiler can turn the loops into SIMD code.
+// lengths are multiples of 8.
+static inline uint64_t load64(const uint8_t *p)
+{
+  uint64_t w;
+  memcpy(&w, p, sizeof(w)); // unaligned and alias safe, compiles to one load
+  return w;
+}
+
+// all bytes 0xFF
+static int bytes_blank(const uint8_t *data, uint32_t length)
+{
+  uint64_t all = ~(uint64_t)0;
+  for(uint32_t i = 0; i < length; i += 8)
+    all &= load64(data + i);
+  return all == ~(uint64_t)0;
+}
+
+// no byte in page different from 0xFF
+static int page_is_blank(const uint8_t *page)
+{
+  return bytes_blank(page, PAGE_SIZE);
+}
+
+// number of pages which must be programmed in sector
+// after erase or without erase
+static uint32_t sector_pages(struct erase_plan *plan, uint32_t sector, int after_erase)
+{
+  uint32_t pages = 0;
+  uint8_t *flash = plan->flash + sector * SECTOR_SIZE;
+  uint8_t *file = plan->file + sector * SECTOR_SIZE;
+  for(uint32_t i = 0; i < SECTOR_SIZE; i += PAGE_SIZE)
+  {
+    if(after_erase)
+      pages += !page_is_blank(file + i);
+    else
+      pages += memcmp(flash + i, file + i, PAGE_SIZE) != 0;
+  }
+  return pages;
+}
+
+// compare flash and file content of the sector
+static uint8_t sector_classify(const uint8_t *flash, const uint8_t *file)
+{
+  uint64_t set = 0; // bits which must go 0->1: erase
+  uint64_t differ = 0;
+  for(uint32_t i = 0; i < SECTOR_SIZE; i += 8)
+  {
+    uint64_t f = load64(flash + i), w = load64(file + i);
+    set |= w & ~f;
+    differ |= w ^ f;
+  }
+  return set ? SECTOR_ERASE : differ ? SECTOR_PROGRAM : SECTOR_UNCHANGED;
+}
+
+// number of sectors from s up to next aligned boundary of "align" sectors, limited by end
+static uint32_t plan_split(struct erase_plan *plan, uint32_t s, uint32_t end, uint32_t align)
+{
+  uint32_t n = align - (plan->start / SECTOR_SIZE + s) % align;
+  return s + n > end ? end - s : n;
+}
+
+// cost of cheapest way to bring sectors [first, first+n) to file content
+// size_index selects the largest erase size which may be tried
+// if "apply" is set, chosen erases are appended to plan
+static double plan_block(struct erase_plan *plan, uint32_t first, uint32_t n, int size_index, int apply)
+{
+  double cost_small = 0.0;
+  if(size_index == 0)
+  { // 4K granularity
+    for(uint32_t s = first; s < first + n; s++)
+    {
+      if(plan->action[s] == SECTOR_ERASE)
+      {
+        cost_small += plan->erase_type[0].typical_ms + plan->cost_page_ms * sector_pages(plan, s, 1);
+        if(apply)
+        {
+          plan->erase_addr[plan->num_erase] = plan->start + s * SECTOR_SIZE;
+          plan->erase_size[plan->num_erase] = SECTOR_SIZE;
+          plan->num_erase++;
+          plan->count_erase[0]++;
+          plan->erased[s] = 1;
+        }
+      }
+      else if(plan->action[s] == SECTOR_PROGRAM)
+        cost_small += plan->cost_page_ms * sector_pages(plan, s, 0);
+    }
+    return cost_small;
+  }
+  uint32_t block_sectors = plan->erase_type[size_index].size / SECTOR_SIZE;
+  uint32_t sub_sectors = plan->erase_type[size_index-1].size / SECTOR_SIZE;
+  double cost_block = plan->erase_type[size_index].typical_ms;
+  int need_erase = 0;
+  // the block erase is only an option when the block is aligned and complete
+  int block_fits = n == block_sectors && (plan->start / SECTOR_SIZE + first) % block_sectors == 0;
+  for(uint32_t s = first; s < first + n; s++)
+  {
+    need_erase |= plan->action[s] == SECTOR_ERASE;
+    block_fits &= plan->touched[s]; // content of untouched sectors is unknown
+    cost_block += plan->cost_page_ms * sector_pages(plan, s, 1);
+  }
+  for(uint32_t s = first; s < first + n; s += plan_split(plan, s, first + n, sub_sectors))
+    cost_small += plan_block(plan, s, plan_split(plan, s, first + n, sub_sectors), size_index-1, 0);
+  if(block_fits && need_erase && cost_block < cost_small)
+  {
+    if(apply)
+    {
+      plan->erase_addr[plan->num_erase] = plan->start + first * SECTOR_SIZE;
+      plan->erase_size[plan->num_erase] = plan->erase_type[size_index].size;
+      plan->num_erase++;
+      plan->count_erase[size_index]++;
+      for(uint32_t s = first; s < first + n; s++)
+        plan->erased[s] = 1;
+    }
+    return cost_block;
+  }
+  if(apply)
+    for(uint32_t s = first; s < first + n; s += plan_split(plan, s, first + n, sub_sectors))
+      plan_block(plan, s, plan_split(plan, s, first + n, sub_sectors), size_index-1, 1);
+  return cost_small;
+}
+
+// choose erases for the whole range, walking it in aligned blocks of the largest erase
+static void plan_erases(struct erase_plan *plan)
+{
+  const int largest = plan->num_erase_type - 1;
+  const uint32_t block_sectors = plan->erase_type[largest].size / SECTOR_SIZE;
+  uint32_t s = 0;
+  plan->cost_ms = 0.0;
+  while(s < plan->sectors)
+  {
+    // up to next aligned boundary of the largest erase
+    uint32_t n = plan_split(plan, s, plan->sectors, block_sectors);
+    plan->cost_ms += plan_block(plan, s, n, largest, 1);
+    s += n;
+  }
+  plan->count_page = 0;
+  for(s = 0; s < plan->sectors; s++)
+  {
+    if(plan->erased[s])
+      plan->count_page += sector_pages(plan, s, 1);
+    else if(plan->action[s] == SECTOR_PROGRAM)
+      plan->count_page += sector_pages(plan, s, 0);
+  }
+}
+
+// erase count of each type, largest first: " 64K:1 32K:0 4K:3"
+static void print_erase_counts(struct erase_plan *plan)
+{
+  for(int i = plan->num_erase_type - 1; i >= 0; i--)
+    printf(" %uK:%d", plan->erase_type[i].size / 1024, plan->count_erase[i]);
+}
+
+void print_erase_plan(struct erase_plan *plan)
+{
+  uint32_t count[3] = {0, 0, 0};
+  for(uint32_t s = 0; s < plan->sectors; s++)
+    if(plan->touched[s])
+      count[plan->action[s]]++;
+  printf("sectors 4K: %d unchanged, %d program only, %d need erase\n",
+    count[SECTOR_UNCHANGED], count[SECTOR_PROGRAM], count[SECTOR_ERASE]);
+  printf("plan: erase");
+  print_erase_counts(plan);
+  printf(", program %d pages, estimated %.1f s\n", plan->count_page, plan->cost_ms / 1000.0);
+}
+
+// program pages of a sector which differ from wanted content.
+// after erase, flash content is assumed 0xFF.
+static int program_sector(struct fpgasp *sp, struct erase_plan *plan, uint32_t s, int after_erase)
+{
+  uint8_t *flash = plan->flash + s * SECTOR_SIZE;
+  uint8_t *file = plan->file + s * SECTOR_SIZE;
+  uint32_t sector_addr = plan->start + s * SECTOR_SIZE;
+  int engine = !sp->usb_bulk && sp->gateware_version >= GATEWARE_PAGE_ENGINE;
+  // flash with smaller pages is programmed in several parts
+  uint32_t unit = sp->flash->page_size < PAGE_SIZE ? sp->flash->page_size : PAGE_SIZE;
+  for(uint32_t i = 0; i < SECTOR_SIZE; i += PAGE_SIZE)
+  {
+    int must_write = after_erase ? !page_is_blank(file + i) : memcmp(flash + i, file + i, PAGE_SIZE) != 0;
+    for(uint32_t k = i; must_write && k < i + PAGE_SIZE; k += unit)
+    {
+      if(engine)
+      {
+        if(flash_write_queued(sp, file + k, sector_addr + k, unit) < 0)
+          return -1;
+      }
+      else if(flash_write(sp, file + k, sector_addr + k, unit) < 0)
+        return -1;
+    }
+  }
+  if(engine)
+    return flash_write_wait(sp);
+  return 0;
+}
+
+// region with its opened image file
+struct region_image
+{
+  struct flash_region region;
+  struct image image;
+};
+
+static int region_compare(const void *a, const void *b)
+{
+  const struct flash_region *ra = &((const struct region_image *)a)->region;
+  const struct flash_region *rb = &((const struct region_image *)b)->region;
+  return ra->addr < rb->addr ? -1 : ra->addr > rb->addr;
+}
+
+// sector completely covered with data of one region
+static int sector_covered(struct flash_region *regions, int n, uint32_t sector_addr)
+{
+  for(int i = 0; i < n; i++)
+    if(sector_addr >= regions[i].addr && sector_addr + SECTOR_SIZE <= regions[i].addr + regions[i].length)
+      return 1;
+  return 0;
+}
+
+// copy region image into its place in the planned range
+static void region_load(struct erase_plan *plan, struct region_image *ri)
+{
+  image_copy(&ri->image, plan->file + ri->region.addr - plan->start, 0, ri->region.length);
+}
+
+// **** host pipeline ****
+// the pre-read is a USB executor (calling thread) and a host thread.
+// The host thread loads region data from the images, checks for 0xFF,
+// computes CRC32 and checks the cache up to PIPELINE_AHEAD sectors
+// ahead of the USB executor, and classifies each sector as soon as it
+// is pre-read. The USB executor only waits when the host falls behind,
+// and planning waits only for classification of the last sectors.
+#define PIPELINE_AHEAD 64
+
+struct pipeline
+{
+  struct fpgasp *sp;
+  struct erase_plan *plan;
+  struct flash_region *regions; // sorted
+  struct region_image *ri; // same order
+  int n;
+  int loaded; // 1: region data is in the plan already
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  uint32_t prepared; // sectors [0, prepared) are prepared by the host
+  uint32_t read; // sectors [0, read) are pre-read by the USB executor
+  int stop; // USB executor failed
+};
+
+static void pipeline_publish(struct pipeline *pl, uint32_t *counter, uint32_t value)
+{
+  pthread_mutex_lock(&pl->lock);
+  *counter = value;
+  pthread_cond_broadcast(&pl->cond);
+  pthread_mutex_unlock(&pl->lock);
+}
+
+// wait until counter passes sector s. return value 1: passed, 0: stopped
+static int pipeline_wait(struct pipeline *pl, uint32_t *counter, uint32_t s)
+{
+  pthread_mutex_lock(&pl->lock);
+  while(*counter <= s && !pl->stop)
+    pthread_cond_wait(&pl->cond, &pl->lock);
+  int passed = *counter > s;
+  pthread_mutex_unlock(&pl->lock);
+  return passed;
+}
+
+// load region data of touched sector s and note what the pre-read needs
+static void pipeline_prepare(struct pipeline *pl, uint32_t s)
+{
+  struct erase_plan *plan = pl->plan;
+  uint8_t *file = plan->file + s * SECTOR_SIZE;
+  uint32_t sector_addr = plan->start + s * SECTOR_SIZE;
+  for(int i = 0; i < pl->n && !pl->loaded; i++)
+  {
+    struct flash_region *r = &pl->ri[i].region;
+    uint32_t a = r->addr > sector_addr ? r->addr : sector_addr;
+    uint32_t b = r->addr + r->length < sector_addr + SECTOR_SIZE ? r->addr + r->length : sector_addr + SECTOR_SIZE;
+    if(a < b)
+      image_copy(&pl->ri[i].image, file + a - sector_addr, a - r->addr, b - a);
+  }
+  plan->state[s] = 0;
+  if(sector_covered(pl->regions, pl->n, sector_addr))
+  {
+    plan->state[s] = SECTOR_STATE_COVERED;
+    if(bytes_blank(file, SECTOR_SIZE))
+      plan->state[s] |= SECTOR_STATE_BLANK;
+    plan->file_crc[s] = crc32(0, file, SECTOR_SIZE);
+  }
+  if(flash_cache_check(pl->sp, sector_addr, &plan->cache_crc[s]))
+    plan->state[s] |= SECTOR_STATE_CACHED;
+}
+
+// sector s is pre-read: outside of file data flash content is kept,
+// then flash and wanted content are compared
+static void pipeline_classify(struct pipeline *pl, uint32_t s)
+{
+  struct erase_plan *plan = pl->plan;
+  uint8_t *flash = plan->flash + s * SECTOR_SIZE;
+  uint8_t *file = plan->file + s * SECTOR_SIZE;
+  uint32_t sector_addr = plan->start + s * SECTOR_SIZE;
+  if(!plan->touched[s])
+  {
+    memcpy(file, flash, SECTOR_SIZE);
+    return;
+  }
+  if(!(plan->state[s] & SECTOR_STATE_COVERED))
+  {
+    uint32_t gap = sector_addr; // after the previous region
+    for(int i = 0; i < pl->n; i++)
+    {
+      struct flash_region *r = &pl->regions[i];
+      if(r->addr >= sector_addr + SECTOR_SIZE || r->addr + r->length <= sector_addr)
+        continue;
+      if(r->addr > gap)
+        memcpy(file + gap - sector_addr, flash + gap - sector_addr, r->addr - gap);
+      gap = r->addr + r->length;
+    }
+    if(gap < sector_addr + SECTOR_SIZE)
+      memcpy(file + gap - sector_addr, flash + gap - sector_addr, sector_addr + SECTOR_SIZE - gap);
+    plan->file_crc[s] = crc32(0, file, SECTOR_SIZE);
+  }
+  if(plan->state[s] & SECTOR_STATE_READ)
+    flash_cache_store(pl->sp, sector_addr, flash, crc32(0, flash, SECTOR_SIZE));
+  plan->action[s] = sector_classify(flash, file);
+}
+
+static void *pipeline_run(void *arg)
+{
+  struct pipeline *pl = (struct pipeline *)arg;
+  uint32_t sectors = pl->plan->sectors, prepared = 0;
+  for(uint32_t s = 0; s < sectors; s++)
+  {
+    for(; prepared < sectors && prepared < s + PIPELINE_AHEAD; prepared++)
+    {
+      if(pl->plan->touched[prepared])
+        pipeline_prepare(pl, prepared);
+      pipeline_publish(pl, &pl->prepared, prepared + 1);
+    }
+    if(!pipeline_wait(pl, &pl->read, s))
+      break;
+    pipeline_classify(pl, s);
+  }
+  return NULL;
+}
+
+static int pipeline_start(struct pipeline *pl)
+{
+  crc32(0, NULL, 0); // table is set up before two threads use it
+  pthread_mutex_init(&pl->lock, NULL);
+  pthread_cond_init(&pl->cond, NULL);
+  if(pthread_create(&pl->thread, NULL, pipeline_run, pl) != 0)
+  {
+    fprintf(stderr, "can't start host pipeline thread\n");
+    pthread_mutex_destroy(&pl->lock);
+    pthread_cond_destroy(&pl->cond);
+    return -1;
+  }
+  return 0;
+}
+
+// wait until all sectors are classified, stop 1: pre-read failed, don't wait
+static void pipeline_finish(struct pipeline *pl, int stop)
+{
+  if(stop)
+  {
+    pthread_mutex_lock(&pl->lock);
+    pl->stop = 1;
+    pthread_cond_broadcast(&pl->cond);
+    pthread_mutex_unlock(&pl->lock);
+  }
+  pthread_join(pl->thread, NULL);
+  pthread_mutex_destroy(&pl->lock);
+  pthread_cond_destroy(&pl->cond);
+}
+
+// sectors verified by an interrupted write of the same images are
+// left out of the plan: not read, erased or programmed.
+// return value: number of sectors left out
+static uint32_t plan_journal(struct fpgasp *sp, struct erase_plan *plan, struct flash_region *regions, int n)
+{
+  uint32_t count_touched = 0, count_left = 0;
+  uint8_t *verified = (uint8_t *)malloc(plan->sectors);
+  int count_verified = verified ? journal_open(sp, journal_hash(sp, regions, n, plan->file, plan->start, plan->sectors),
+    plan->start, plan->sectors, verified) : -1;
+  for(uint32_t s = 0; s < plan->sectors && count_verified > 0; s++)
+  {
+    count_touched += plan->touched[s];
+    if(verified[s] && plan->touched[s])
+    {
+      plan->touched[s] = 0;
+      count_left++;
+    }
+  }
+  if(count_verified > 0)
+    printf("resume: %d of %d sectors verified before\n", count_verified, count_touched - count_left + count_verified);
+  free(verified);
+  return count_left;
+}
+
+// write that many bytes found or file or if file is larger, limit by length.
+int read_file_write_flash(struct fpgasp *sp, const char *filename, uint32_t addr, uint32_t length)
+{
+  struct flash_region region = {filename, addr, length};
+  return write_regions(sp, &region, 1);
+}
+
+static int write_sorted_regions(struct fpgasp *sp, struct flash_region *regions, struct region_image *ri, int n);
+
+// write all regions in one pass: regions are sorted by address, the
+// sectors they touch are read once, erases are planned for all of them,
+// then the plan is executed and verified.
+// sector which fails verify is retried few times with 4K erase, then give up.
+// regions are sorted in place, length 0 is replaced with image length.
+// return value
+//  0: ok
+// -1: error (also when regions overlap)
+int write_regions(struct fpgasp *sp, struct flash_region *regions, int n)
+{
+  struct region_image *ri = (struct region_image *)calloc(n, sizeof(*ri));
+  int m = 0, rc = 0;
+  if(ri == NULL)
+    return -1;
+  for(int i = 0; i < n && rc == 0; i++)
+  {
+    rc = image_open(&ri[m].image, regions[i].filename);
+    if(rc < 0)
+      break; // cant't open file
+    if(regions[i].length == 0 || regions[i].length > ri[m].image.length)
+      regions[i].length = ri[m].image.length;
+    ri[m].region = regions[i];
+    if(regions[i].length)
+      m++;
+    else
+      image_close(&ri[m].image);
+  }
+  if(rc == 0 && m > 0)
+  {
+    qsort(ri, m, sizeof(*ri), region_compare);
+    for(int i = 0; i < m; i++)
+      regions[i] = ri[i].region;
+    rc = write_sorted_regions(sp, regions, ri, m);
+  }
+  for(int i = 0; i < m; i++)
+    image_close(&ri[i].image);
+  free(ri);
+  return rc;
+}
+
+static int write_sorted_regions(struct fpgasp *sp, struct flash_region *regions, struct region_image *ri, int n)
+{
+  uint32_t length = 0; // sum of region lengths
+  for(int i = 0; i + 1 < n; i++)
+    if(regions[i].addr + regions[i].length > regions[i+1].addr)
+    {
+      fprintf(stderr, "%s at 0x%06X overlaps %s at 0x%06X\n",
+        regions[i].filename, regions[i].addr, regions[i+1].filename, regions[i+1].addr);
+      return -1;
+    }
+
+  if(sp->flash->erase[0].size != SECTOR_SIZE)
+  {
+    fprintf(stderr, "flash without 4K erase is not supported\n");
+    return -1;
+  }
+  if(regions[n-1].addr + regions[n-1].length > sp->flash->size)
+  {
+    fprintf(stderr, "%s at 0x%06X ends beyond flash size %u KB\n",
+      regions[n-1].filename, regions[n-1].addr, sp->flash->size >> 10);
+    return -1;
+  }
+
+  struct erase_plan plan;
+  memset(&plan, 0, sizeof(plan));
+  plan.erase_type = sp->flash->erase;
+  plan.num_erase_type = sp->flash->num_erase;
+  plan.cost_page_ms = sp->flash->page_program_ms + COST_PAGE_USB_MS;
+  plan.start = regions[0].addr - regions[0].addr % SECTOR_SIZE;
+  plan.sectors = (regions[n-1].addr + regions[n-1].length - plan.start + SECTOR_SIZE - 1) / SECTOR_SIZE;
+  uint32_t plan_bytes = plan.sectors * SECTOR_SIZE;
+  plan.flash = (uint8_t *)malloc(plan_bytes);
+  plan.file = (uint8_t *)malloc(plan_bytes);
+  plan.action = (uint8_t *)calloc(plan.sectors, 1);
+  plan.touched = (uint8_t *)calloc(plan.sectors, 1);
+  plan.state = (uint8_t *)calloc(plan.sectors, 1);
+  plan.file_crc = (uint32_t *)malloc(plan.sectors * sizeof(uint32_t));
+  plan.cache_crc = (uint32_t *)malloc(plan.sectors * sizeof(uint32_t));
+  plan.erased = (uint8_t *)calloc(plan.sectors, 1);
+  plan.erase_addr = (uint32_t *)malloc(plan.sectors * sizeof(uint32_t));
+  plan.erase_size = (uint32_t *)malloc(plan.sectors * sizeof(uint32_t));
+  int rc = 0;
+  const int retry = 10;
+  uint32_t count_retry = 0;
+
+  double time_start = time_now();
+  uint32_t count_touched = 0;
+  for(int i = 0; i < n; i++)
+  {
+    printf("writing range 0x%06X-0x%06X\n", regions[i].addr, regions[i].addr + regions[i].length - 1);
+    length += regions[i].length;
+    uint32_t first = (regions[i].addr - plan.start) / SECTOR_SIZE;
+    uint32_t last = (regions[i].addr + regions[i].length - 1 - plan.start) / SECTOR_SIZE;
+    for(uint32_t s = first; s <= last; s++)
+    {
+      count_touched += !plan.touched[s];
+      plan.touched[s] = 1;
+    }
+  }
+
+  // resuming needs the journal before the pre-read, so its hash
+  // of the region data is taken before the host pipeline starts
+  struct pipeline pl;
+  memset(&pl, 0, sizeof(pl));
+  pl.sp = sp;
+  pl.plan = &plan;
+  pl.regions = regions;
+  pl.ri = ri;
+  pl.n = n;
+  if(sp->journal_file && sp->journal_resume)
+  {
+    for(int i = 0; i < n; i++)
+      region_load(&plan, &ri[i]);
+    pl.loaded = 1;
+    count_touched -= plan_journal(sp, &plan, regions, n);
+  }
+
+  // pre-read touched sectors, classified by the host pipeline meanwhile.
+  // If gateware can scan flash, blank sectors, sectors already equal to
+  // the file and sectors confirmed by the content cache are not read
+  // over USB. a sector which must become 0xFF is erased, its content
+  // doesn't matter. covered or cached sectors need one CRC32 scan, it
+  // also tells a blank sector by the CRC32 of 4K 0xFF.
+  int scan = sp->gateware_version >= GATEWARE_FLASH_SCAN;
+  uint8_t blank[SECTOR_SIZE];
+  memset(blank, 0xFF, SECTOR_SIZE);
+  uint32_t blank_crc = crc32(0, blank, SECTOR_SIZE);
+  uint32_t count_blank = 0, count_crc = 0, count_cache = 0, count_erase_only = 0, count_done = 0;
+  double time_phase = time_now();
+  memset(plan.flash, 0xFF, plan_bytes); // untouched sectors are never read
+  int started = pipeline_start(&pl) == 0;
+  rc = started ? 0 : -1;
+  for(uint32_t s = 0; s < plan.sectors && rc == 0; s++)
+  {
+    uint8_t *flash = plan.flash + s * SECTOR_SIZE;
+    uint8_t *file = plan.file + s * SECTOR_SIZE;
+    uint32_t sector_addr = plan.start + s * SECTOR_SIZE;
+    int known = 0; // content known without reading
+    if(plan.touched[s])
+    {
+      pipeline_wait(&pl, &pl.prepared, s);
+      uint8_t state = plan.state[s];
+      if(scan && (state & (SECTOR_STATE_COVERED | SECTOR_STATE_CACHED)))
+      { // one CRC32 scan is compared with blank, the file and the cache
+        uint32_t flash_crc;
+        int scanned = flash_scan(sp, SCAN_CRC32, sector_addr, SECTOR_SIZE, &flash_crc) == 0;
+        if(scanned && flash_crc == blank_crc)
+        {
+          memset(flash, 0xFF, SECTOR_SIZE);
+          count_blank++;
+          known = 1;
+        }
+        else if(scanned && (state & SECTOR_STATE_BLANK))
+        {
+          memset(flash, 0x00, SECTOR_SIZE); // not blank, classified as erase
+          count_erase_only++;
+          known = 1;
+        }
+        else if(scanned && (state & SECTOR_STATE_COVERED) && flash_crc == plan.file_crc[s])
+        {
+          memcpy(flash, file, SECTOR_SIZE);
+          count_crc++;
+          known = 1;
+        }
+        else if(scanned && (state & SECTOR_STATE_CACHED) && flash_crc == plan.cache_crc[s])
+        {
+          flash_cache_copy(sp, sector_addr, flash);
+          count_cache++;
+          known = 1;
+        }
+      }
+      else if(scan && flash_is_blank(sp, sector_addr, SECTOR_SIZE) == 1)
+      { // partly written sector, its old content is kept
+        memset(flash, 0xFF, SECTOR_SIZE);
+        count_blank++;
+        known = 1;
+      }
+      if(!known)
+      {
+        rc = flash_read(sp, flash, sector_addr, SECTOR_SIZE);
+        plan.state[s] |= SECTOR_STATE_READ;
+      }
+      progress(sp, ++count_done, count_touched);
+    }
+    pipeline_publish(&pl, &pl.read, s + 1);
+  }
+  fprintf(stderr, "\n");
+  if(rc < 0)
+    fprintf(stderr, "pre-read failed\n");
+  else if(scan)
+    printf("pre-read 4K: %d blank, %d equal by CRC32, %d from cache, %d erase only, %d read\n",
+      count_blank, count_crc, count_cache, count_erase_only,
+      count_touched - count_blank - count_crc - count_cache - count_erase_only);
+  sp->stats->phase_seconds[PHASE_PREREAD] += time_now() - time_phase;
+  time_phase = time_now();
+
+  if(started)
+    pipeline_finish(&pl, rc < 0);
+  if(rc == 0)
+  {
+    if(sp->journal_file && !sp->journal_resume)
+      plan_journal(sp, &plan, regions, n); // new journal, all region data is loaded now
+    plan_erases(&plan);
+    print_erase_plan(&plan);
+  }
+  sp->stats->phase_seconds[PHASE_DIFF] += time_now() - time_phase;
+  time_phase = time_now();
+
+  // execute erases
+  for(uint32_t i = 0; i < plan.num_erase && rc == 0; i++)
+  {
+    rc = flash_erase_sector(sp, plan.erase_addr[i], plan.erase_size[i]);
+    progress(sp, i + 1, plan.num_erase);
+  }
+  if(plan.num_erase)
+    fprintf(stderr, "\n");
+  sp->stats->phase_seconds[PHASE_ERASE] += time_now() - time_phase;
+
+  // program and verify each sector, retry with 4K erase on failure
+  uint8_t verify_buf[SECTOR_SIZE];
+  for(uint32_t s = 0; s < plan.sectors && rc == 0; s++)
+  {
+    uint32_t sector_addr = plan.start + s * SECTOR_SIZE;
+    uint8_t *file = plan.file + s * SECTOR_SIZE;
+    int retries_remaining = retry;
+    time_phase = time_now();
+    if(plan.erased[s])
+      rc = program_sector(sp, &plan, s, 1);
+    else if(plan.action[s] == SECTOR_PROGRAM)
+      rc = program_sector(sp, &plan, s, 0);
+    sp->stats->phase_seconds[PHASE_PROGRAM] += time_now() - time_phase;
+    while(rc == 0)
+    {
+      time_phase = time_now();
+      int verified = 0;
+      if(plan.erased[s] || plan.action[s] != SECTOR_UNCHANGED || retries_remaining < retry)
+      { // verify
+        uint32_t flash_crc;
+        if(scan)
+          verified = flash_scan(sp, SCAN_CRC32, sector_addr, SECTOR_SIZE, &flash_crc) == 0
+            && flash_crc == plan.file_crc[s];
+        else
+          verified = flash_read(sp, verify_buf, sector_addr, SECTOR_SIZE) == 0
+            && memcmp(verify_buf, file, SECTOR_SIZE) == 0;
+      }
+      else
+        verified = 1; // unchanged sector was verified by pre-read
+      sp->stats->phase_seconds[PHASE_VERIFY] += time_now() - time_phase;
+      if(verified)
+      {
+        if(plan.touched[s])
+        {
+          flash_cache_store(sp, sector_addr, file, plan.file_crc[s]);
+          journal_mark(sp, s);
+        }
+        break;
+      }
+      if(retries_remaining-- <= 0)
+      {
+        rc = -1;
+        break;
+      }
+      count_retry++;
+      sp->stats->retries_write++;
+      time_phase = time_now();
+      rc = flash_erase_sector(sp, sector_addr, SECTOR_SIZE);
+      sp->stats->phase_seconds[PHASE_ERASE] += time_now() - time_phase;
+      time_phase = time_now();
+      if(rc == 0)
+        rc = program_sector(sp, &plan, s, 1);
+      sp->stats->phase_seconds[PHASE_PROGRAM] += time_now() - time_phase;
+    }
+    progress(sp, s + 1, plan.sectors);
+  }
+  printf("\n"); // after progress bar to new line
+  if(rc < 0)
+    fprintf(stderr, "FAIL\n");
+  else
+  {
+    printf("erased");
+    print_erase_counts(&plan);
+    printf(", programmed %d pages, retries %d\n", plan.count_page, count_retry);
+    if(sp->write_usb_bytes)
+      printf("page program %u bytes, %u bytes over USB with RLE, ratio %.2f\n",
+        sp->write_raw_bytes, sp->write_usb_bytes, (double)sp->write_raw_bytes / sp->write_usb_bytes);
+    print_throughput(sp, "wrote", length, time_now() - time_start);
+  }
+  journal_close(sp, rc == 0);
+  free(plan.flash);
+  free(plan.file);
+  free(plan.action);
+  free(plan.touched);
+  free(plan.state);
+  free(plan.file_crc);
+  free(plan.cache_crc);
+  free(plan.erased);
+  free(plan.erase_addr);
+  free(plan.erase_size);
+  return rc;
+}
+
+
+void close_usb_device(struct fpgasp *sp)
+{
+  if(sp->interface_claimed)
+  {
+    libusb_release_interface(sp->device_handle, 0);
+    sp->interface_claimed = 0;
+  }
+  if(sp->device_handle)
+  {
+    libusb_close(sp->device_handle);
+    sp->device_handle = NULL;
+  }
+  sp->bulk_ep_out = sp->bulk_ep_in = 0;
+  sp->gateware_version = 0;
+  sp->page_pending = 0;
+  sp->page_seq_known = 0;
+  flash_cache_close(sp);
+  if(sp->flash)
+  { // next device is probed again
+    flash_info_defaults(sp->flash);
+    sp->flash_read_mode = &sp->flash->read_modes[READ_SLOW];
+  }
+}
+
+// "bus-port.port" of the device, same as linux sysfs
+void usb_device_path(libusb_device *dev, char *path, int size)
+{
+  uint8_t ports[8];
+  int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+  int len = snprintf(path, size, "%d-", libusb_get_bus_number(dev));
+  for(int i = 0; i < n && len < size; i++)
+    len += snprintf(path + len, size - len, i ? ".%d" : "%d", ports[i]);
+}
+
+// claim interface, read bitstream version and endpoints of opened device
+static int usb_attach(struct fpgasp *sp)
+{
+  int rc;
+  rc = libusb_claim_interface(sp->device_handle, 0);
+  if (rc < 0)
+  {
+    fprintf(stderr, "Error claiming interface: %s\n", libusb_error_name(rc));
+    return -1;
+  }
+  sp->interface_claimed = 1;
+
+  // bitstream version decides which vendor requests may be used
+  struct libusb_device_descriptor desc;
+  if(libusb_get_device_descriptor(libusb_get_device(sp->device_handle), &desc) == 0)
+    sp->gateware_version = desc.bcdDevice;
+
+  // gateware with SPI_BULK lists endpoints of the SPI bridge
+  struct libusb_config_descriptor *config;
+  if(libusb_get_active_config_descriptor(libusb_get_device(sp->device_handle), &config) == 0)
+  {
+    if(config->bNumInterfaces > 0 && config->interface[0].num_altsetting > 0)
+    {
+      const struct libusb_interface_descriptor *intf = &config->interface[0].altsetting[0];
+      for(int i = 0; i < intf->bNumEndpoints; i++)
+      {
+        const struct libusb_endpoint_descriptor *ep = &intf->endpoint[i];
+        if((ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK) != LIBUSB_TRANSFER_TYPE_BULK)
+          continue;
+        if(ep->bEndpointAddress & LIBUSB_ENDPOINT_IN)
+          sp->bulk_ep_in = ep->bEndpointAddress;
+        else
+          sp->bulk_ep_out = ep->bEndpointAddress;
+      }
+    }
+    libusb_free_config_descriptor(config);
+  }
+  return 0;
+}
+
+static void usb_hotplug_free(struct fpgasp *sp);
+
+// libusb is initialized when the first device is listed or opened
+struct fpgasp *fpgasp_new(int queue_depth)
+{
+  struct fpgasp *sp = (struct fpgasp *)calloc(1, sizeof(*sp));
+  if(sp == NULL)
+    return NULL;
+  sp->usb_queue = (struct usb_queue_slot *)calloc(USB_QUEUE_MAX, sizeof(*sp->usb_queue));
+  sp->stats = (struct fpgasp_stats *)calloc(1, sizeof(*sp->stats));
+  sp->page_sent = (struct page_record *)calloc(PAGE_SEQ_WINDOW, sizeof(*sp->page_sent));
+  sp->flash = (struct flash_info *)calloc(1, sizeof(*sp->flash));
+  if(sp->usb_queue == NULL || sp->stats == NULL || sp->page_sent == NULL || sp->flash == NULL)
+  {
+    fpgasp_free(sp);
+    return NULL;
+  }
+  if(queue_depth < 0)
+    queue_depth = 0;
+  if(queue_depth > USB_QUEUE_MAX)
+    queue_depth = USB_QUEUE_MAX;
+  sp->usb_queue_depth = queue_depth;
+  sp->journal_fd = -1;
+  flash_info_defaults(sp->flash);
+  sp->flash_read_mode = &sp->flash->read_modes[READ_SLOW];
+  return sp;
+}
+
+// after this, libusb may be initialized again (in a forked worker)
+void fpgasp_free(struct fpgasp *sp)
+{
+  if(sp == NULL)
+    return;
+  close_usb_device(sp);
+  usb_hotplug_free(sp);
+  if(sp->usb_queue)
+    for(int i = 0; i < USB_QUEUE_MAX; i++)
+      if(sp->usb_queue[i].transfer)
+        libusb_free_transfer(sp->usb_queue[i].transfer);
+  if(sp->libusb_initialized)
+    libusb_exit(sp->usb);
+  free(sp->usb_queue);
+  free(sp->stats);
+  free(sp->page_sent);
+  free(sp->flash);
+  free(sp->journal_file);
+  free(sp);
+}
+
+void fpgasp_set_progress(struct fpgasp *sp, fpgasp_progress_fn progress, void *user)
+{
+  sp->progress = progress;
+  sp->progress_user = user;
+}
+
+uint16_t fpgasp_gateware_version(struct fpgasp *sp)
+{
+  return sp->gateware_version;
+}
+
+static int usb_init(struct fpgasp *sp)
+{
+  if(sp->libusb_initialized)
+    return 0;
+  int r = libusb_init(&sp->usb);
+  if (r < 0)
+  {
+    fprintf(stderr, "Cannot init libusb\n");
+    return -1;
+  }
+  sp->libusb_initialized = 1;
+  return 0;
+}
+
+// list paths of all devices with vid:pid, return how many
+int usb_enumerate(struct fpgasp *sp, uint16_t vid, uint16_t pid, struct usb_target *targets, int max)
+{
+  libusb_device **list;
+  int n = 0;
+  if(usb_init(sp) < 0)
+    return -1;
+  ssize_t count = libusb_get_device_list(sp->usb, &list);
+  for(ssize_t i = 0; i < count && n < max; i++)
+  {
+    struct libusb_device_descriptor desc;
+    if(libusb_get_device_descriptor(list[i], &desc) < 0)
+      continue;
+    if(desc.idVendor != vid || desc.idProduct != pid)
+      continue;
+    memset(&targets[n], 0, sizeof(targets[n]));
+    usb_device_path(list[i], targets[n].path, sizeof(targets[n].path));
+    n++;
+  }
+  if(count >= 0)
+    libusb_free_device_list(list, 1);
+  return n;
+}
+
+// open device with vid:pid at given path, path NULL opens the first one
+int open_usb_device(struct fpgasp *sp, uint16_t vid, uint16_t pid, const char *path)
+{
+  libusb_device **list;
+  if(usb_init(sp) < 0)
+    return -1;
+  ssize_t count = libusb_get_device_list(sp->usb, &list);
+  for(ssize_t i = 0; i < count && sp->device_handle == NULL; i++)
+  {
+    struct libusb_device_descriptor desc;
+    char dev_path[USB_PATH_MAX];
+    if(libusb_get_device_descriptor(list[i], &desc) < 0)
+      continue;
+    if(desc.idVendor != vid || desc.idProduct != pid)
+      continue;
+    usb_device_path(list[i], dev_path, sizeof(dev_path));
+    if(path != NULL && strcmp(path, dev_path) != 0)
+      continue;
+    if(libusb_open(list[i], &sp->device_handle) < 0)
+      sp->device_handle = NULL;
+  }
+  if(count >= 0)
+    libusb_free_device_list(list, 1);
+  if (!sp->device_handle)
+  {
+    fprintf(stderr, "Error finding USB device %04X:%04X%s%s\n", vid, pid, path ? " at " : "", path ? path : "");
+    return -1;
+  }
+  if(usb_attach(sp) < 0)
+  {
+    close_usb_device(sp);
+    return -1;
+  }
+  memset(sp->stats, 0, sizeof(*sp->stats)); // statistics of this device
+  sp->write_raw_bytes = sp->write_usb_bytes = 0;
+  return 0;
+}
+
+// **** hotplug ****
+// devices of vid:pid that arrive are queued by path until
+// usb_wait_device() takes them. with libusb hotplug the callback queues
+// them (it must not open devices), without it the device list is polled.
+#define HOTPLUG_QUEUE USB_TARGETS_MAX
+#define HOTPLUG_POLL_MS 100 // list interval without libusb hotplug
+#define HOTPLUG_EVENTS_MS 100 // longest libusb_handle_events wait
+
+struct hotplug
+{
+  uint16_t vid, pid;
+  int callback; // 1: libusb_hotplug_register_callback, 0: polling
+  libusb_hotplug_callback_handle handle;
+  char arrived[HOTPLUG_QUEUE][USB_PATH_MAX]; // not yet taken, oldest first
+  int count;
+  struct usb_target attached[USB_TARGETS_MAX]; // polling: list before
+  int attached_count;
+};
+
+static void hotplug_arrived(struct hotplug *hp, const char *path)
+{
+  for(int i = 0; i < hp->count; i++)
+    if(strcmp(hp->arrived[i], path) == 0)
+      return;
+  if(hp->count == HOTPLUG_QUEUE)
+    return;
+  snprintf(hp->arrived[hp->count++], USB_PATH_MAX, "%s", path);
+}
+
+// device that left before it was taken is dropped
+static void hotplug_left(struct hotplug *hp, const char *path)
+{
+  for(int i = 0; i < hp->count; i++)
+    if(strcmp(hp->arrived[i], path) == 0)
+    {
+      memmove(hp->arrived[i], hp->arrived[i+1], (hp->count - i - 1) * USB_PATH_MAX);
+      hp->count--;
+      return;
+    }
+}
+
+static int LIBUSB_CALL hotplug_callback(libusb_context *ctx, libusb_device *dev,
+  libusb_hotplug_event event, void *user)
+{
+  struct hotplug *hp = (struct hotplug *)user;
+  char path[USB_PATH_MAX];
+  usb_device_path(dev, path, sizeof(path));
+  if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+    hotplug_arrived(hp, path);
+  else
+    hotplug_left(hp, path);
+  return 0; // stay registered
+}
+
+// compare the device list with the one before
+static int hotplug_poll(struct fpgasp *sp)
+{
+  struct hotplug *hp = sp->hotplug;
+  struct usb_target now[USB_TARGETS_MAX];
+  int n = usb_enumerate(sp, hp->vid, hp->pid, now, USB_TARGETS_MAX);
+  if(n < 0)
+    return -1;
+  for(int i = 0; i < hp->attached_count; i++)
+  {
+    int k = 0;
+    while(k < n && strcmp(now[k].path, hp->attached[i].path) != 0)
+      k++;
+    if(k == n)
+      hotplug_left(hp, hp->attached[i].path);
+  }
+  for(int k = 0; k < n; k++)
+  {
+    int i = 0;
+    while(i < hp->attached_count && strcmp(now[k].path, hp->attached[i].path) != 0)
+      i++;
+    if(i == hp->attached_count)
+      hotplug_arrived(hp, now[k].path);
+  }
+  memcpy(hp->attached, now, n * sizeof(now[0]));
+  hp->attached_count = n;
+  return 0;
+}
+
+static int usb_hotplug_start(struct fpgasp *sp, uint16_t vid, uint16_t pid)
+{
+  if(sp->hotplug && sp->hotplug->vid == vid && sp->hotplug->pid == pid)
+    return 0;
+  usb_hotplug_free(sp);
+  if(usb_init(sp) < 0)
+    return -1;
+  struct hotplug *hp = (struct hotplug *)calloc(1, sizeof(*hp));
+  if(hp == NULL)
+    return -1;
+  hp->vid = vid;
+  hp->pid = pid;
+  sp->hotplug = hp;
+  if(libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+  { // devices already attached arrive during registration
+    int rc = libusb_hotplug_register_callback(sp->usb,
+      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+      LIBUSB_HOTPLUG_ENUMERATE, vid, pid, LIBUSB_HOTPLUG_MATCH_ANY,
+      hotplug_callback, hp, &hp->handle);
+    if(rc == 0)
+    {
+      hp->callback = 1;
+      return 0;
+    }
+    fprintf(stderr, "libusb hotplug: %s, polling devices\n", libusb_error_name(rc));
+  }
+  return hotplug_poll(sp);
+}
+
+static void usb_hotplug_free(struct fpgasp *sp)
+{
+  if(sp->hotplug == NULL)
+    return;
+  if(sp->hotplug->callback)
+    libusb_hotplug_deregister_callback(sp->usb, sp->hotplug->handle);
+  free(sp->hotplug);
+  sp->hotplug = NULL;
+}
+
+// next device of vid:pid that arrived since the first call, devices
+// attached at the first call count as arrived. timeout_ms < 0: no timeout.
+// return value 1: target->path is set, 0: timeout or signal, -1: error
+int usb_wait_device(struct fpgasp *sp, uint16_t vid, uint16_t pid, struct usb_target *target, int timeout_ms)
+{
+  if(usb_hotplug_start(sp, vid, pid) < 0)
+    return -1;
+  struct hotplug *hp = sp->hotplug;
+  double deadline = time_now() + 1.0e-3 * timeout_ms;
+  while(hp->count == 0)
+  {
+    double remaining = timeout_ms < 0 ? HOTPLUG_EVENTS_MS : 1.0e3 * (deadline - time_now());
+    if(remaining <= 0)
+      return 0;
+    int wait_ms = remaining < HOTPLUG_EVENTS_MS ? (int)remaining + 1 : HOTPLUG_EVENTS_MS;
+    if(hp->callback)
+    {
+      struct timeval tv = {0, 1000 * wait_ms};
+      int rc = libusb_handle_events_timeout_completed(sp->usb, &tv, NULL);
+      if(rc == LIBUSB_ERROR_INTERRUPTED)
+        return 0; // caller may have been asked to stop
+      if(rc < 0)
+      {
+        fprintf(stderr, "libusb_handle_events: %s\n", libusb_error_name(rc));
+        return -1;
+      }
+    }
+    else
+    {
+      if(usleep(1000 * (wait_ms < HOTPLUG_POLL_MS ? wait_ms : HOTPLUG_POLL_MS)) < 0 && errno == EINTR)
+        return 0;
+      if(hotplug_poll(sp) < 0)
+        return -1;
+    }
+  }
+  memset(target, 0, sizeof(*target));
+  snprintf(target->path, sizeof(target->path), "%s", hp->arrived[0]);
+  hotplug_left(hp, hp->arrived[0]);
+  return 1;
+}
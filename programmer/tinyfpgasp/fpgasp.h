@@ -0,0 +1,118 @@
+#ifndef FPGASP_H
+#define FPGASP_H
+
+// flash programming library of tinyfpgasp. All state of a session
+// (libusb context, opened device, transfer queue, read mode, statistics)
+// is in the handle, so one program may drive several devices.
+//
+//   struct fpgasp *sp = fpgasp_new(8);
+//   if(open_usb_device(sp, 0x16c0, 0x05dc, NULL) == 0
+//   && usb_select_transport(sp, "auto") == 0
+//   && flash_select_read_mode(sp, "auto") == 0)
+//     read_file_write_flash(sp, "image.bit", 0x200000, 0);
+//   fpgasp_free(sp);
+
+#include <stdint.h>
+
+struct fpgasp;
+
+// bcdDevice from which gateware supports a feature
+#define GATEWARE_FLASH_SCAN 0x0002 // bRequest 2:CRC32 3:blank check
+#define GATEWARE_READ_MODES 0x0003 // wIndex header/width, bRequest 4:capabilities
+#define GATEWARE_MULTI_PACKET 0x0004 // data stage up to 4096 bytes, bRequest 5:stream read
+#define GATEWARE_CHECKED_READ 0x0005 // bRequest 6:stream read with CRC32, continued across requests
+#define GATEWARE_RLE_WRITE 0x0006 // bRequest 7:SPI OUT with RLE coded data stage
+#define GATEWARE_PAGE_ENGINE 0x0007 // bRequest 8:double-buffered page program, gateware polls WIP
+#define GATEWARE_PAGE_SEQUENCE 0x0008 // bRequest 8 pages with sequence numbers
+#define GATEWARE_SPI_CLOCK 0x0009 // bRequest 9:SPI clock divider and MISO sample delay
+
+#define USB_QUEUE_MAX 64 // limit of queue_depth
+
+// devices are selected by USB path or flash unique ID
+#define USB_PATH_MAX 32
+#define USB_TARGETS_MAX 32
+struct usb_target
+{
+  char path[USB_PATH_MAX]; // bus-port.port
+  char uid[17]; // flash unique ID in hex, empty if not read
+};
+
+// one file programmed at addr, length 0: whole file
+struct flash_region
+{
+  const char *filename;
+  uint32_t addr, length;
+};
+
+// progress of the current step, called often
+typedef void (*fpgasp_progress_fn)(void *user, uint32_t done, uint32_t total);
+
+// handle
+// queue_depth: USB transfers in flight, 0: synchronous
+struct fpgasp *fpgasp_new(int queue_depth);
+void fpgasp_free(struct fpgasp *sp);
+void fpgasp_set_progress(struct fpgasp *sp, fpgasp_progress_fn progress, void *user);
+uint16_t fpgasp_gateware_version(struct fpgasp *sp);
+
+// device
+int usb_enumerate(struct fpgasp *sp, uint16_t vid, uint16_t pid, struct usb_target *targets, int max);
+int open_usb_device(struct fpgasp *sp, uint16_t vid, uint16_t pid, const char *path);
+void close_usb_device(struct fpgasp *sp);
+int usb_select_transport(struct fpgasp *sp, const char *name);
+int flash_select_read_mode(struct fpgasp *sp, const char *name);
+// next device of vid:pid plugged in, devices attached at the first call
+// count as plugged in. the handle keeps listening between calls, open and
+// close a device in between. timeout_ms < 0: wait forever.
+// return value 1: path of the device in target, 0: timeout or signal, -1: error
+int usb_wait_device(struct fpgasp *sp, uint16_t vid, uint16_t pid, struct usb_target *target, int timeout_ms);
+
+// flash
+// geometry and opcodes from SFDP, once per device, flash_select_read_mode() calls it
+int flash_probe(struct fpgasp *sp);
+int flash_read_id(struct fpgasp *sp);
+int flash_read_jedec_id(struct fpgasp *sp, uint8_t *id);
+int flash_read_uid(struct fpgasp *sp, char *hex);
+int flash_read_status(struct fpgasp *sp);
+int flash_read(struct fpgasp *sp, uint8_t *data, uint32_t addr, uint32_t length);
+int flash_erase_sector(struct fpgasp *sp, uint32_t addr, uint32_t len);
+int flash_write(struct fpgasp *sp, uint8_t *data, uint32_t addr, uint32_t length);
+int flash_crc32_match(struct fpgasp *sp, const uint8_t *data, uint32_t addr, uint32_t length);
+int flash_is_blank(struct fpgasp *sp, uint32_t addr, uint32_t length);
+
+// files
+int read_flash_write_file(struct fpgasp *sp, const char *filename, uint32_t addr, uint32_t length);
+int read_file_write_flash(struct fpgasp *sp, const char *filename, uint32_t addr, uint32_t length);
+int write_regions(struct fpgasp *sp, struct flash_region *regions, int n);
+
+// flash content cache of the opened board, a file in dir named by
+// JEDEC ID and unique ID. write_regions() takes sectors from it instead
+// of reading them when gateware CRC32 confirms them. closed with the device.
+int flash_cache_open(struct fpgasp *sp, const char *dir);
+void flash_cache_close(struct fpgasp *sp);
+
+// SPI clock of the bootloader: 24 MHz/(divider+1), MISO sampled delay
+// 48 MHz cycles after the rising clock edge (0-divider).
+// calibrate finds the fastest setting whose reads equal a read at the
+// slowest clock and latest sample point, backed off one divider step
+// from the first that fails.
+// tune applies the setting saved in filename after a check read, else
+// (or with recalibrate) calibrates and saves it, one file per board;
+// a flash with too little data to calibrate is saved as the default clock.
+int spi_clock_set(struct fpgasp *sp, int divider, int delay);
+int spi_clock_calibrate(struct fpgasp *sp, int *divider, int *delay);
+int spi_clock_tune(struct fpgasp *sp, const char *filename, int recalibrate);
+
+// journal file of write_regions(): hash of flash and images, range and
+// verified sectors. resume 1: sectors verified by an interrupted write
+// of the same images are skipped. removed when the write succeeds.
+int fpgasp_set_journal(struct fpgasp *sp, const char *filename, int resume);
+
+// statistics of the session, path is reported as device
+void stats_print_text(struct fpgasp *sp);
+void stats_print_json(struct fpgasp *sp, const char *path);
+
+// utility
+double time_now(void);
+uint32_t crc32(uint32_t crc, const uint8_t *data, uint32_t length);
+
+#endif
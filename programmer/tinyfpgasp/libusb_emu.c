@@ -0,0 +1,1038 @@
+// libusb replacement which emulates the tinyfpga SP bootloader
+// (usb_sp_ctrl_ep.v vendor requests and usb_spi_bridge_ep.v bulk frames)
+// in front of a simulated SPI NOR flash.
+// Link it instead of -lusb-1.0 to run tinyfpgasp without a board:
+//
+//   make tinyfpgasp-emu
+//   EMU_FLASH=flash.bin ./tinyfpgasp-emu -w image.bit
+//
+// Time is virtual: each USB transfer, SPI byte, page program and erase
+// advances a clock by a configurable latency, so throughput results
+// don't depend on the host machine. usleep() of the programmer while
+// a device is open advances the clock too. At exit a report line with time,
+// MB/s, USB transactions and flash operations is printed to stderr.
+//
+// environment:
+// EMU_FLASH         flash content file, loaded at open and saved at close
+//                   (with EMU_DEVICES > 1 device i uses file EMU_FLASH.i)
+// EMU_FLASH_SIZE    flash size in bytes (default 16M), above 16M the flash
+//                   has an extended address register (0xC5/0xC8)
+// EMU_SFDP          0: flash without SFDP table (default 1)
+// EMU_DEVICES       number of attached devices (default 1)
+// EMU_BCD           bcdDevice reported by the gateware in hex (default 9)
+// EMU_BULK          1: config descriptor lists the bulk SPI endpoints
+// EMU_USB_US        latency of a synchronous transfer (default 1000 us)
+// EMU_QUEUE_US      latency of a transfer with others in flight (default 125 us)
+// EMU_BYTE_NS       time per USB payload byte (default 900 ns)
+// EMU_SPI_NS        time per SPI byte of a gateware flash scan (default 670 ns)
+//                   at SPI clock divider 0, times divider+1
+// EMU_SPI_DIV       SPI clock divider after USB reset, SPI_DIV of the board (default 0)
+// EMU_SPI_SKEW      board trace delay from SPI clock to MISO in gateware clock
+//                   cycles: SPI and stream reads at a setting with
+//                   divider+1+sample delay < skew get each bit one clock late
+// EMU_PP_US         page program time (default 700 us)
+// EMU_ERASE_4K_US   sector erase times (default 45000, 120000, 150000 us)
+// EMU_ERASE_32K_US
+// EMU_ERASE_64K_US
+// EMU_BYTES         workload size, if set the report includes MB/s
+// EMU_READ_ERRORS   N: every Nth checked stream data stage arrives corrupted
+// EMU_USB_ERRORS    N: every Nth SPI OUT or page program OUT fails, alternately
+//                   before the device gets it and after it was processed
+// EMU_UNPLUG_MS     T: device is unplugged at virtual time T ms, all later
+//                   transfers fail, flash keeps what was written until then
+// EMU_HOTPLUG_MS    T: every T ms of virtual time all devices are swapped
+//                   for new boards with blank flash (EMU_FLASH is removed),
+//                   hotplug callbacks see them leave and arrive. while the
+//                   programmer waits without an open device, time runs to
+//                   the next swap; after the last board it gets SIGTERM
+// EMU_HOTPLUG_BOARDS number of board sets for EMU_HOTPLUG_MS (default 3)
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <libusb-1.0/libusb.h>
+
+#define EMU_DEVICES_MAX 16
+#define EMU_PACKET_MAX 32 // control endpoint packet size
+#define EMU_TRANSFER_MAX 4096 // longest data stage with multi-packet gateware
+#define EMU_GATEWARE_MULTI_PACKET 0x0004
+#define EMU_GATEWARE_CHECKED_READ 0x0005
+#define EMU_GATEWARE_RLE_WRITE 0x0006
+#define EMU_GATEWARE_PAGE_ENGINE 0x0007
+#define EMU_GATEWARE_PAGE_SEQUENCE 0x0008
+#define EMU_GATEWARE_SPI_CLOCK 0x0009
+#define EMU_PENDING_MAX 1024 // asynchronous transfers in flight
+#define EMU_BULK_FIFO (1 << 17) // bulk IN data waiting to be read
+
+struct libusb_device
+{
+  int index;
+};
+
+struct libusb_device_handle
+{
+  int index;
+  int board; // board set it was opened on, later sets don't know it
+};
+
+static struct libusb_device emu_devices[EMU_DEVICES_MAX];
+static struct libusb_device_handle emu_handle;
+static int emu_opened = -1; // index of the opened device, -1: none
+static int board; // set of boards attached, counts EMU_HOTPLUG_MS swaps
+static int board_reported; // last set hotplug callbacks saw arrive
+static libusb_hotplug_callback_fn hotplug_fn; // NULL: not registered
+static void *hotplug_user;
+
+// latencies, from environment at libusb_init
+static double lat_usb_us, lat_queue_us, byte_us, spi_byte_us;
+static double program_us, erase_us[3];
+static int spi_skew, spi_div_reset;
+
+// statistics for the report
+static double time_us; // virtual time
+static unsigned long count_out, count_in, count_erase[3], count_program, count_status;
+static unsigned long count_usb_bytes; // payload of all transfers
+
+// SPI flash state
+static uint8_t *flash;
+static uint32_t flash_size;
+static double busy_until_us; // WIP is set until this time
+static int write_enable; // WEL
+static int cs_active; // chip select low
+static uint8_t command;
+static uint32_t command_bytes; // bytes shifted since chip select went low
+static uint32_t address;
+static uint8_t page_data[256], page_written[256]; // page program buffer
+static uint8_t jedec_id[3];
+static uint8_t sfdp[256]; // SFDP header and basic flash parameter table
+static uint8_t ext_address; // extended address register, address[31:24]
+static uint8_t ext_value; // data byte of a register write
+
+// gateware state
+static uint8_t in_buf[EMU_PACKET_MAX]; // MISO of the last SPI OUT
+static uint32_t scan_result;
+static int scan_busy; // status polls until the scan reports done
+static int scan_open; // chip select held low by a checked stream
+static unsigned long checked_reads; // for EMU_READ_ERRORS
+static double page_done_us[2]; // page program engine: buffer is free from this time
+static int page_fill; // buffer USB fills next
+static uint8_t page_seq; // sequence number of the next accepted page
+static int page_seq_error; // a page with a later sequence number was dropped
+static unsigned long count_usb_errors; // for EMU_USB_ERRORS
+static int spi_div, spi_delay; // SPI clock divider and MISO sample delay
+static uint8_t miso_last; // byte before, its last bit comes late
+static uint8_t bulk_fifo[EMU_BULK_FIFO];
+static uint32_t bulk_fifo_read, bulk_fifo_write;
+
+static double env_double(const char *name, double value)
+{
+  const char *s = getenv(name);
+  return s ? atof(s) : value;
+}
+
+static int env_int(const char *name, int value)
+{
+  const char *s = getenv(name);
+  return s ? (int)strtol(s, NULL, 0) : value;
+}
+
+static int gateware_version(void)
+{
+  const char *s = getenv("EMU_BCD");
+  return s ? (int)strtol(s, NULL, 16) : EMU_GATEWARE_SPI_CLOCK;
+}
+
+static int device_count(void)
+{
+  int n = env_int("EMU_DEVICES", 1);
+  return n < 1 ? 1 : n > EMU_DEVICES_MAX ? EMU_DEVICES_MAX : n;
+}
+
+static uint32_t crc32(const uint8_t *data, uint32_t len)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  while(len--)
+  {
+    crc ^= *data++;
+    for(int i = 0; i < 8; i++)
+      crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+  }
+  return ~crc;
+}
+
+// **** SPI NOR flash ****
+
+static int flash_busy(void)
+{
+  return time_us < busy_until_us;
+}
+
+static int address_command(uint8_t c)
+{
+  switch(c)
+  {
+    case 0x02: case 0x03: case 0x0B: case 0x3B: case 0x6B: case 0x4B:
+    case 0x20: case 0x52: case 0xD8: case 0x5A:
+      return 1;
+  }
+  return 0;
+}
+
+static void flash_select(void)
+{
+  cs_active = 1;
+  command_bytes = 0;
+  address = 0;
+  memset(page_written, 0, sizeof(page_written));
+}
+
+// write and erase commands execute when chip select goes high
+static void flash_deselect(void)
+{
+  if(!cs_active)
+    return;
+  cs_active = 0;
+  if(command_bytes == 0 || flash_busy())
+    return;
+  switch(command)
+  {
+    case 0x06: // write enable
+      write_enable = 1;
+      return;
+    case 0x04: // write disable
+      write_enable = 0;
+      return;
+  }
+  if(!write_enable)
+    return;
+  if(command == 0xC5 && command_bytes == 2) // write extended address register
+  {
+    ext_address = ext_value;
+    write_enable = 0;
+    return;
+  }
+  if(command == 0x02 && command_bytes > 4) // page program, only 1->0 bit changes
+  {
+    uint32_t page = address & ~0xFF;
+    for(int i = 0; i < 256; i++)
+      if(page_written[i])
+        flash[(page + i) % flash_size] &= page_data[i];
+    busy_until_us = time_us + program_us;
+    write_enable = 0;
+    count_program++;
+    return;
+  }
+  int size_index = command == 0x20 ? 0 : command == 0x52 ? 1 : command == 0xD8 ? 2 : -1;
+  if(size_index >= 0 && command_bytes == 4)
+  {
+    static const uint32_t erase_size[] = {4*1024, 32*1024, 64*1024};
+    uint32_t size = erase_size[size_index];
+    memset(flash + (address & ~(size-1)) % flash_size, 0xFF, size);
+    busy_until_us = time_us + erase_us[size_index];
+    write_enable = 0;
+    count_erase[size_index]++;
+  }
+}
+
+// shift one byte, returns MISO
+static uint8_t flash_shift(uint8_t mosi)
+{
+  uint32_t i = command_bytes++;
+  if(i == 0)
+  {
+    command = mosi;
+    if(command == 0x05)
+      count_status++;
+    return 0xFF;
+  }
+  if(command == 0x05) // read status register
+    return (flash_busy() ? 1 : 0) | (write_enable ? 2 : 0);
+  if(flash_busy()) // other commands are ignored during program or erase
+    return 0xFF;
+  if(i <= 3 && address_command(command))
+  {
+    address = (address << 8) | mosi;
+    if(i == 3 && command != 0x5A) // 3-byte address in the selected 16M bank
+      address |= (uint32_t)ext_address << 24;
+    return 0xFF;
+  }
+  switch(command)
+  {
+    case 0x03: // read
+      return flash[(address + i - 4) % flash_size];
+    case 0x0B: // fast read, 1 dummy byte
+      return i < 5 ? 0xFF : flash[(address + i - 5) % flash_size];
+    case 0x3B: // dual output, 2 dummy bytes at single width
+      return i < 6 ? 0xFF : flash[(address + i - 6) % flash_size];
+    case 0x6B: // quad output, 4 dummy bytes at single width
+      return i < 8 ? 0xFF : flash[(address + i - 8) % flash_size];
+    case 0x02: // page program wraps inside the page
+    {
+      uint8_t a = address + i - 4;
+      page_data[a] = mosi;
+      page_written[a] = 1;
+      return 0xFF;
+    }
+    case 0x4B: // unique ID after 4 dummy bytes, differs per device
+      return i < 5 ? 0xFF : 0xA0 + (emu_opened & 0xF) + 0x10 * ((i - 5) & 7) + (i == 12 ? board : 0);
+    case 0x9F: // JEDEC ID
+      return i <= 3 ? jedec_id[i-1] : 0xFF;
+    case 0x5A: // SFDP after 1 dummy byte
+      return i < 5 ? 0xFF : sfdp[(address + i - 5) & 0xFF];
+    case 0xC5: // write extended address register
+      if(i == 1)
+        ext_value = mosi;
+      return 0xFF;
+    case 0xC8: // read extended address register
+      return ext_address;
+    case 0xAB: // release power down, device ID
+      return i >= 4 ? 0x17 : 0xFF;
+  }
+  return 0xFF;
+}
+
+// MISO as sampled by the gateware, too fast a setting for
+// EMU_SPI_SKEW gets each bit one SPI clock late
+static uint8_t miso_sample(uint8_t miso)
+{
+  uint8_t late = (miso >> 1) | (miso_last << 7);
+  miso_last = miso;
+  return spi_div + 1 + spi_delay < spi_skew ? late : miso;
+}
+
+static void put_dword(uint8_t *p, uint32_t v)
+{
+  for(int i = 0; i < 4; i++)
+    p[i] = v >> (8*i);
+}
+
+// SFDP time field: 5 bit count, 2 bit unit of 1, 16, 128, 1000 ms
+static uint32_t sfdp_erase_time(double us)
+{
+  static const double unit_us[] = {1000, 16000, 128000, 1000000};
+  int unit = 0;
+  while(unit < 3 && us > 32 * unit_us[unit])
+    unit++;
+  int count = (int)(us / unit_us[unit] + 0.5) - 1;
+  return (count < 0 ? 0 : count > 31 ? 31 : count) | unit << 5;
+}
+
+// Winbond W25Q128JV/W25Q256JV like JEDEC ID and SFDP (JESD216B),
+// times are the emulated ones
+static void sfdp_init(void)
+{
+  int capacity = 0;
+  while((1u << capacity) < flash_size)
+    capacity++;
+  jedec_id[0] = 0xEF;
+  jedec_id[1] = 0x40;
+  jedec_id[2] = capacity;
+  memset(sfdp, 0xFF, sizeof(sfdp));
+  if(env_int("EMU_SFDP", 1) == 0)
+    return;
+  int big = flash_size > 16*1024*1024;
+  uint8_t *t = sfdp + 0x80;
+  put_dword(sfdp + 0x00, 0x50444653); // "SFDP"
+  put_dword(sfdp + 0x04, 0xFF000106); // revision 1.6, 1 parameter header
+  put_dword(sfdp + 0x08, 0x10010600); // basic table revision 1.6, 16 DWORDs
+  put_dword(sfdp + 0x0C, 0xFF000080); // at 0x80
+  put_dword(t + 0, 0xFFF120E5 | (big ? 1 << 17 : 0)); // 4K erase 0x20, 1-1-2, 1-2-2, 1-4-4, 1-1-4, 3 or 4 byte address
+  put_dword(t + 4, flash_size * 8 - 1); // density in bits
+  put_dword(t + 8, 0x6B08EB44); // 1-1-4 0x6B 8 dummy clocks, 1-4-4 0xEB
+  put_dword(t + 12, 0xBB423B08); // 1-2-2 0xBB, 1-1-2 0x3B 8 dummy clocks
+  put_dword(t + 16, 0xFFFFFFEE);
+  put_dword(t + 20, 0xFF00FFFF);
+  put_dword(t + 24, 0xFF00FFFF);
+  put_dword(t + 28, 0x520F200C); // erase 4K 0x20, 32K 0x52
+  put_dword(t + 32, 0x0000D810); // erase 64K 0xD8
+  put_dword(t + 36, 2 | sfdp_erase_time(erase_us[0]) << 4 | sfdp_erase_time(erase_us[1]) << 11
+    | sfdp_erase_time(erase_us[2]) << 18);
+  int program_units = program_us > 256 ? 1 : 0; // of 64 us, else 8 us
+  int program_count = (int)(program_us / (program_units ? 64 : 8) + 0.5) - 1;
+  put_dword(t + 40, 2 | 8 << 4 | ((program_count < 0 ? 0 : program_count > 31 ? 31 : program_count) | program_units << 5) << 8);
+  put_dword(t + 44, 0);
+  put_dword(t + 48, 0);
+  put_dword(t + 52, 0);
+  put_dword(t + 56, 5 << 20); // QE is status register 2 bit 1, read 0x35
+  put_dword(t + 60, big ? 0x05000000 : 0); // enter 4-byte addressing: B7, extended address register
+}
+
+static const char *flash_file(int index)
+{
+  static char name[1024];
+  const char *file = getenv("EMU_FLASH");
+  if(file == NULL || device_count() == 1)
+    return file;
+  snprintf(name, sizeof(name), "%s.%d", file, index + 1);
+  return name;
+}
+
+static void flash_load(int index)
+{
+  const char *file = flash_file(index);
+  memset(flash, 0xFF, flash_size);
+  FILE *fp = file ? fopen(file, "rb") : NULL;
+  if(fp)
+  {
+    if(fread(flash, 1, flash_size, fp) == 0 && ferror(fp))
+      perror(file);
+    fclose(fp);
+  }
+}
+
+static void flash_save(int index)
+{
+  const char *file = flash_file(index);
+  FILE *fp = file ? fopen(file, "wb") : NULL;
+  if(fp)
+  {
+    fwrite(flash, 1, flash_size, fp);
+    fclose(fp);
+  }
+}
+
+// opened device still attached, not swapped by EMU_HOTPLUG_MS
+static int opened_attached(void)
+{
+  return emu_opened >= 0 && emu_handle.board == board;
+}
+
+static void emu_report(void)
+{
+  if(opened_attached())
+    flash_save(emu_opened);
+  if(time_us == 0)
+    return;
+  double bytes = env_double("EMU_BYTES", 0);
+  fprintf(stderr, "emu: %.3f s", time_us * 1.0e-6);
+  if(bytes > 0)
+    fprintf(stderr, " %.3f MB/s", bytes / time_us);
+  fprintf(stderr, ", USB OUT %lu IN %lu %lu bytes, erase 4K %lu 32K %lu 64K %lu, program %lu, status %lu",
+    count_out, count_in, count_usb_bytes, count_erase[0], count_erase[1], count_erase[2], count_program, count_status);
+  if(count_usb_errors)
+    fprintf(stderr, ", USB errors %lu", count_usb_errors);
+  fprintf(stderr, "\n");
+}
+
+// **** usb_sp_ctrl_ep.v vendor requests ****
+
+// data stage of SPI OUT is NAKed until the scan and the page engine are done,
+// pages wait while chip select is held by a continued transfer
+static void spi_out_wait(void)
+{
+  scan_busy = 0;
+  if(cs_active)
+    return;
+  for(int i = 0; i < 2; i++)
+    if(time_us < page_done_us[i])
+      time_us = page_done_us[i];
+}
+
+static int control_out(uint8_t request, uint16_t value, uint16_t index, const uint8_t *data, uint16_t length)
+{
+  count_out++;
+  switch(request)
+  {
+    case 0: // SPI, wValue bit 0 keeps chip select low after the transfer
+      if(length > 0)
+        spi_out_wait();
+      if(!cs_active)
+        flash_select();
+      for(int i = 0; i < length; i++)
+        in_buf[i % EMU_PACKET_MAX] = miso_sample(flash_shift(data[i]));
+      if((value & 1) == 0)
+        flash_deselect();
+      return length;
+    case 2: // CRC32 scan, wValue address and wIndex length in 256 byte pages
+    case 3: // blank check scan
+    {
+      uint32_t start = (uint32_t)ext_address << 24 | value * 256, len = index * 256;
+      time_us += len * spi_byte_us * (spi_div + 1);
+      scan_busy = 1;
+      if(request == 2)
+        scan_result = crc32(flash + start % flash_size, len);
+      else
+      {
+        scan_result = 0xFFFFFFFF;
+        for(uint32_t i = 0; i < len; i++)
+          if(flash[(start + i) % flash_size] != 0xFF)
+          {
+            scan_result = start + i;
+            break;
+          }
+      }
+      return length;
+    }
+    case 8: // page program engine, wValue address[23:8], wIndex[7:0] address[7:0], wIndex[15] RLE
+    {       // wIndex[14] sequence number in wIndex[13:8]
+      uint8_t page[256];
+      uint32_t decoded = 0, addr = (uint32_t)ext_address << 24 | (uint32_t)value << 8 | (index & 0xFF);
+      if(gateware_version() < EMU_GATEWARE_PAGE_ENGINE)
+        return LIBUSB_ERROR_PIPE;
+      if(gateware_version() >= EMU_GATEWARE_PAGE_SEQUENCE && (index & 0x4000))
+      {
+        uint8_t seq = (index >> 8) & 0x3F;
+        if(seq != page_seq)
+        { // dropped, a repeated page is not an error
+          if(seq != ((page_seq - 1) & 0x3F))
+            page_seq_error = 1;
+          return length;
+        }
+      }
+      for(int i = 0; i < length && decoded < sizeof(page); )
+      {
+        if((index & 0x8000) == 0)
+        {
+          page[decoded++] = data[i++];
+          continue;
+        }
+        int run = (data[i] & 0x7F) + 1, repeat = data[i] & 0x80;
+        i++;
+        for(int k = 0; k < run && i < length && decoded < sizeof(page); k++)
+          page[decoded++] = repeat ? data[i] : data[i++];
+        if(repeat)
+          i++;
+      }
+      if(decoded == 0 || (addr & 0xFF) + decoded > 256)
+        return LIBUSB_ERROR_PIPE;
+      // data stage is NAKed until the buffer is free,
+      // the page is programmed after the one in the other buffer
+      if(time_us < page_done_us[page_fill])
+        time_us = page_done_us[page_fill];
+      double start = time_us;
+      if(start < page_done_us[!page_fill])
+        start = page_done_us[!page_fill];
+      if(start < busy_until_us)
+        start = busy_until_us;
+      for(uint32_t i = 0; i < decoded; i++)
+        flash[(addr + i) % flash_size] &= page[i];
+      page_done_us[page_fill] = busy_until_us = start + program_us;
+      write_enable = 0;
+      count_program++;
+      page_fill ^= 1;
+      page_seq = (page_seq + 1) & 0x3F;
+      return length;
+    }
+    case 9: // SPI clock, wValue divider, wIndex MISO sample delay up to the divider
+      if(gateware_version() < EMU_GATEWARE_SPI_CLOCK)
+        return LIBUSB_ERROR_PIPE;
+      spi_div = value & 0xFF;
+      spi_delay = (index & 0xFF) > spi_div ? spi_div : index & 0xFF;
+      return length;
+    case 7: // RLE coded SPI OUT, wIndex decoded length
+    {
+      uint32_t decoded = 0;
+      if(gateware_version() < EMU_GATEWARE_RLE_WRITE)
+        return LIBUSB_ERROR_PIPE;
+      spi_out_wait();
+      if(!cs_active)
+        flash_select();
+      for(int i = 0; i < length; )
+      {
+        int run = (data[i] & 0x7F) + 1, repeat = data[i] & 0x80;
+        i++;
+        for(int k = 0; k < run && i < length; k++)
+          flash_shift(repeat ? data[i] : data[i++]);
+        if(repeat)
+          i++;
+        decoded += run;
+      }
+      if(decoded != index)
+      {
+        fprintf(stderr, "emu: RLE decoded %u bytes, expected %u\n", decoded, index);
+        return LIBUSB_ERROR_PIPE;
+      }
+      if((value & 1) == 0)
+        flash_deselect();
+      return length;
+    }
+  }
+  return LIBUSB_ERROR_PIPE;
+}
+
+static int control_in(uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length)
+{
+  count_in++;
+  switch(request)
+  {
+    case 0: // MISO of the last SPI OUT
+      memcpy(data, in_buf, length > EMU_PACKET_MAX ? EMU_PACKET_MAX : length);
+      if((value & 1) == 0)
+        flash_deselect();
+      return length;
+    case 1: // SPI busy
+      data[0] = 0;
+      return 1;
+    case 2: // scan status and result
+    case 3:
+      data[0] = scan_busy > 0;
+      if(scan_busy)
+        scan_busy--;
+      for(int i = 0; i < 4 && i + 1 < length; i++)
+        data[i+1] = scan_result >> (8*i);
+      return length;
+    case 4: // capabilities: fast, dual, quad, checked stream, RLE, page program engine, page sequence, SPI clock
+      data[0] = gateware_version() >= EMU_GATEWARE_SPI_CLOCK ? 0xFF :
+        gateware_version() >= EMU_GATEWARE_PAGE_SEQUENCE ? 0x7F :
+        gateware_version() >= EMU_GATEWARE_PAGE_ENGINE ? 0x3F :
+        gateware_version() >= EMU_GATEWARE_RLE_WRITE ? 0x1F :
+        gateware_version() >= EMU_GATEWARE_CHECKED_READ ? 0x0F : 0x07;
+      return 1;
+    case 8: // page program engine busy, sequence gap, next sequence number
+      data[0] = time_us < page_done_us[0] || time_us < page_done_us[1];
+      if(gateware_version() < EMU_GATEWARE_PAGE_SEQUENCE)
+        return 1;
+      data[0] |= page_seq_error << 2;
+      page_seq_error = 0;
+      if(length > 1)
+        data[1] = page_seq;
+      return length > 1 ? 2 : 1;
+    case 5: // stream read, wIndex opcode and address[23:16], wValue address[15:0]
+    {
+      if(gateware_version() < EMU_GATEWARE_MULTI_PACKET)
+        return LIBUSB_ERROR_PIPE;
+      uint8_t opcode = index >> 8;
+      uint32_t addr = (index & 0xFF) << 16 | value;
+      int dummy = opcode == 0x0B ? 1 : opcode == 0x3B ? 2 : opcode == 0x6B ? 4 : 0;
+      flash_deselect();
+      flash_select();
+      flash_shift(opcode);
+      flash_shift(addr >> 16);
+      flash_shift(addr >> 8);
+      flash_shift(addr);
+      for(int i = 0; i < dummy; i++)
+        flash_shift(0xFF);
+      for(int i = 0; i < length; i++)
+        data[i] = miso_sample(flash_shift(0xFF));
+      flash_deselect();
+      return length;
+    }
+    case 6: // checked stream read, data and CRC32, wIndex 0 continues the open read
+    {
+      if(gateware_version() < EMU_GATEWARE_CHECKED_READ || length < 4)
+        return LIBUSB_ERROR_PIPE;
+      uint8_t opcode = index >> 8;
+      uint32_t size = length - 4;
+      if(opcode)
+      {
+        uint32_t addr = (index & 0xFF) << 16 | value;
+        int dummy = opcode == 0x0B ? 1 : opcode == 0x3B ? 2 : opcode == 0x6B ? 4 : 0;
+        flash_deselect();
+        flash_select();
+        flash_shift(opcode);
+        flash_shift(addr >> 16);
+        flash_shift(addr >> 8);
+        flash_shift(addr);
+        for(int i = 0; i < dummy; i++)
+          flash_shift(0xFF);
+      }
+      for(uint32_t i = 0; i < size; i++)
+        data[i] = miso_sample(flash_shift(0xFF));
+      uint32_t crc = crc32(data, size);
+      for(int i = 0; i < 4; i++)
+        data[size + i] = crc >> (8*i);
+      scan_open = opcode != 0 || (value & 1);
+      if(!scan_open)
+        flash_deselect();
+      int every = env_int("EMU_READ_ERRORS", 0);
+      if(size > 0 && every > 0 && ++checked_reads % every == 0)
+        data[checked_reads % size] ^= 0x10;
+      return length;
+    }
+  }
+  return LIBUSB_ERROR_PIPE;
+}
+
+// **** hotplug ****
+
+static double hotplug_ms(void)
+{
+  return env_double("EMU_HOTPLUG_MS", 0.0);
+}
+
+static int hotplug_boards(void)
+{
+  int n = env_int("EMU_HOTPLUG_BOARDS", 3);
+  return n < 1 ? 1 : n;
+}
+
+// swap boards when virtual time reached the next EMU_HOTPLUG_MS step
+static void hotplug_update(void)
+{
+  if(hotplug_ms() <= 0.0)
+    return;
+  int now = (int)(time_us / (hotplug_ms() * 1000.0));
+  if(now > hotplug_boards() - 1)
+    now = hotplug_boards() - 1;
+  if(now == board)
+    return;
+  board = now;
+  for(int i = 0; i < device_count(); i++)
+    if(flash_file(i))
+      remove(flash_file(i)); // new board is blank
+}
+
+// callbacks see the boards of sets in between leave and arrive once
+static void hotplug_report(void)
+{
+  if(hotplug_fn == NULL || board_reported == board)
+    return;
+  board_reported = board;
+  for(int i = 0; i < device_count(); i++)
+    hotplug_fn(NULL, &emu_devices[i], LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, hotplug_user);
+  for(int i = 0; i < device_count(); i++)
+    hotplug_fn(NULL, &emu_devices[i], LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, hotplug_user);
+}
+
+// programmer waits without an open device, time runs up to the next swap.
+// after the last board the wait is interrupted by SIGTERM, as by an
+// operator ending the programmer. return value -1: interrupted
+static int hotplug_wait(double us)
+{
+  static int ended = 0;
+  double next_us = (board + 1) * hotplug_ms() * 1000.0;
+  if(ended)
+    return -1;
+  if(hotplug_ms() > 0.0 && time_us + us >= next_us)
+  {
+    if(board == hotplug_boards() - 1)
+    {
+      fprintf(stderr, "emu: no more boards\n");
+      ended = 1;
+      raise(SIGTERM);
+      return -1;
+    }
+    us = next_us - time_us;
+  }
+  time_us += us;
+  hotplug_update();
+  return 0;
+}
+
+static int unplugged(void)
+{
+  double unplug_ms = env_double("EMU_UNPLUG_MS", 0.0);
+  hotplug_update();
+  return (unplug_ms > 0.0 && time_us >= unplug_ms * 1000.0) || !opened_attached();
+}
+
+static int control(uint8_t request_type, uint8_t request, uint16_t value, uint16_t index, uint8_t *data, uint16_t length)
+{
+  if(unplugged())
+    return LIBUSB_ERROR_NO_DEVICE;
+  uint16_t max = gateware_version() >= EMU_GATEWARE_MULTI_PACKET ? EMU_TRANSFER_MAX : EMU_PACKET_MAX;
+  if(length > max)
+    return LIBUSB_ERROR_PIPE;
+  time_us += length * byte_us;
+  count_usb_bytes += length;
+  if(request_type & LIBUSB_ENDPOINT_IN)
+    return control_in(request, value, index, data, length);
+  static unsigned long count_errorable;
+  int every = env_int("EMU_USB_ERRORS", 0);
+  if(every && (request == 0 || request == 8) && ++count_errorable % every == 0)
+  {
+    if(count_usb_errors++ & 1)
+      control_out(request, value, index, data, length); // only the status stage is lost
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+  return control_out(request, value, index, data, length);
+}
+
+// **** libusb API used by tinyfpgasp ****
+
+int libusb_init(libusb_context **ctx)
+{
+  static int initialized = 0;
+  if(initialized)
+    return 0;
+  initialized = 1;
+  lat_usb_us = env_double("EMU_USB_US", 1000);
+  lat_queue_us = env_double("EMU_QUEUE_US", 125);
+  byte_us = env_double("EMU_BYTE_NS", 900) * 1.0e-3;
+  spi_byte_us = env_double("EMU_SPI_NS", 670) * 1.0e-3;
+  spi_skew = env_int("EMU_SPI_SKEW", 0);
+  spi_div_reset = env_int("EMU_SPI_DIV", 0);
+  program_us = env_double("EMU_PP_US", 700);
+  erase_us[0] = env_double("EMU_ERASE_4K_US", 45000);
+  erase_us[1] = env_double("EMU_ERASE_32K_US", 120000);
+  erase_us[2] = env_double("EMU_ERASE_64K_US", 150000);
+  flash_size = env_int("EMU_FLASH_SIZE", 16*1024*1024);
+  flash = (uint8_t *)malloc(flash_size);
+  if(flash == NULL)
+    return LIBUSB_ERROR_NO_MEM;
+  for(int i = 0; i < EMU_DEVICES_MAX; i++)
+    emu_devices[i].index = i;
+  sfdp_init();
+  atexit(emu_report);
+  return 0;
+}
+
+void libusb_exit(libusb_context *ctx)
+{
+}
+
+const char *libusb_error_name(int code)
+{
+  switch(code)
+  {
+    case LIBUSB_ERROR_PIPE: return "LIBUSB_ERROR_PIPE";
+    case LIBUSB_ERROR_TIMEOUT: return "LIBUSB_ERROR_TIMEOUT";
+    case LIBUSB_ERROR_NO_MEM: return "LIBUSB_ERROR_NO_MEM";
+    case LIBUSB_ERROR_NO_DEVICE: return "LIBUSB_ERROR_NO_DEVICE";
+  }
+  return "LIBUSB_ERROR_OTHER";
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+  int n = device_count();
+  *list = (libusb_device **)calloc(n + 1, sizeof(**list));
+  for(int i = 0; i < n; i++)
+    (*list)[i] = &emu_devices[i];
+  return n;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+  free(list);
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+  memset(desc, 0, sizeof(*desc));
+  desc->idVendor = 0x16C0;
+  desc->idProduct = 0x05DC;
+  desc->bcdDevice = gateware_version();
+  return 0;
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+  return 1;
+}
+
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers, int port_numbers_len)
+{
+  port_numbers[0] = dev->index + 1;
+  return 1;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+  if(opened_attached())
+    flash_save(emu_opened);
+  hotplug_update();
+  emu_opened = dev->index;
+  flash_load(emu_opened);
+  emu_handle.index = dev->index;
+  emu_handle.board = board;
+  busy_until_us = time_us;
+  write_enable = 0;
+  cs_active = 0;
+  spi_div = spi_div_reset; // USB reset restores the gateware default
+  spi_delay = 0;
+  *dev_handle = &emu_handle;
+  return 0;
+}
+
+void libusb_close(libusb_device_handle *dev_handle)
+{
+  if(opened_attached())
+    flash_save(emu_opened);
+  emu_opened = -1;
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle)
+{
+  return &emu_devices[dev_handle->index];
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+  return 0;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+  return 0;
+}
+
+int libusb_get_active_config_descriptor(libusb_device *dev, struct libusb_config_descriptor **config)
+{
+  static struct libusb_endpoint_descriptor endpoint[2];
+  static struct libusb_interface_descriptor altsetting;
+  static struct libusb_interface interface;
+  static struct libusb_config_descriptor descriptor;
+  endpoint[0].bEndpointAddress = 0x01;
+  endpoint[1].bEndpointAddress = 0x81;
+  endpoint[0].bmAttributes = endpoint[1].bmAttributes = LIBUSB_TRANSFER_TYPE_BULK;
+  endpoint[0].wMaxPacketSize = endpoint[1].wMaxPacketSize = EMU_PACKET_MAX;
+  altsetting.bNumEndpoints = env_int("EMU_BULK", 0) ? 2 : 0;
+  altsetting.endpoint = endpoint;
+  interface.altsetting = &altsetting;
+  interface.num_altsetting = 1;
+  descriptor.bNumInterfaces = 1;
+  descriptor.interface = &interface;
+  *config = &descriptor;
+  return 0;
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config)
+{
+}
+
+int libusb_control_transfer(libusb_device_handle *dev_handle, uint8_t request_type, uint8_t bRequest,
+  uint16_t wValue, uint16_t wIndex, unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+  time_us += lat_usb_us;
+  return control(request_type, bRequest, wValue, wIndex, data, wLength);
+}
+
+// bulk OUT carries frames {1, out length, in length, out bytes},
+// MISO of the in bytes is queued for bulk IN
+int libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint,
+  unsigned char *data, int length, int *transferred, unsigned int timeout)
+{
+  if(unplugged())
+    return LIBUSB_ERROR_NO_DEVICE;
+  time_us += lat_usb_us + length * byte_us;
+  count_usb_bytes += length;
+  if(endpoint & LIBUSB_ENDPOINT_IN)
+  {
+    int n = 0;
+    count_in++;
+    while(n < length && bulk_fifo_read != bulk_fifo_write)
+      data[n++] = bulk_fifo[bulk_fifo_read++ % EMU_BULK_FIFO];
+    *transferred = n;
+    return n == length ? 0 : LIBUSB_ERROR_TIMEOUT;
+  }
+  count_out++;
+  int i = 0;
+  while(i + 5 <= length && data[i] == 1)
+  {
+    uint32_t out_length = data[i+1] | data[i+2] << 8;
+    uint32_t in_length = data[i+3] | data[i+4] << 8;
+    i += 5;
+    flash_select();
+    for(uint32_t k = 0; k < out_length && i < length; k++)
+      flash_shift(data[i++]);
+    for(uint32_t k = 0; k < in_length; k++)
+      bulk_fifo[bulk_fifo_write++ % EMU_BULK_FIFO] = flash_shift(0);
+    flash_deselect();
+  }
+  *transferred = length;
+  return 0;
+}
+
+// asynchronous transfers complete in submission order, one per
+// libusb_handle_events(), pipelined at the queued transfer latency
+static struct libusb_transfer *pending[EMU_PENDING_MAX];
+static int pending_count;
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+  return (struct libusb_transfer *)calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+  free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+  if(pending_count >= EMU_PENDING_MAX)
+    return LIBUSB_ERROR_NO_MEM;
+  pending[pending_count++] = transfer;
+  return 0;
+}
+
+int libusb_handle_events(libusb_context *ctx)
+{
+  if(pending_count == 0)
+    return 0;
+  struct libusb_transfer *transfer = pending[0];
+  memmove(pending, pending + 1, --pending_count * sizeof(pending[0]));
+  // a lone transfer waits the full round trip, others overlap
+  time_us += pending_count ? lat_queue_us : lat_usb_us;
+  struct libusb_control_setup *setup = (struct libusb_control_setup *)transfer->buffer;
+  int rc = control(setup->bmRequestType, setup->bRequest, libusb_le16_to_cpu(setup->wValue),
+    libusb_le16_to_cpu(setup->wIndex), transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE,
+    libusb_le16_to_cpu(setup->wLength));
+  transfer->status = rc < 0 ? LIBUSB_TRANSFER_STALL : LIBUSB_TRANSFER_COMPLETED;
+  transfer->actual_length = rc < 0 ? 0 : rc;
+  transfer->callback(transfer);
+  return 0;
+}
+
+int libusb_has_capability(uint32_t capability)
+{
+  return capability == LIBUSB_CAP_HAS_HOTPLUG;
+}
+
+// devices attached now arrive during registration, as with
+// LIBUSB_HOTPLUG_ENUMERATE. all devices match, they have one vid:pid
+int libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags,
+  int vendor_id, int product_id, int dev_class, libusb_hotplug_callback_fn cb_fn,
+  void *user_data, libusb_hotplug_callback_handle *callback_handle)
+{
+  hotplug_update();
+  hotplug_fn = cb_fn;
+  hotplug_user = user_data;
+  board_reported = board;
+  *callback_handle = 1;
+  if(flags & LIBUSB_HOTPLUG_ENUMERATE)
+    for(int i = 0; i < device_count(); i++)
+      cb_fn(ctx, &emu_devices[i], LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, user_data);
+  return 0;
+}
+
+void libusb_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle)
+{
+  hotplug_fn = NULL;
+}
+
+// without transfers in flight only hotplug events happen, the
+// timeout passes in virtual time
+int libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+{
+  if(pending_count)
+    return libusb_handle_events(ctx);
+  if(emu_opened < 0)
+  {
+    if(hotplug_wait(tv->tv_sec * 1.0e6 + tv->tv_usec) < 0)
+      return LIBUSB_ERROR_INTERRUPTED;
+  }
+  else
+    time_us += tv->tv_sec * 1.0e6 + tv->tv_usec;
+  hotplug_update();
+  hotplug_report();
+  return 0;
+}
+
+// sleeps of the programmer while a device is open pass virtual time,
+// with EMU_HOTPLUG_MS also the others
+int usleep(useconds_t usec)
+{
+  if(emu_opened >= 0)
+    time_us += usec;
+  else if(hotplug_ms() > 0.0)
+  {
+    if(hotplug_wait(usec) < 0)
+    {
+      errno = EINTR;
+      return -1;
+    }
+  }
+  else
+  {
+    struct timespec ts = {usec / 1000000, (usec % 1000000) * 1000L};
+    return nanosleep(&ts, NULL);
+  }
+  return 0;
+}
@@ -1,22 +1,25 @@
-
 #include <stdio.h>
 
 // uint types
 #include <unistd.h>
 
-// malloc
+// getenv
 #include <stdlib.h>
 
 // memcpy
 #include <memory.h>
 
-// file handling
+// parallel workers for many devices
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <strings.h>
+
+// --daemon finishes the device it programs when interrupted
+#include <signal.h>
 
-// USB
-#include <libusb-1.0/libusb.h>
+// flash programming library
+#include "fpgasp.h"
 
 // commandline parser cmdline.ggo with gengetpot
 #include "cmdline.h"
@@ -24,8 +27,23 @@
 struct gengetopt_args_info args_info;
 struct gengetopt_args_info *args = &args_info;
 
-static struct libusb_device_handle *device_handle = NULL;
-uint8_t libusb_initialized = 0, interface_claimed = 0;
+// with many devices, one forked worker per device reports
+// progress and result to the parent through shared memory
+struct worker_status
+{
+  volatile uint32_t done, total; // progress of the current step
+  volatile int finished;
+  int rc;
+  double seconds;
+  char uid[17];
+};
+static struct worker_status *worker = NULL; // NULL: not a worker
+
+// regions written in one session, from --manifest and --write
+#define REGIONS_MAX 64
+static struct flash_region regions[REGIONS_MAX];
+static char region_names[REGIONS_MAX][1024]; // manifest file names
+static int num_regions = 0;
 
 void print_progress_bar (uint32_t done, uint32_t total)
 {
@@ -40,586 +58,384 @@ void print_progress_bar (uint32_t done, uint32_t total)
     fflush(stderr);
 }
 
-void print_hex_buf(uint8_t *buf, uint32_t len)
+// progress callback of the library, user is the worker status or NULL
+static void print_progress(void *user, uint32_t done, uint32_t total)
 {
-  for(int i = 0; i < len; i++)
-  {
-      if(i % 32 == 0 && i != 0)
-        printf("\n");
-      printf("%02X ", buf[i]);
+  struct worker_status *status = (struct worker_status *)user;
+  if(status)
+  { // parent prints progress of all workers
+    status->total = total;
+    status->done = done;
+    return;
   }
-  printf("\n");
-}
-
-
-void cmd_addr(uint8_t *buf, uint8_t cmd, uint32_t addr)
-{
-  buf[0] = cmd;
-  buf[1] = 0xFF & (addr >> 16);
-  buf[2] = 0xFF & (addr >> 8);
-  buf[3] = 0XFF & addr;
+  print_progress_bar(done, total);
 }
 
-// up to 32 byte single packet in/out exchange
-int txrx(uint8_t *out_data, uint32_t out_len, uint8_t *in_data, uint32_t in_len)
+// manifest lines are "file address [length]", # starts a comment.
+// relative file names are relative to the manifest directory.
+int read_manifest(const char *manifest)
 {
-  uint8_t bRequest = 0; // currently no use
-  uint16_t wIndex = 0; // currently no use
-  uint16_t wValue = 0; // wValue: 0-no continuation, 1-continuation
-  uint16_t timeout_ms = 10; // 10 ms waiting for response
-  int response;
-
-  response = libusb_control_transfer(device_handle, (uint8_t)(LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR),
-      bRequest, wValue, wIndex, out_data, out_len, timeout_ms);
-  if(response < 0)
+  FILE *f = fopen(manifest, "r");
+  if(f == NULL)
   {
-    fprintf(stderr, "txrx OUT: %s\n", libusb_error_name(response));
-    return -1; // something went wrong with USB
+    perror(manifest);
+    return -1;
   }
-
-  if(in_data == NULL || in_len == 0)
-    return 0;
-
-  response = libusb_control_transfer(device_handle, (uint8_t)(LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR),
-      bRequest, wValue, wIndex, in_data, in_len, timeout_ms);
-  if(response < 0)
+  const char *slash = strrchr(manifest, '/');
+  char line[1024];
+  int line_number = 0, rc = 0;
+  while(rc == 0 && fgets(line, sizeof(line), f))
   {
-    fprintf(stderr, "txrx IN: %s\n", libusb_error_name(response));
-    return -1; // something went wrong with USB
+    char name[768];
+    long addr, length = 0;
+    line_number++;
+    char *comment = strchr(line, '#');
+    if(comment)
+      *comment = '\0';
+    int fields = sscanf(line, "%767s %li %li", name, &addr, &length);
+    if(fields <= 0)
+      continue; // empty line
+    int dir_len = slash && name[0] != '/' ? slash - manifest + 1 : 0;
+    if(fields < 2 || num_regions == REGIONS_MAX
+    || dir_len + strlen(name) >= sizeof(region_names[0]))
+    {
+      fprintf(stderr, "%s:%d: %s\n", manifest, line_number,
+        fields < 2 ? "expected file address [length]" :
+        num_regions == REGIONS_MAX ? "too many regions" : "file name too long");
+      rc = -1;
+      break;
+    }
+    char *filename = region_names[num_regions];
+    sprintf(filename, "%.*s%s", dir_len, manifest, name);
+    regions[num_regions].filename = filename;
+    regions[num_regions].addr = addr;
+    regions[num_regions].length = length;
+    num_regions++;
   }
-
-  return 0;
+  fclose(f);
+  return rc;
 }
 
-int flash_read_id()
+// directory of write journals, SPI clock settings and the flash content cache
+static const char *state_dir(void)
 {
-  uint8_t buf[5];
-  cmd_addr(buf, 0xAB, 0);
-  int rc = txrx(buf, sizeof(buf), buf, sizeof(buf));
-  if(rc < 0)
-    return rc;
-  return buf[4];
+  static char dir[1024];
+  if(args->cache_given && strcmp(args->cache_arg, "off") != 0)
+    return args->cache_arg;
+  const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+  if(xdg && xdg[0])
+    snprintf(dir, sizeof(dir), "%s/tinyfpgasp", xdg);
+  else if(home && home[0])
+    snprintf(dir, sizeof(dir), "%s/.cache/tinyfpgasp", home);
+  else
+    return NULL;
+  return dir;
 }
 
-int flash_read_status()
+// directory of the flash content cache, NULL: --cache off
+static const char *cache_dir(void)
 {
-  uint8_t buf[2];
-  buf[0] = 0x05;
-  int rc = txrx(buf, sizeof(buf), buf, sizeof(buf));
-  if(rc < 0)
-    return rc;
-  return buf[1];
+  if(args->cache_given && strcmp(args->cache_arg, "off") == 0)
+    return NULL;
+  return state_dir();
 }
 
-int flash_wait_while_busy()
+// file of the board in the state directory, named by flash unique ID
+// or USB path. return value 0: ok, -1: no state directory
+static int board_file(struct fpgasp *sp, const char *path, const char *suffix, char *filename, int size)
 {
-  while(flash_read_status() & 1);
+  char uid[17];
+  if(state_dir() == NULL)
+    return -1;
+  if(flash_read_uid(sp, uid) < 0 || strspn(uid, "0") == 16 || strspn(uid, "F") == 16)
+    snprintf(filename, size, "%s/%s.%s", state_dir(), path ? path : "device", suffix);
+  else
+    snprintf(filename, size, "%s/%s.%s", state_dir(), uid, suffix);
   return 0;
 }
 
-int flash_write_enable()
+// each board has its own journal
+static void set_journal(struct fpgasp *sp, const char *path)
 {
-  uint8_t buf[1];
-  buf[0] = 0x06;
-  int rc = txrx(buf, sizeof(buf), NULL, 0);
-  if(rc < 0)
-    return rc;
-  return 0;
+  char filename[1024];
+  if(board_file(sp, path, "journal", filename, sizeof(filename)) == 0)
+    fpgasp_set_journal(sp, filename, args->resume_flag);
 }
 
-int flash_write_disable()
+// SPI clock given as divider and delay, or tuned for the board
+static int spi_clock(struct fpgasp *sp, const char *path)
 {
-  uint8_t buf[1];
-  buf[0] = 0x04;
-  int rc = txrx(buf, sizeof(buf), NULL, 0);
-  if(rc < 0)
-    return rc;
-  return 0;
+  const char *arg = args->spi_clock_arg;
+  char filename[1024];
+  int divider, delay = 0;
+  if(strcmp(arg, "off") == 0)
+    return 0;
+  if(strcmp(arg, "auto") == 0 || strcmp(arg, "calibrate") == 0)
+    return spi_clock_tune(sp, board_file(sp, path, "spi", filename, sizeof(filename)) == 0 ? filename : NULL,
+      strcmp(arg, "calibrate") == 0);
+  if(sscanf(arg, "%d,%d", &divider, &delay) < 1)
+  {
+    fprintf(stderr, "unknown SPI clock %s\n", arg);
+    return -1;
+  }
+  return spi_clock_set(sp, divider, delay);
 }
 
-
-int flash_read(uint8_t *data, uint32_t addr, uint32_t length)
+// open device, select transport and read mode, then read and write.
+// uid: flash unique ID is read into it, NULL: not needed
+static int device_session(struct fpgasp *sp, uint16_t vid, uint16_t pid, const char *path, char *uid)
 {
-  uint8_t buf[32]; // USB I/O buffer
-  uint32_t accumulated_read = 0; // accumulate total read
-  uint32_t payload_start = 4; // initial payload starts at byte 4 without continuation
-  uint8_t data1 = 0; // currently no use
-  uint8_t bRequest = 0; // currently no use
-  uint16_t wIndex = 0; // currently no use
-  uint16_t wValue = length <= sizeof(buf)-payload_start ? 0 : 1; // wValue: 0-no continuation, 1-continuation
-  uint16_t timeout_ms = 10; // 10 ms waiting for response
-
-  cmd_addr(buf, 0x03, addr); // FLASH normal (slow) read
+  int rc = 0;
+  if(open_usb_device(sp, vid, pid, path) < 0)
+    return -1;
+  if(usb_select_transport(sp, args->transport_arg) < 0)
+    return -1;
+    
+  printf("FLASH ID: 0x%02X\n", flash_read_id(sp));
+  if(flash_select_read_mode(sp, args->mode_arg) < 0)
+    return -1;
+  if(spi_clock(sp, path) < 0)
+    return -1;
+  if(uid)
+    flash_read_uid(sp, uid);
   
-  while(accumulated_read < length)
+  if(args->read_given)
   {
-    int response;
-
-    #if 0
-    // IN request - wait for SPI to finish its transmission 
-    buf[0] = 1;
-    while(buf[0] == 1)
-    {
-      response = libusb_control_transfer(device_handle, (uint8_t)(LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR),
-        1, 0, 0, buf, 1, timeout_ms);
-      if(buf[0])
-        printf("spi busy before out %d\n", buf[0]);
-    }
-    #endif
-
-    // write to USB read command followed with dummy bytes
-    // in order to read, we must first write command and the
-    // contiue writing anything to SPI
-    // every written byte will also result in reading a byte.
-    // up to 32 read bytes are buffered inside of the USB device.
-    // this USB buffer can be retrieved by subsequent IN command later.
-    response = libusb_control_transfer(device_handle, (uint8_t)(LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|data1),
-      bRequest, wValue, wIndex, buf, sizeof(buf), timeout_ms);
-    if(response < 0)
-    {
-      fprintf(stderr, "OUT: %s\n", libusb_error_name(response));
-      return -1; // something went wrong with USB
-    }
-    // calculate next request length (how much to read from USB)
-    uint32_t request_size;
-    if(accumulated_read + sizeof(buf) - payload_start >= length)
-    {
-      // printf("last packet\n");
-      // end packet, trim request size to how much we really need
-      request_size = length + payload_start - accumulated_read;
-      wValue = 0; // terminate continuation
-    }
+    // each worker reads to its own file
+    char filename[1024];
+    if(worker)
+      snprintf(filename, sizeof(filename), "%s.%s", args->read_arg, path);
     else
-      request_size = sizeof(buf);
-
-    #if 0
-    // IN request - wait for SPI to finish its transmission 
-    buf[0] = 1;
-    while(buf[0] == 1)
-    {
-      response = libusb_control_transfer(device_handle, (uint8_t)(LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR),
-        1, 0, 0, buf, 1, timeout_ms);
-      if(buf[0])
-        printf("spi busy before in %d\n", buf[0]);
-    }
-    #endif
-
-    //usleep(1000000);
-    // usleep(11); // sleep 11us for SPI to tranfer (usually not needed)
-    response = libusb_control_transfer(device_handle, (uint8_t)(LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|data1),
-      bRequest, wValue, wIndex, buf, request_size, timeout_ms);
-    if(response != request_size)
-    {
-      fprintf(stderr, "IN: %s\n", libusb_error_name(response));
-      return -1; // something went wrong with USB
-    }
-    uint32_t response_size = response - payload_start;
-    memcpy(data, buf+payload_start, response_size);
-    data += response_size;
-    accumulated_read += response_size;
-    if(payload_start) // contination will result in full 32-byte payload
-      payload_start = 0;
+      snprintf(filename, sizeof(filename), "%s", args->read_arg);
+    if(read_flash_write_file(sp, filename, args->address_arg, args->length_arg) < 0)
+      rc = -1;
+  }
+  if(num_regions && cache_dir())
+    flash_cache_open(sp, cache_dir()); // without cache every sector is read
+  if(num_regions)
+    set_journal(sp, path);
+  if(num_regions)
+  { // sorted in place by the library, a copy keeps the order for the next device
+    struct flash_region session_regions[REGIONS_MAX];
+    memcpy(session_regions, regions, num_regions * sizeof(regions[0]));
+    if(write_regions(sp, session_regions, num_regions) < 0)
+      rc = -1;
   }
-  return 0; // 0 on success
+  if(args->stats_given)
+  {
+    if(strcmp(args->stats_arg, "json") == 0)
+      stats_print_json(sp, path);
+    else
+      stats_print_text(sp);
+  }
+  return rc;
 }
 
-// retry max "retry" times until 'match' of consecutive identical readings appear
-/*
-int flash_read_retry(uint8_t *data, uint32_t addr, uint32_t length, int retry, int match)
+// everything done with one device in one session, path NULL: first device
+int run_device(uint16_t vid, uint16_t pid, const char *path)
 {
-  return 0;
+  struct fpgasp *sp = fpgasp_new(args->queue_arg);
+  if(sp == NULL)
+    return -1;
+  fpgasp_set_progress(sp, print_progress, worker);
+  int rc = device_session(sp, vid, pid, path, worker ? worker->uid : NULL);
+  fpgasp_free(sp);
+  return rc;
 }
-*/
 
-// only 3 selected sector lengths are possible
-int flash_erase_sector(uint32_t addr, uint32_t len)
+static int string_listed(const char *s, char **list, int n)
 {
-  uint8_t opcode = 0; // null-opcode is NOP
-  if(len ==  4*1024) opcode = 0x20;
-  if(len == 32*1024) opcode = 0x52;
-  if(len == 64*1024) opcode = 0xd8;
-  if(opcode == 0)
-    return -1; // unsupported length
-  flash_write_enable();
-  uint8_t buf[4];
-  cmd_addr(buf, opcode, addr);
-  int rc = txrx(buf, sizeof(buf), NULL, 0);
-  if(rc < 0)
-    return -1; // error in txrx
-  flash_wait_while_busy();
+  for(int i = 0; i < n; i++)
+    if(strcasecmp(s, list[i]) == 0)
+      return 1;
   return 0;
 }
 
-int flash_write(uint8_t *data, uint32_t addr, uint32_t length)
+// device passes --path and --uid, its uid is read for --uid and --list
+static int target_selected(struct fpgasp *sp, uint16_t vid, uint16_t pid, struct usb_target *target)
 {
-  uint8_t buf[32]; // USB I/O buffer
-  uint32_t accumulated_write = 0; // accumulate total read
-  uint32_t payload_start = 4; // initial payload starts at byte 4 without continuation
-  uint8_t data1 = 0; // currently no use
-  uint8_t bRequest = 0; // currently no use
-  uint16_t wIndex = 0; // currently no use
-  uint16_t wValue = length <= sizeof(buf)-payload_start ? 0 : 1; // wValue: 0-no continuation, 1-continuation
-  uint16_t timeout_ms = 10; // 10 ms waiting for response
-
-  flash_write_enable();
-
-  cmd_addr(buf, 0x02, addr); // FLASH write (should be previous erased to 0xFF)
-  while(accumulated_write < length)
+  if(args->path_given && !string_listed(target->path, args->path_arg, args->path_given))
+    return 0;
+  if(args->uid_given || args->list_flag)
   {
-    int response;
-
-    #if 0
-    // IN request - wait for SPI to finish its transmission 
-    buf[0] = 1;
-    while(buf[0] == 1)
-    {
-      response = libusb_control_transfer(device_handle, (uint8_t)(LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR),
-        1, 0, 0, buf, 1, timeout_ms);
-      if(buf[0])
-        printf("spi busy before out %d\n", buf[0]);
-    }
-    #endif
-
-    // calculate next request length (how much to read from USB)
-    uint32_t request_size;
-    if(accumulated_write + sizeof(buf) - payload_start >= length)
-    {
-      // printf("last packet\n");
-      // end packet, trim request size to how much we really need
-      request_size = length + payload_start - accumulated_write;
-      wValue = 0; // terminate continuation
-    }
-    else
-      request_size = sizeof(buf);
-    uint32_t payload_size = sizeof(buf) - payload_start;
-    // printf("paystart %d, payload_size %d\n", payload_start, payload_size);
-    memcpy(buf+payload_start, data, payload_size);
-
-    // write to USB the flash write command followed with data
-    response = libusb_control_transfer(device_handle, (uint8_t)(LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|data1),
-      bRequest, wValue, wIndex, buf, request_size, timeout_ms);
-    if(response < 0)
-    {
-      fprintf(stderr, "OUT: %s\n", libusb_error_name(response));
-      return -1; // something went wrong with USB
-    }
-
-    #if 0
-    // IN request - wait for SPI to finish its transmission 
-    buf[0] = 1;
-    while(buf[0] == 1)
-    {
-      response = libusb_control_transfer(device_handle, (uint8_t)(LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR),
-        1, 0, 0, buf, 1, timeout_ms);
-      if(buf[0])
-        printf("spi busy before in %d\n", buf[0]);
-    }
-    #endif
-
-    data += payload_size;
-    accumulated_write += payload_size;
-    if(payload_start) // contination will result in full 32-byte payload
-      payload_start = 0;
-
+    if(open_usb_device(sp, vid, pid, target->path) == 0)
+      flash_read_uid(sp, target->uid);
+    close_usb_device(sp);
+    if(args->uid_given && !string_listed(target->uid, args->uid_arg, args->uid_given))
+      return 0;
   }
-  flash_wait_while_busy();
-  return 0; // 0 on success
+  return 1;
 }
 
+// devices with vid:pid filtered by --path and --uid
+int select_targets(struct fpgasp *sp, uint16_t vid, uint16_t pid, struct usb_target *targets)
+{
+  int n = usb_enumerate(sp, vid, pid, targets, USB_TARGETS_MAX);
+  int selected = 0;
+  for(int i = 0; i < n; i++)
+    if(target_selected(sp, vid, pid, &targets[i]))
+      targets[selected++] = targets[i];
+  return n < 0 ? -1 : selected;
+}
 
-// read from addr, length bytes and write to file
-int read_flash_write_file(char *filename, uint32_t addr, uint32_t length)
+// mean progress of all workers, finished worker counts as 100%
+static void print_parallel_progress(struct worker_status *status, int n)
 {
-  // printf("reading\n");
-  const int bufsize = 28; // not much speed improvement in increasing this
-  uint8_t buf[2][bufsize]; // 2 buffers, both must match
-  uint32_t accumulated_read = 0;
-  int file_descriptor = open(filename, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
-  const int retry = 1000;
-  uint32_t next_progress = 0, progress_step = length / 100;
-  while(accumulated_read < length)
+  uint32_t sum = 0;
+  int finished = 0, failed = 0;
+  for(int i = 0; i < n; i++)
   {
-    int match; // repeat reading until 2 subsequent readings match
-    int ib = 0; // buffer index 0/1 to match
-    uint32_t requested_size = accumulated_read + bufsize >= length ? length - accumulated_read : bufsize;
-    match = 0;
-    const int match_required = 2;
-    // printf("accumulated_read %d\n", accumulated_read);
-    for(int i = 0; i < retry && match < match_required; i++)
+    if(status[i].finished)
     {
-      buf[ib][0] = ~buf[ib^1][0]; // damage first byte for the match to initially fail unless read correct
-      buf[ib][requested_size-1] = ~buf[ib^1][requested_size-1]; // damage first byte for the match to initially fail unless read correct
-      int rc = flash_read(buf[ib], addr, requested_size);
-      if(rc == 0 && memcmp(buf[ib], buf[ib^1], requested_size) == 0)
-        match++;
-      else
-      {
-        match = 0;
-        if(i > 0)
-          printf("read verify error %d\n", i);
-      }
-      ib ^= 1; // switch buffer
-    }
-    if(match < match_required)
-    {
-      fprintf(stderr, "failure after %d retries\n", retry);
-      return -1;
-    }
-    write(file_descriptor, buf[0], requested_size);
-    accumulated_read += requested_size;
-    addr += requested_size;
-    if(accumulated_read > next_progress)
-    {
-      print_progress_bar(accumulated_read, length);
-      next_progress += progress_step;
+      sum += 100;
+      finished++;
+      failed += status[i].rc != 0;
     }
+    else if(status[i].total)
+      sum += (uint64_t)100 * status[i].done / status[i].total;
   }
-  print_progress_bar(accumulated_read, length);
-  fprintf(stderr, "\n");
-  close(file_descriptor);
-  return 0;
+  print_progress_bar(sum, 100 * n);
+  fprintf(stderr, " %d/%d finished, %d failed", finished, n, failed);
+  fflush(stderr);
 }
 
-
-// write that many bytes found or file or if file is larger, limit by length.
-// read each sector, then determine should we erase it and/or write
-// read it back for verification, if different, retry few times and give up
-// return value
-//  0: ok
-// -1: error
-int read_file_write_flash(char *filename, uint32_t addr, uint32_t length)
+// same job for all devices at once, one worker process per device.
+// print pass/fail of each device at the end.
+int run_parallel(uint16_t vid, uint16_t pid, struct usb_target *targets, int n)
 {
-  const uint32_t available_sector_size[] = {4*1024, 32*1024, 64*1024}; // sizes in ascending order
-  const int num_available_sector_size = sizeof(available_sector_size)/sizeof(available_sector_size[0]);
-  uint8_t flash_sector_buf[available_sector_size[num_available_sector_size-1]]; // allocate buf, max sector size
-  uint8_t file_sector_buf[available_sector_size[num_available_sector_size-1]]; // allocate buf, max sector size
-  int file_descriptor = open(filename, O_RDONLY);
-  if(file_descriptor < 0)
-    return -1; // cant't open file
-  
-  if(length == 0)
+  struct worker_status *status = mmap(NULL, n * sizeof(*status),
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(status == MAP_FAILED)
   {
-    length = lseek(file_descriptor, 0, SEEK_END);
-    lseek(file_descriptor, 0, SEEK_SET);
+    perror("mmap");
+    return -1;
   }
-
-  // **** sector logic ****
-  // we need to interated over flash sectors
-  // if writing to partial sector we first read old data from the sector,
-  // erase whole sector, write from file and write old data, then verify and retry 
-  const int retry = 10;
-  uint32_t bytes_written = 0;
-  int retries_remaining = retry;
-  
-  printf("writing range 0x%06X-0x%06X\n", addr, addr+length-1);
-  // some simple satistics about flash wear
-  uint32_t count_erase = 0, count_write = 0;
-  
-  uint32_t last_read_from_file = 1;
-  while(bytes_written < length && last_read_from_file > 0 && retries_remaining > 0)
+  memset(status, 0, n * sizeof(*status));
+  pid_t pids[USB_TARGETS_MAX];
+  int running = 0;
+  fflush(stdout);
+  fflush(stderr);
+  double time_start = time_now();
+  for(int i = 0; i < n; i++)
   {
-    uint32_t length_remaining = length - bytes_written;
-    // find suitable sector to erase
-    // 1. priority is to minimize easeing part of data we don't have to erase
-    // 2. maximize sector size
-    uint32_t sector_size = available_sector_size[0]; // minimal sector size
-    uint32_t sector_part_before_data = addr % sector_size; // start as minimal sector
-    
-    // find do we have any larger sector
-    if(0) // disabled, the smalles 4K sector is most suitable for retry procedure
-    for(int i = 1; i < num_available_sector_size; i++)
+    pids[i] = fork();
+    if(pids[i] == 0)
     {
-      if( addr % available_sector_size[i] == sector_part_before_data // if part before is the same
-      && (length_remaining >= available_sector_size[i]-available_sector_size[0])) // and we have enough data
-        sector_size = available_sector_size[i]; // accept new sector size
-    }
-    uint32_t data_bytes_to_write = sector_size - sector_part_before_data;
-    if(bytes_written + data_bytes_to_write >= length)
-      data_bytes_to_write = length - bytes_written; // last sector, clamp size
-    uint32_t erase_sector_addr = addr-sector_part_before_data;
-
-    uint32_t actual_bytes_from_file = 0;
-    if(retries_remaining == retry)
-    { // first retry, it's new sector we need to read flash and file
-      // read sector before erase and before the file
-      flash_read(flash_sector_buf, erase_sector_addr, sector_size);
-      // copy to file sector (as file may be read in less than sector size)
-      memcpy(file_sector_buf, flash_sector_buf, sector_size);
-      // data_bytes_to_write is what we want to write, but file may contain less
-      // try to read from file "data_bytes_to_write" or get eof:
-      uint32_t remaining_to_read = data_bytes_to_write;
-      uint8_t *file_data_pointer = file_sector_buf + addr - erase_sector_addr;
-      last_read_from_file = 1;
-      while(remaining_to_read > 0 && last_read_from_file > 0)
-      {
-        last_read_from_file = read(file_descriptor, file_data_pointer, remaining_to_read);
-        if(last_read_from_file > 0)
-        {
-          remaining_to_read -= last_read_from_file;
-          file_data_pointer += last_read_from_file;
-        }
-      }
-      actual_bytes_from_file = data_bytes_to_write - remaining_to_read;
+      worker = &status[i];
+      // messages of many workers would mix, only errors are printed
+      if(freopen("/dev/null", "w", stdout) == NULL)
+        _exit(1);
+      int rc = run_device(vid, pid, targets[i].path);
+      worker->seconds = time_now() - time_start;
+      worker->rc = rc;
+      _exit(rc < 0 ? 1 : 0);
     }
-    //printf("actual_bytes_from_file %d\n", actual_bytes_from_file);
-    //if(last_read_from_file <= 0)
-    //  printf("****** EOF *******\n");
-    // update number of bytes to write
-    data_bytes_to_write = actual_bytes_from_file;
-
-    // printf("retry %d\n", retries_remaining);
-    retries_remaining--; 
-    // this while loop may be early relooped after this point
-    // with "continue" -> retries will be left decremented
-    
-    // determine do we have to 2:erase, 1:write or 0:leave  the sector unmodified
-    // compare byte-by-byte flash_sector_buf and file_sector_buf
-    uint8_t must_erase = 0;
-    for(uint32_t i = 0; i < sector_size; i++)
-    {
-      if( (flash_sector_buf[i] & file_sector_buf[i]) != file_sector_buf[i])
-        must_erase = 1;
-    }
-    uint8_t must_write = 0;
-    if(must_erase)
+    if(pids[i] < 0)
     {
-      for(uint32_t i = 0; i < sector_size; i++)
-        if(file_sector_buf[i] != 0xFF)
-          must_write = 1;
+      perror("fork");
+      status[i].rc = -1;
+      status[i].finished = 1;
     }
     else
-    {
-      for(uint32_t i = 0; i < sector_size; i++)
-        if(flash_sector_buf[i] != file_sector_buf[i])
-          must_write = 1;
-    }
-    if(0)
-    printf("sector 0x%06X-0x%06X (size %d, erase %d, write %d)\n",
-      erase_sector_addr,
-      erase_sector_addr+sector_size-1,
-      sector_size, 
-      must_erase, must_write);
-    if(must_erase)
-    {
-      flash_erase_sector(erase_sector_addr, sector_size);
-      count_erase++;
-    }
-    const uint32_t page_program_size = 256; // up to this bytes max in one page write operation
-    if(must_write)
-    {
-      for(int i = 0; i < sector_size; i += page_program_size)
-        flash_write(file_sector_buf + i, erase_sector_addr + i, page_program_size);
-      count_write++;
-    }
-    // verify
-    flash_read(flash_sector_buf, erase_sector_addr, sector_size);
-    int verify_fail = memcmp(flash_sector_buf, file_sector_buf, sector_size);
-    if(verify_fail)
-      continue; // jumps to new while iteration without update of addr and bytes written
-    bytes_written += data_bytes_to_write; // not correct but OK for now
-    addr += data_bytes_to_write;
-    print_progress_bar(bytes_written, length);
-    retries_remaining = retry; // if we get this far, we are successful and set retry counter
+      running++;
   }
-  printf("\n"); // after progress bar to new line
-  if(retries_remaining == 0)
+  while(running > 0)
   {
-    fprintf(stderr, "FAIL\n");
-    return -1;
+    int wstatus;
+    pid_t p;
+    while((p = waitpid(-1, &wstatus, WNOHANG)) > 0)
+      for(int i = 0; i < n; i++)
+        if(pids[i] == p)
+        {
+          if(!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+            status[i].rc = -1;
+          status[i].finished = 1;
+          running--;
+        }
+    print_parallel_progress(status, n);
+    if(running > 0)
+      usleep(100000);
   }
-  printf("4K sectors erased:%d written:%d\n", count_erase, count_write); 
-  return 0;
+  fprintf(stderr, "\n");
+  int failed = 0;
+  for(int i = 0; i < n; i++)
+  {
+    printf("%-12s UID %-16s %s %.1f s\n", targets[i].path,
+      status[i].uid[0] ? status[i].uid : "unknown",
+      status[i].rc ? "FAIL" : "PASS", status[i].seconds);
+    failed += status[i].rc != 0;
+  }
+  printf("%d of %d devices passed in %.1f s\n", n - failed, n, time_now() - time_start);
+  munmap(status, n * sizeof(*status));
+  return failed ? -1 : 0;
 }
 
+// first interrupt ends --daemon after the device it programs,
+// a second one at once
+static volatile sig_atomic_t stop_waiting = 0;
 
-void close_usb_device(void)
+static void stop_signal(int sig)
 {
-  printf("aaaa\n");
-  if(interface_claimed)
-  {
-    libusb_release_interface(device_handle, 0);
-    interface_claimed = 0;
-  }
-  if(libusb_initialized)
-  {
-    libusb_exit(NULL);
-    libusb_initialized = 0;
-  }
+  stop_waiting = 1;
+  signal(sig, SIG_DFL);
 }
 
-int open_usb_device(uint16_t vid, uint16_t pid)
+// --wait programs the next device plugged in, --daemon every one until
+// interrupted. one handle keeps libusb and its hotplug callback for all
+// devices, each one is reported when it is done.
+int run_hotplug(uint16_t vid, uint16_t pid)
 {
-  int r = libusb_init(NULL);
-  if (r < 0)
-  {
-    fprintf(stderr, "Cannot init libusb\n");
-    close_usb_device();
+  struct fpgasp *sp = fpgasp_new(args->queue_arg);
+  if(sp == NULL)
     return -1;
-  }
-  libusb_initialized = 1;
-
-  device_handle = libusb_open_device_with_vid_pid(NULL, vid, pid);
-  if (!device_handle)
+  fpgasp_set_progress(sp, print_progress, NULL);
+  signal(SIGINT, stop_signal);
+  signal(SIGTERM, stop_signal);
+  fprintf(stderr, "waiting for USB device %04X:%04X\n", vid, pid);
+  int devices = 0, failed = 0, rc = 0;
+  double time_start = time_now();
+  while(!stop_waiting)
   {
-    fprintf(stderr, "Error finding USB device %04X:%04X\n", vid, pid);
-    return -1;
+    struct usb_target target;
+    int timeout_ms = 500; // checks for interrupt
+    int waited_ms = (int)(1.0e3 * (time_now() - time_start));
+    if(!args->daemon_flag && args->wait_arg > 0 && args->wait_arg * 1000 - waited_ms < timeout_ms)
+      timeout_ms = args->wait_arg * 1000 - waited_ms;
+    if(timeout_ms <= 0)
+    {
+      fprintf(stderr, "Error: no USB device %04X:%04X plugged in within %d s\n", vid, pid, args->wait_arg);
+      rc = -1;
+      break;
+    }
+    int arrived = usb_wait_device(sp, vid, pid, &target, timeout_ms);
+    if(arrived < 0)
+    {
+      rc = -1;
+      break;
+    }
+    if(arrived == 0 || !target_selected(sp, vid, pid, &target))
+      continue;
+    double time_device = time_now();
+    int device_rc = device_session(sp, vid, pid, target.path, target.uid);
+    close_usb_device(sp);
+    devices++;
+    failed += device_rc != 0;
+    printf("%-12s UID %-16s %s %.1f s\n", target.path, target.uid[0] ? target.uid : "unknown",
+      device_rc ? "FAIL" : "PASS", time_now() - time_device);
+    fflush(stdout);
+    if(!args->daemon_flag)
+    {
+      rc = device_rc;
+      break;
+    }
   }
-
-#if 1
-  int rc;
-  rc = libusb_claim_interface(device_handle, 0);
-  if (rc < 0)
+  if(args->daemon_flag)
   {
-    fprintf(stderr, "Error claiming interface: %s\n", libusb_error_name(rc));
-    return -1;
+    printf("%d of %d devices passed\n", devices - failed, devices);
+    rc = failed || rc < 0 ? -1 : 0;
   }
-  interface_claimed = 1;
-#endif
-  return 0;
-}
-
-int send_one_packet()
-{
-  uint8_t buf[32];
-  buf[0] = 0xAB; // 1010 1011
-  buf[1] = 0x00;
-  buf[2] = 0x00;
-  buf[3] = 0x00;
-  for(int i = 4; i < 32; i++)
-    buf[i] = 0x00;
-  uint16_t datalen = 32;
-  uint8_t data1 = 0; // currently no use
-  uint8_t bRequest = 0; // currently no use
-  uint16_t wIndex = 0; // currently no use
-  uint16_t wValue = 0; // wValue: 0-no continuation, 1-continuation
-  uint16_t timeout_ms = 100; // 10 ms waiting for response
-
-  int  response = libusb_control_transfer(device_handle, (uint8_t)(LIBUSB_ENDPOINT_OUT|LIBUSB_REQUEST_TYPE_VENDOR|data1),
-      bRequest, wValue, wIndex, buf, datalen, timeout_ms);
-
-#if 1
-  //usleep(1000000);
-
-  response = libusb_control_transfer(device_handle, (uint8_t)(LIBUSB_ENDPOINT_IN|LIBUSB_REQUEST_TYPE_VENDOR|data1),
-      bRequest, wValue, wIndex, buf, datalen, timeout_ms);
-  
-  print_hex_buf(buf, datalen);
-#endif
-  return response;
-}
-
-
-int test_read(uint32_t addr, uint32_t len)
-{
-  uint8_t *buf; // buffer 64K
-  buf = (uint8_t *)malloc(len * sizeof(uint8_t));
-  flash_read(buf, addr, len); // read complete buffer from flash address 0
-
-  // print start of the buffer
-  printf("address 0x%06X length %d\n", addr, len);
-  print_hex_buf(buf, len);
-  free(buf);
-  return 0;
+  fpgasp_free(sp);
+  return rc;
 }
 
 int main(int argc, char **argv)
@@ -629,34 +445,47 @@ int main(int argc, char **argv)
   
   sscanf(args->device_arg, "%x:%x", &usb_vid, &usb_pid);
 
-  if(open_usb_device(usb_vid, usb_pid) < 0)
+  if(args->manifest_given && read_manifest(args->manifest_arg) < 0)
     return -1;
-    
-  printf("FLASH ID: 0x%02X\n", flash_read_id());
-  
-  #if 0
-  
-  uint8_t flash_status = flash_read_status(0x05);
-  printf("FLASH STATUS: 0x%02X\n", flash_status);
-  
-  //usleep(1000000);
-  // test_read(0x300000); // alphabet
-  test_read(0x200000+2*1024-64, 128); // alphabet
-  
-  //flash_erase_sector(0x200000, 4*1024);
-  uint32_t length = 4096;
-  uint8_t *data = (uint8_t *)malloc(length * sizeof(uint8_t));
-  for(int i = 0; i < length; i++)
-    data[i] = 0xFF & i;
-  // flash_write(data, 0x200000+2*1024, length);
-  free(data);
-  test_read(0x200000+2*1024-64, 256); // alphabet
-  #endif
-  
-  if(args->read_given)
-    read_flash_write_file(args->read_arg, args->address_arg, args->length_arg);
   if(args->write_given)
-    read_file_write_flash(args->write_arg, args->address_arg, 0);
+  {
+    if(num_regions == REGIONS_MAX)
+    {
+      fprintf(stderr, "too many regions\n");
+      return -1;
+    }
+    regions[num_regions].filename = args->write_arg;
+    regions[num_regions].addr = args->address_arg;
+    regions[num_regions].length = 0;
+    num_regions++;
+  }
 
-  return 0;
+  if((args->wait_given || args->daemon_flag) && !args->list_flag)
+    return run_hotplug(usb_vid, usb_pid) < 0 ? 1 : 0;
+
+  // each device, also each worker, opens libusb in its own session
+  struct usb_target targets[USB_TARGETS_MAX];
+  struct fpgasp *sp = fpgasp_new(0);
+  if(sp == NULL)
+    return -1;
+  int n = select_targets(sp, usb_vid, usb_pid, targets);
+  fpgasp_free(sp);
+  if(n < 0)
+    return -1;
+  if(args->list_flag)
+  {
+    for(int i = 0; i < n; i++)
+      printf("%-12s UID %s\n", targets[i].path, targets[i].uid[0] ? targets[i].uid : "unknown");
+    return 0;
+  }
+  if(n == 0)
+  {
+    fprintf(stderr, "Error finding USB device %04X:%04X\n", usb_vid, usb_pid);
+    return -1;
+  }
+  if(n > 1 && !args->all_flag && !args->path_given && !args->uid_given)
+    n = 1; // without selection only the first device
+  if(n > 1)
+    return run_parallel(usb_vid, usb_pid, targets, n) < 0 ? 1 : 0;
+  return run_device(usb_vid, usb_pid, targets[0].path) < 0 ? 1 : 0;
 }
@@ -1,7 +1,12 @@
 import struct
+import errno
 import json
+import hashlib
+import math
+import os
 import jsonmerge
 import re
+import zlib
 from intelhex import IntelHex
 from tqdm import tqdm
 from functools import reduce
@@ -13,6 +18,7 @@ import platform
 
 use_libusb = False
 use_pyserial = False
+use_meta_cache = True
 
 def to_int(value):
     try:
@@ -71,6 +77,9 @@ class SerialPort(object):
     def read(self, length):
         return self.ser.read(length)
 
+    def readinto(self, buf):
+        return self.ser.readinto(buf)
+
 
 class UsbPort(object):
     def __init__(self, device):
@@ -96,12 +105,30 @@ class UsbPort(object):
         pass
 
     def read(self, length):
+        import usb.core
         if length > 0:
-            data = self.IN.read(length)
+            try:
+                data = self.IN.read(length)
+            except usb.core.USBError as e:
+                # like a serial port, a read timeout returns what arrived
+                if e.errno != errno.ETIMEDOUT:
+                    raise
+                data = []
             return bytearray(data)
         else:
             return ""
 
+    def readinto(self, buf):
+        # a bulk IN transfer can end early with a short packet
+        filled = 0
+        while filled < len(buf):
+            data = self.read(len(buf) - filled)
+            if len(data) == 0:
+                break  # timeout, the caller sees a short read
+            buf[filled : filled + len(data)] = bytearray(data)
+            filled += len(data)
+        return filled
+
 
 bit_reverse_table = bytearray([
     0x00, 0x80, 0x40, 0xC0, 0x20, 0xA0, 0x60, 0xE0, 0x10, 0x90, 0x50, 0xD0, 0x30, 0xB0, 0x70, 0xF0,
@@ -134,11 +161,113 @@ def _mirror_each_byte(data):
     return mirrored_data
 
 
+def meta_cache_dir():
+    base = os.environ.get("XDG_CACHE_HOME") or os.path.join(os.path.expanduser("~"), ".cache")
+    return os.path.join(base, "tinyprog")
+
+
 class TinyMeta(object):
+    """
+    Board metadata, read from flash on first use of root.
+
+    Metadata found through security register pages is cached on disk,
+    keyed by the flash JEDEC ID and the security page contents, so a known
+    board costs three short reads instead of the full scan. The "@addr+len"
+    pointer ranges are stored with a CRC32 and read again before the cache
+    entry is trusted.
+    """
+
+    security_pages = [1, 2, 3]
+    # metadata roots in flash, last 4K below each power of two from 128K to 16M
+    flash_roots = [(int(math.pow(2, p) - (4 * 1024)), (4 * 1024) - 256) for p in [17, 18, 19, 20, 21, 22, 23, 24]]
+
     def __init__(self, prog):
         self.prog = prog
-        prog.wake()
-        self.root = self._read_metadata()
+        self._root = None
+        self._loaded = False
+        self._ranges = [] # flash ranges the metadata was read from, pointers with CRC32
+        self._cache_file = None
+
+    @property
+    def root(self):
+        if not self._loaded:
+            self._load()
+        return self._root
+
+    def _load(self):
+        self.prog.wake()
+        pages = [self.prog.read_security_register_page(p) for p in self.security_pages]
+        self._cache_file = self._cache_file_name(pages)
+        cached = self._cache_read()
+        if cached is not None and self._ranges_valid(cached[u"ranges"]):
+            self._root = cached[u"root"]
+            self._ranges = cached[u"ranges"]
+        else:
+            self._ranges = []
+            self._root = self._read_metadata(pages)
+            self._cache_write()
+        self._loaded = True
+
+    def _cache_file_name(self, pages):
+        # without a root in the security pages the key would not tell boards apart
+        if not use_meta_cache or not any(self._parse_page(page) is not None for page in pages):
+            return None
+        key = hashlib.sha1(bytes(bytearray(self.prog.read_id())))
+        for page in pages:
+            key.update(bytes(bytearray(page)))
+        return os.path.join(meta_cache_dir(), key.hexdigest() + ".json")
+
+    def _ranges_valid(self, ranges):
+        # flash roots are too long to check each time, writes through
+        # invalidate() drop the entry; a range without CRC is from an old cache
+        for r in ranges:
+            if len(r) == 3:
+                if zlib.crc32(bytes(self.prog.read(r[0], r[1]))) & 0xffffffff != r[2]:
+                    return False
+            elif tuple(r) not in self.flash_roots:
+                return False
+        return True
+
+    def _cache_read(self):
+        if self._cache_file is None:
+            return None
+        try:
+            with open(self._cache_file) as f:
+                return json.load(f)
+        except (IOError, OSError, ValueError):
+            return None
+
+    def _cache_write(self):
+        if self._cache_file is None or self._root is None:
+            return
+        try:
+            if not os.path.isdir(os.path.dirname(self._cache_file)):
+                os.makedirs(os.path.dirname(self._cache_file))
+            with open(self._cache_file, "w") as f:
+                json.dump({u"root": self._root, u"ranges": self._ranges}, f)
+        except (IOError, OSError):
+            pass # cache is optional
+
+    def invalidate(self, addr, length):
+        """
+        Drop the cached metadata of this board if flash range addr+length
+        overlaps a range it was read from.
+        """
+        if not self._loaded:
+            self._cache_file = self._cache_file_name(
+                [self.prog.read_security_register_page(p) for p in self.security_pages])
+            cached = self._cache_read()
+            self._ranges = cached[u"ranges"] if cached is not None else []
+        if self._cache_file is None:
+            return
+        if any(r[0] < addr + length and addr < r[0] + r[1] for r in self._ranges):
+            try:
+                os.remove(self._cache_file)
+            except OSError:
+                pass
+
+    def _parse_page(self, data):
+        return self._parse_json(data.replace(b"\x00", b"").replace(b"\xff", b""))
 
     def _parse_json(self, data):
         try:
@@ -156,18 +285,20 @@ class TinyMeta(object):
         if isinstance(meta, (str, bytes)):
             m = re.search(r"^\s*@\s*0x(?P<addr>[A-Fa-f0-9]+)\s*\+\s*(?P<len>\d+)\s*$", meta)
             if m:
-                data = self.prog.read(int(m.group("addr"), 16), int(m.group("len")))
+                addr, length = int(m.group("addr"), 16), int(m.group("len"))
+                data = self.prog.read(addr, length)
+                self._ranges.append([addr, length, zlib.crc32(bytes(data)) & 0xffffffff])
                 return json.loads(bytes(data).decode("utf-8"))
             else:
                 return meta
 
         return meta
 
-    def _read_metadata(self):
-        import math
+    def _read_metadata(self, pages):
+        self._ranges += [list(region) for region in self.flash_roots]
         meta_roots = (
-            [self._parse_json(self.prog.read_security_register_page(p).replace(b"\x00", b"").replace(b"\xff", b"")) for p in [1, 2, 3]] +
-            [self._parse_json(self.prog.read(int(math.pow(2, p) - (4 * 1024)), (4 * 1024) - 256).replace(b"\x00", b"").replace(b"\xff", b"")) for p in [17, 18, 19, 20, 21, 22, 23, 24]]
+            [self._parse_page(page) for page in pages] +
+            [self._parse_page(self.prog.read(addr, length)) for addr, length in self.flash_roots]
         )
         meta_roots = [root for root in meta_roots if root is not None]
         if len(meta_roots) > 0:
@@ -198,6 +329,16 @@ class TinyMeta(object):
 
 
 class TinyProg(object):
+    # usb_spi_bridge_ep.v takes a 16-bit read length per command
+    READ_LEN_MAX = 0xFFFF
+    # read commands sent before their response is read. the next one waits
+    # in the OUT endpoint buffer while the current response streams, more
+    # would block the write while nobody reads the IN data
+    READ_PIPELINE = 2
+    # read timeouts of the port waited for the status byte of a poll,
+    # a 64K erase may take longer than one
+    POLL_TIMEOUTS = 30
+
     def __init__(self, ser, progress=None):
         self.ser = ser
 
@@ -209,6 +350,7 @@ class TinyProg(object):
         self.wake()
         flash_id = self.read_id()
         flash_id = [to_int(b) for b in flash_id]
+        self.has_poll = self._probe_poll(flash_id)
         # temporary hack, should have better database as well as SFPD reading
         if flash_id[0:2] == [0x9D, 0x60]:
             # ISSI
@@ -233,16 +375,56 @@ class TinyProg(object):
             return True
         return False
 
-    def cmd(self, opcode, addr=None, data=b'', read_len=0):
-        #print("type of data is %s" % type(data))
-        #assert isinstance(data, bytes)
+    def _cmd_string(self, opcode, addr=None, data=b'', read_len=0):
         addr = b'' if addr is None else struct.pack('>I', addr)[1:]
         write_string = bytearray([opcode]) + addr + data
-        cmd_write_string = b'\x01' + struct.pack('<HH', len(write_string), read_len) + write_string
-        self.ser.write(bytearray(cmd_write_string))
+        return bytearray(b'\x01' + struct.pack('<HH', len(write_string), read_len) + write_string)
+
+    def cmd(self, opcode, addr=None, data=b'', read_len=0):
+        self.ser.write(self._cmd_string(opcode, addr, data, read_len))
         self.ser.flush()
         return self.ser.read(read_len)
 
+    # usb_spi_bridge_ep.v repeats the status read until (status & mask) == 0,
+    # then sends that status byte
+    def _poll_string(self, mask=0x01):
+        return bytearray([0x02, 0x05, mask])
+
+    def _probe_poll(self, flash_id):
+        """
+        True if the gateware runs poll commands. Older gateware skips the
+        poll bytes and only answers the JEDEC ID read sent after them.
+        """
+        self.write_disable()
+        self.ser.write(self._poll_string(0x02) + self._cmd_string(0x9f, read_len=3))
+        self.ser.flush()
+        if [to_int(b) for b in self.ser.read(3)] == flash_id:
+            return False
+        self.ser.read(1) # last byte of the JEDEC ID
+        return True
+
+    # the gateware gives up after about 4 s and sends the busy status
+    def _read_poll(self):
+        for i in range(self.POLL_TIMEOUTS):
+            status = self.ser.read(1)
+            if status:
+                if to_int(status) & 0x01:
+                    raise IOError("flash still busy after the poll limit")
+                return status
+        raise IOError("flash still busy after %d read timeouts" % self.POLL_TIMEOUTS)
+
+    # write enable, program or erase command and wait while busy.
+    # with poll commands it is one script: one write, one status byte back
+    def _busy_cmd(self, opcode, addr, data=b''):
+        if self.has_poll:
+            self.ser.write(self._cmd_string(0x06) + self._cmd_string(opcode, addr, data) + self._poll_string())
+            self.ser.flush()
+            self._read_poll()
+        else:
+            self.write_enable()
+            self.cmd(opcode, addr, data)
+            self.wait_while_busy()
+
     def sleep(self):
         self.cmd(0xb9)
 
@@ -256,32 +438,39 @@ class TinyProg(object):
         return self.cmd(0x05, read_len=1)
 
     def erase_security_register_page(self, page):
-        self.write_enable()
-        self.cmd(self.security_page_erase_cmd, page << (8 + self.security_page_bit_offset))
-        self.wait_while_busy()
+        self._busy_cmd(self.security_page_erase_cmd, page << (8 + self.security_page_bit_offset))
 
     def program_security_register_page(self, page, data):
-        self.write_enable()
-        self.cmd(self.security_page_write_cmd, page << (8 + self.security_page_bit_offset), data)
-        self.wait_while_busy()
+        self._busy_cmd(self.security_page_write_cmd, page << (8 + self.security_page_bit_offset), data)
 
     def read_security_register_page(self, page):
         return self.cmd(self.security_page_read_cmd, addr=page << (8 + self.security_page_bit_offset), data=b'\x00', read_len=255)
 
+    # fast read commands of READ_LEN_MAX bytes, READ_PIPELINE of them
+    # on the link, responses land directly in the result buffer
     def read(self, addr, length, disable_progress=True):
-        data = b''
+        data = bytearray(length)
+        view = memoryview(data)
+        chunks = [(offset, min(self.READ_LEN_MAX, length - offset))
+                  for offset in range(0, length, self.READ_LEN_MAX)]
+        sent = 0
         with tqdm(desc="    Reading", unit="B", unit_scale=True, total=length, disable=disable_progress) as pbar:
-            while length > 0:
-                read_length = min(255, length)
-                read_payload = self.cmd(0x0b, addr, b'\x00', read_len=read_length)
-                payload_length = len(read_payload)
-                if payload_length > 0:
-                  data += read_payload
-                  self.progress(payload_length)
-                  addr += payload_length
-                  length -= payload_length
-                  pbar.update(payload_length)
-            return data
+            for i, (offset, read_length) in enumerate(chunks):
+                burst = chunks[sent : i + self.READ_PIPELINE]
+                for chunk_offset, chunk_length in burst:
+                    self.ser.write(self._cmd_string(0x0b, addr + chunk_offset, b'\x00', chunk_length))
+                if burst:
+                    self.ser.flush()
+                    sent += len(burst)
+                received = 0
+                while received < read_length:
+                    payload_length = self.ser.readinto(view[offset + received : offset + read_length])
+                    if not payload_length:
+                        raise IOError("flash read at 0x%06x timed out" % (addr + offset + received))
+                    received += payload_length
+                    self.progress(payload_length)
+                    pbar.update(payload_length)
+        return data
 
     def write_enable(self):
         self.cmd(0x06)
@@ -290,6 +479,11 @@ class TinyProg(object):
         self.cmd(0x04)
 
     def wait_while_busy(self):
+        if self.has_poll:
+            self.ser.write(self._poll_string())
+            self.ser.flush()
+            self._read_poll()
+            return
         while to_int(self.read_sts()) & 1:
             pass
 
@@ -299,9 +493,7 @@ class TinyProg(object):
             32 * 1024: 0x52,
             64 * 1024: 0xd8,
         }[length]
-        self.write_enable()
-        self.cmd(opcode, addr)
-        self.wait_while_busy()
+        self._busy_cmd(opcode, addr)
 
     def erase(self, addr, length, disable_progress=True):
         return self.program_sectors(addr, length, disable_progress)
@@ -326,6 +518,7 @@ class TinyProg(object):
         offset = 0
         write_addr = addr + offset
         if verify_only == False:
+          self.meta.invalidate(addr, length)
           with tqdm(desc=description, unit="B", unit_scale=True, total=length, disable=disable_progress) as pbar:
             while length > 0 and retries_remaining > 0:
                 erase_length = max(p for p in possible_lengths
@@ -402,9 +595,7 @@ class TinyProg(object):
 
     # don't use this directly, use the public "write" function instead
     def _write(self, addr, data):
-        self.write_enable()
-        self.cmd(0x02, addr, data)
-        self.wait_while_busy()
+        self._busy_cmd(0x02, addr, data)
         self.progress(len(data))
 
     def write(self, addr, data, disable_progress=True):
@@ -204,6 +204,8 @@ def main():
                         help="try using libusb to connect to boards without a serial driver attached")
     parser.add_argument("--pyserial", action="store_true",
                         help="use pyserial to connect to boards")
+    parser.add_argument("--no-meta-cache", action="store_true",
+                        help="read board metadata from flash, don't use the cache in ~/.cache/tinyprog")
 
     args = parser.parse_args()
 
@@ -215,6 +217,7 @@ def main():
 
     tinyprog.use_libusb = args.libusb
     tinyprog.use_pyserial = args.pyserial
+    tinyprog.use_meta_cache = not args.no_meta_cache
 
     active_boards = get_ports(device) + get_ports("1209:2100")
 
@@ -343,6 +346,7 @@ def main():
         print("    Booting " + str(active_port))
         with active_port:
             fpga = TinyProg(active_port)
+            fpga.boot()
 
     print("")
 
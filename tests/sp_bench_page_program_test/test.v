@@ -0,0 +1,50 @@
+`include "top_tb_header.vh"
+  integer k;
+  integer n;
+  integer p;
+  reg [7:0] data_byte;
+  reg [7:0] page [0:259];
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+  reg [511:0] pkt;
+
+  initial begin
+    // benchmark: 4 page programs 0x02 at 0x100000, 0x100100, ...
+    // each one control transfer of 260 bytes, packets 8 * 32 + 4.
+    // OUT packets are repeated while the device NAKs.
+    bench_start();
+    for (p = 0; p < 4; p = p + 1) begin
+      mosi = 0;
+      miso = 0;
+      for (k = 0; k < 260; k = k + 1) begin
+        data_byte = k == 0 ? 8'h02 : k == 1 ? 8'h10 : k == 2 ? p : k == 3 ? 8'h00 : (p * 256 + k) * 5 + 3;
+        page[k] = data_byte;
+        mosi = {mosi, data_byte};
+        miso = {miso, 8'h00};
+      end
+      prepare_spi_xfer(mosi, miso, 260 * 8);
+
+      // setup stage: bRequest 0, wIndex 0, wLength 260
+      send_usb_setup(0, 0);
+      send_usb_data0({8'h01, 8'h04, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h40}, 64);
+      expect_usb_ack();
+
+      // data stage
+      for (n = 0; n < 9; n = n + 1) begin
+        pkt = 0;
+        for (k = 0; k < 32 && n * 32 + k < 260; k = k + 1) begin
+          pkt[k * 8 +: 8] = page[n * 32 + k];
+        end
+        send_usb_out_data(0, 0, n % 2 ? 4'b0011 : 4'b1011, pkt, n == 8 ? 4 * 8 : 32 * 8);
+      end
+
+      // status stage after SPI has sent all 260 bytes
+      expect_usb_status_in(0);
+      `assert("all bytes sent to SPI", spi_mosi_length, 0);
+    end
+
+    bench_report(4 * 256);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
@@ -0,0 +1,48 @@
+`include "top_tb_header.vh"
+  integer k;
+  integer n;
+  reg [7:0] data_byte;
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+  reg [511:0] out_data;
+  reg [1023:0] in_data;
+
+  initial begin
+    // benchmark: read 8 * 28 bytes the way gateware before stream read
+    // is used: SPI OUT of read 0x03, address and 28 bytes, then SPI IN
+    bench_start();
+    for (n = 0; n < 8; n = n + 1) begin
+      out_data = {8'h00, n[7:0] * 8'd28, 8'h00, 8'h03};
+      in_data = 0;
+      mosi = {8'h03, 8'h00, n[7:0] * 8'd28, 8'h00};
+      miso = 32'h00000000;
+      for (k = 4; k < 32; k = k + 1) begin
+        data_byte = (n * 28 + k) * 7 + 1;
+        in_data[k * 8 +: 8] = data_byte;
+        mosi = {mosi, 8'h00};
+        miso = {miso, data_byte};
+      end
+      prepare_spi_xfer(mosi, miso, 32 * 8);
+
+      // SPI OUT: bRequest 0, wLength 32
+      send_usb_ctrl_out(0, {8'h00, 8'h20, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h40}, out_data, 32 * 8);
+
+      // SPI IN: bRequest 0, wLength 32
+      send_usb_setup(0, 0);
+      send_usb_data0({8'h00, 8'h20, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'hC0}, 64);
+      expect_usb_ack();
+
+      get_usb_in(0, 0);
+      check_usb_data(4'b1011, in_data, 32 * 8);
+      send_usb_ack();
+
+      send_usb_out(0, 0);
+      send_usb_data1(0, 0);
+      expect_usb_ack();
+    end
+
+    bench_report(8 * 28);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
@@ -0,0 +1,49 @@
+`include "top_tb_header.vh"
+  integer k;
+  integer n;
+  reg [7:0] data_byte;
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+  reg [1023:0] in_data;
+
+  initial begin
+    // benchmark: stream read of 960 bytes with fast read 0x0B in one
+    // control IN transfer, the host polls each packet until it is ready
+    mosi = {8'h0B, 8'h12, 8'h34, 8'h56, 8'hFF};
+    miso = 40'h0000000000;
+    for (k = 0; k < 960; k = k + 1) begin
+      data_byte = k * 3 + 1;
+      mosi = {mosi, 8'hFF};
+      miso = {miso, data_byte};
+    end
+    prepare_spi_xfer(mosi, miso, (5 + 960) * 8);
+    bench_start();
+
+    // setup stage: bRequest 5, wValue 0x3456, wIndex 0x0B12, wLength 960
+    send_usb_setup(0, 0);
+    send_usb_data0({8'h03, 8'hC0, 8'h0B, 8'h12, 8'h34, 8'h56, 8'h05, 8'hC0}, 64);
+    expect_usb_ack();
+
+    // data stage: 30 packets of 32 bytes
+    for (n = 0; n < 30; n = n + 1) begin
+      in_data = 0;
+      for (k = 0; k < 32; k = k + 1) begin
+        data_byte = (n * 32 + k) * 3 + 1;
+        in_data[k * 8 +: 8] = data_byte;
+      end
+      get_usb_in(0, 0);
+      check_usb_data(n % 2 ? 4'b0011 : 4'b1011, in_data, 32 * 8);
+      send_usb_ack();
+    end
+
+    // status stage
+    send_usb_out(0, 0);
+    send_usb_data1(0, 0);
+    expect_usb_ack();
+
+    bench_report(960);
+    `assert("all bytes read from SPI", spi_miso_length, 0);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
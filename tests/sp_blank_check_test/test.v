@@ -0,0 +1,44 @@
+`include "top_tb_header.vh"
+  integer k;
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+
+  initial begin
+    // 2 pages from 0x004000, first non-blank byte at 0x00412C
+    mosi = {8'h03, 8'h00, 8'h40, 8'h00};
+    miso = 32'h00000000;
+    for (k = 0; k < 512; k = k + 1) begin
+      mosi = {mosi, 8'hFF};
+      miso = {miso, k == 300 ? 8'hFE : 8'hFF};
+    end
+    prepare_spi_xfer(mosi, miso, 516 * 8);
+
+    // start blank check: bRequest 3, wValue page 0x0040, wIndex 2 pages
+    send_usb_ctrl_xfer(0, {8'h00, 8'h00, 8'h00, 8'h02, 8'h00, 8'h40, 8'h03, 8'h40});
+
+    #150000000;
+
+    // scan stops at first non-blank byte
+    `assert("chip select released after scan", spi_cs, 1'b1);
+    send_usb_ctrl_in(0, {8'h00, 8'h05, 8'h00, 8'h00, 8'h00, 8'h00, 8'h03, 8'hC0},
+      {8'h00, 8'h00, 8'h41, 8'h2C, 8'h00}, 5 * 8);
+
+    // one blank page from 0x004100
+    mosi = {8'h03, 8'h00, 8'h41, 8'h00};
+    miso = 32'h00000000;
+    for (k = 0; k < 256; k = k + 1) begin
+      mosi = {mosi, 8'hFF};
+      miso = {miso, 8'hFF};
+    end
+    prepare_spi_xfer(mosi, miso, 260 * 8);
+
+    send_usb_ctrl_xfer(0, {8'h00, 8'h00, 8'h00, 8'h01, 8'h00, 8'h41, 8'h03, 8'h40});
+
+    #100000000;
+
+    send_usb_ctrl_in(0, {8'h00, 8'h05, 8'h00, 8'h00, 8'h00, 8'h00, 8'h03, 8'hC0},
+      {8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'h00}, 5 * 8);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
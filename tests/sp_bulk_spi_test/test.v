@@ -0,0 +1,41 @@
+`include "top_tb_header.vh"
+  initial begin
+    // configuration descriptor lists EP1 bulk OUT and IN
+    send_usb_ctrl_in(0, {8'h00, 8'h20, 8'h00, 8'h00, 8'h02, 8'h00, 8'h06, 8'h80},
+      {8'h00, 8'h00, 8'h20, 8'h02, 8'h81, 8'h05, 8'h07,
+       8'h00, 8'h00, 8'h20, 8'h02, 8'h01, 8'h05, 8'h07,
+       8'h00, 8'h00, 8'h00, 8'h00, 8'h02, 8'h00, 8'h00, 8'h04, 8'h09,
+       8'hFA, 8'hC0, 8'h00, 8'h01, 8'h01, 8'h00, 8'h20, 8'h02, 8'h09}, 32 * 8);
+
+    // bulk frame: 1, out length 5, in length 4, fast read command, address and dummy byte
+    prepare_spi_xfer(
+      /* MOSI */ {8'h0B, 8'h12, 8'h34, 8'h56, 8'h00, 32'h00000000},
+      /* MISO */ {40'h0000000000, 32'h57acca70},
+      /* Length */ 72
+    );
+
+    send_usb_out(0, 1);
+    send_usb_data0({8'h00, 8'h56, 8'h34, 8'h12, 8'h0B, 8'h00, 8'h04, 8'h00, 8'h05, 8'h01}, 10 * 8);
+    expect_usb_ack();
+
+    #10000000;
+
+    send_usb_in(0, 1);
+    expect_usb_data0({8'h70, 8'hca, 8'hac, 8'h57}, 32);
+    send_usb_ack();
+
+    #10000000;
+    `assert("chip select released", spi_cs, 1'b1);
+
+    // control endpoint still drives SPI after the bridge released it
+    prepare_spi_xfer(
+      /* MOSI */ {8'h05, 8'h00},
+      /* MISO */ {8'h00, 8'h40},
+      /* Length */ 16
+    );
+    send_usb_ctrl_out(0, {8'h00, 8'h02, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h40}, {8'h00, 8'h05}, 16);
+    send_usb_ctrl_in(0, {8'h00, 8'h02, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'hC0}, {8'h40, 8'h00}, 16);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
@@ -0,0 +1,78 @@
+`include "top_tb_header.vh"
+  integer k;
+  reg [7:0] data_byte;
+  reg [31:0] crc;
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+  reg [1023:0] in_data [0:2];
+
+  initial begin
+    // checked stream read: fast read 0x0B at 0x123456, 40 bytes and CRC32
+    // in the first request, chip select stays low and the second request
+    // continues with 16 bytes and CRC32, then releases chip select
+    mosi = {8'h0B, 8'h12, 8'h34, 8'h56, 8'hFF};
+    miso = 40'h0000000000;
+    for (k = 0; k < 3; k = k + 1)
+      in_data[k] = 0;
+    crc = 32'hFFFFFFFF;
+    for (k = 0; k < 40; k = k + 1) begin
+      data_byte = k * 5 + 2;
+      crc = crc32_ref(crc, data_byte);
+      in_data[k / 32][(k % 32) * 8 +: 8] = data_byte;
+      mosi = {mosi, 8'hFF};
+      miso = {miso, data_byte};
+    end
+    in_data[1][8 * 8 +: 32] = ~crc;
+    crc = 32'hFFFFFFFF;
+    for (k = 0; k < 16; k = k + 1) begin
+      data_byte = k * 11 + 7;
+      crc = crc32_ref(crc, data_byte);
+      in_data[2][k * 8 +: 8] = data_byte;
+      mosi = {mosi, 8'hFF};
+      miso = {miso, data_byte};
+    end
+    in_data[2][16 * 8 +: 32] = ~crc;
+    prepare_spi_xfer(mosi, miso, (5 + 40 + 16) * 8);
+
+    // setup stage: bRequest 6, wValue 0x3456, wIndex 0x0B12, wLength 44
+    send_usb_setup(0, 0);
+    send_usb_data0({8'h00, 8'h2C, 8'h0B, 8'h12, 8'h34, 8'h56, 8'h06, 8'hC0}, 64);
+    expect_usb_ack();
+
+    // data stage: 32 data bytes, then 8 data bytes and CRC32
+    get_usb_in(0, 0);
+    check_usb_data(4'b1011, in_data[0], 32 * 8);
+    send_usb_ack();
+
+    get_usb_in(0, 0);
+    check_usb_data(4'b0011, in_data[1], 12 * 8);
+    send_usb_ack();
+
+    // status stage
+    send_usb_out(0, 0);
+    send_usb_data1(0, 0);
+    expect_usb_ack();
+
+    #2000000;
+    `assert("chip select held after the first request", spi_cs, 1'b0);
+
+    // setup stage: bRequest 6, wValue 0 (release), wIndex 0 (continue), wLength 20
+    send_usb_setup(0, 0);
+    send_usb_data0({8'h00, 8'h14, 8'h00, 8'h00, 8'h00, 8'h00, 8'h06, 8'hC0}, 64);
+    expect_usb_ack();
+
+    get_usb_in(0, 0);
+    check_usb_data(4'b1011, in_data[2], 20 * 8);
+    send_usb_ack();
+
+    send_usb_out(0, 0);
+    send_usb_data1(0, 0);
+    expect_usb_ack();
+
+    #2000000;
+    `assert("chip select released", spi_cs, 1'b1);
+    `assert("all bytes read from SPI", spi_miso_length, 0);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
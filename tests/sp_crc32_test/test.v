@@ -0,0 +1,49 @@
+`include "top_tb_header.vh"
+  integer k;
+  reg [7:0] data_byte;
+  reg [31:0] crc;
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+
+  initial begin
+    // reference model check value, CRC32 of "123456789"
+    crc = 32'hFFFFFFFF;
+    for (k = 0; k < 9; k = k + 1) begin
+      crc = crc32_ref(crc, "123456789" >> ((8 - k) * 8));
+    end
+    `assert("CRC32 reference model", ~crc, 32'hCBF43926);
+
+    // read command 0x03 from 0x012300, then 256 dummy bytes
+    mosi = {8'h03, 8'h01, 8'h23, 8'h00};
+    miso = 32'h00000000;
+    crc = 32'hFFFFFFFF;
+    for (k = 0; k < 256; k = k + 1) begin
+      data_byte = k * 37 + 11;
+      mosi = {mosi, 8'hFF};
+      miso = {miso, data_byte};
+      crc = crc32_ref(crc, data_byte);
+    end
+    crc = ~crc;
+    prepare_spi_xfer(mosi, miso, 260 * 8);
+
+    // start CRC32: bRequest 2, wValue page 0x0123, wIndex 1 page
+    send_usb_ctrl_xfer(0, {8'h00, 8'h00, 8'h00, 8'h01, 8'h01, 8'h23, 8'h02, 8'h40});
+
+    // still busy
+    send_usb_ctrl_in(0, {8'h00, 8'h05, 8'h00, 8'h00, 8'h00, 8'h00, 8'h02, 8'hC0},
+      {8'h00, 8'h00, 8'h00, 8'h00, 8'h01}, 5 * 8);
+    `assert("chip select active while scanning", spi_cs, 1'b0);
+
+    #100000000;
+
+    `assert("chip select released after scan", spi_cs, 1'b1);
+    send_usb_ctrl_in(0, {8'h00, 8'h05, 8'h00, 8'h00, 8'h00, 8'h00, 8'h02, 8'hC0},
+      {crc[31:24], crc[23:16], crc[15:8], crc[7:0], 8'h00}, 5 * 8);
+
+    // SPI busy query also reports the scanner
+    send_usb_ctrl_in(0, {8'h00, 8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h01, 8'hC0},
+      {8'h00}, 8);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
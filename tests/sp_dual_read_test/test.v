@@ -0,0 +1,32 @@
+`include "top_tb_header.vh"
+  integer k;
+  reg [7:0] data_byte;
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+  reg [511:0] out_data;
+  reg [1023:0] in_data;
+
+  initial begin
+    // dual output read 0x3B: command and address single bit, 8 dummy clocks and data on IO1, IO0
+    out_data = {8'h56, 8'h34, 8'h12, 8'h3B};
+    in_data = 0;
+    mosi = {8'h3B, 8'h12, 8'h34, 8'h56}; // only header is checked on MOSI
+    miso = 32'h00000000;
+    for (k = 4; k < 32; k = k + 1) begin
+      data_byte = k < 4 + 2 ? 8'h00 : k * 7 + 1;
+      in_data[k * 8 +: 8] = data_byte;
+      miso = {miso, data_byte};
+    end
+    prepare_spi_wide_xfer(mosi, miso, 32 * 8, 4 * 8, 2);
+
+    // SPI OUT: bRequest 0, wIndex 0x0044: 4 header bytes, wLength 32
+    send_usb_ctrl_out(0, {8'h00, 8'h20, 8'h00, 8'h44, 8'h00, 8'h00, 8'h00, 8'h40}, out_data, 32 * 8);
+
+    #20000000;
+
+    `assert("chip select released", spi_cs, 1'b1);
+    send_usb_ctrl_in(0, {8'h00, 8'h20, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'hC0}, in_data, 32 * 8);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
@@ -0,0 +1,54 @@
+`include "top_tb_header.vh"
+  integer k;
+  reg [7:0] data_byte;
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+  reg [511:0] pkt [0:3];
+
+  initial begin
+    // page program 0x02: command, address and 96 data bytes
+    // in one control transfer of 100 bytes, packets 32+32+32+4
+    mosi = 0;
+    miso = 0;
+    for (k = 0; k < 4; k = k + 1)
+      pkt[k] = 0;
+    for (k = 0; k < 100; k = k + 1) begin
+      data_byte = k == 0 ? 8'h02 : k == 1 ? 8'h12 : k == 2 ? 8'h34 : k == 3 ? 8'h56 : k * 5 + 3;
+      pkt[k / 32][(k % 32) * 8 +: 8] = data_byte;
+      mosi = {mosi, data_byte};
+      miso = {miso, 8'h00};
+    end
+    prepare_spi_xfer(mosi, miso, 100 * 8);
+
+    // setup stage: bRequest 0, wIndex 0, wLength 100
+    send_usb_setup(0, 0);
+    send_usb_data0({8'h00, 8'h64, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h40}, 64);
+    expect_usb_ack();
+
+    // data stage
+    send_usb_out(0, 0);
+    send_usb_data1(pkt[0], 32 * 8);
+    expect_usb_ack();
+
+    send_usb_out(0, 0);
+    send_usb_data0(pkt[1], 32 * 8);
+    expect_usb_ack();
+
+    send_usb_out(0, 0);
+    send_usb_data1(pkt[2], 32 * 8);
+    expect_usb_ack();
+
+    send_usb_out(0, 0);
+    send_usb_data0(pkt[3], 4 * 8);
+    expect_usb_ack();
+
+    // status stage after SPI has sent all 100 bytes
+    expect_usb_status_in(0);
+    `assert("all bytes sent to SPI", spi_mosi_length, 0);
+
+    #2000000;
+    `assert("chip select released", spi_cs, 1'b1);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
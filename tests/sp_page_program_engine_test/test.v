@@ -0,0 +1,71 @@
+`include "top_tb_header.vh"
+  integer k;
+  reg [7:0] data_byte;
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+  reg [511:0] out_data;
+
+  initial begin
+    // page A: 16 bytes at 0x123400, status busy once
+    mosi = {8'h06, 8'h02, 8'h12, 8'h34, 8'h00};
+    miso = {8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF};
+    out_data = 0;
+    for (k = 0; k < 16; k = k + 1) begin
+      data_byte = k * 17 + 1;
+      mosi = {mosi, data_byte};
+      miso = {miso, 8'hFF};
+      out_data = out_data | (data_byte << (k * 8));
+    end
+    mosi = {mosi, 8'h05, 8'h05, 8'h05};
+    miso = {miso, 8'hFF, 8'h03, 8'h00};
+    // page B: RLE coded 8 x 5A at 0x123500, busy long enough to be seen by the PC
+    mosi = {mosi, 8'h06, 8'h02, 8'h12, 8'h35, 8'h00};
+    miso = {miso, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF};
+    for (k = 0; k < 8; k = k + 1) begin
+      mosi = {mosi, 8'h5A};
+      miso = {miso, 8'hFF};
+    end
+    mosi = {mosi, 8'h05};
+    miso = {miso, 8'hFF};
+    for (k = 0; k < 300; k = k + 1) begin
+      mosi = {mosi, 8'h05};
+      miso = {miso, 8'h03};
+    end
+    mosi = {mosi, 8'h05};
+    miso = {miso, 8'h00};
+    // SPI OUT sent while page B is busy, after it
+    mosi = {mosi, 8'h04};
+    miso = {miso, 8'hFF};
+    // page C: 1 byte at 0x123600, WIP never set, write protected
+    mosi = {mosi, 8'h06, 8'h02, 8'h12, 8'h36, 8'h00, 8'h77, 8'h05, 8'h05};
+    miso = {miso, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'h00};
+    prepare_spi_xfer(mosi, miso, (24 + 15 + 300 + 1 + 8) * 8);
+
+    // bRequest 8, wValue 0x1234 address[23:8], wIndex 0 address[7:0], wLength 16
+    send_usb_ctrl_out(0, {8'h00, 8'h10, 8'h00, 8'h00, 8'h12, 8'h34, 8'h08, 8'h40}, out_data, 16 * 8);
+    // wIndex[15] RLE coded: token 87 repeats 5A 8 times
+    send_usb_ctrl_out(0, {8'h00, 8'h02, 8'h80, 8'h00, 8'h12, 8'h35, 8'h08, 8'h40}, {8'h5A, 8'h87}, 2 * 8);
+
+    // busy, no error
+    send_usb_ctrl_in(0, {8'h00, 8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h08, 8'hC0}, {8'h01}, 8);
+    // SPI busy query also reports the engine
+    send_usb_ctrl_in(0, {8'h00, 8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h01, 8'hC0}, {8'h01}, 8);
+
+    // bRequest 0 OUT, data waits in the endpoint until the engine is done
+    send_usb_ctrl_out(0, {8'h00, 8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h40}, {8'h04}, 8);
+
+    #100000000;
+    `assert("chip select released after page B", spi_cs, 1'b1);
+    send_usb_ctrl_in(0, {8'h00, 8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h08, 8'hC0}, {8'h00}, 8);
+
+    send_usb_ctrl_out(0, {8'h00, 8'h01, 8'h00, 8'h00, 8'h12, 8'h36, 8'h08, 8'h40}, {8'h77}, 8);
+    #10000000;
+    `assert("all page program bytes sent to SPI", spi_mosi_length, 0);
+    `assert("chip select released after page C", spi_cs, 1'b1);
+    // error reported once
+    send_usb_ctrl_in(0, {8'h00, 8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h08, 8'hC0}, {8'h02}, 8);
+    send_usb_ctrl_in(0, {8'h00, 8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h08, 8'hC0}, {8'h00}, 8);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
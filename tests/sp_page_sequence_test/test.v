@@ -0,0 +1,36 @@
+`include "top_tb_header.vh"
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+
+  initial begin
+    // page 0: 4 bytes at 0x123400
+    mosi = {8'h06, 8'h02, 8'h12, 8'h34, 8'h00, 8'h11, 8'h22, 8'h33, 8'h44, 8'h05, 8'h05, 8'h05};
+    miso = {8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'h03, 8'h00};
+    // page 1: 1 byte at 0x123500
+    mosi = {mosi, 8'h06, 8'h02, 8'h12, 8'h35, 8'h00, 8'h77, 8'h05, 8'h05, 8'h05};
+    miso = {miso, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'hFF, 8'h03, 8'h00};
+    prepare_spi_xfer(mosi, miso, 21 * 8);
+
+    // wIndex[14] sequence number in wIndex[13:8], page 0
+    send_usb_ctrl_out(0, {8'h00, 8'h04, 8'h40, 8'h00, 8'h12, 8'h34, 8'h08, 8'h40}, {8'h44, 8'h33, 8'h22, 8'h11}, 4 * 8);
+    // repeated page 0, status stage lost on the PC side: dropped
+    send_usb_ctrl_out(0, {8'h00, 8'h04, 8'h40, 8'h00, 8'h12, 8'h34, 8'h08, 8'h40}, {8'h44, 8'h33, 8'h22, 8'h11}, 4 * 8);
+    // page 2 after a lost page 1: dropped, gap reported
+    send_usb_ctrl_out(0, {8'h00, 8'h01, 8'h42, 8'h00, 8'h12, 8'h36, 8'h08, 8'h40}, {8'h55}, 8);
+
+    #10000000;
+    `assert("chip select released after page 0", spi_cs, 1'b1);
+    // gap reported once, next sequence number 1
+    send_usb_ctrl_in(0, {8'h00, 8'h02, 8'h00, 8'h00, 8'h00, 8'h00, 8'h08, 8'hC0}, {8'h01, 8'h04}, 2 * 8);
+    send_usb_ctrl_in(0, {8'h00, 8'h02, 8'h00, 8'h00, 8'h00, 8'h00, 8'h08, 8'hC0}, {8'h01, 8'h00}, 2 * 8);
+
+    // PC resends from page 1
+    send_usb_ctrl_out(0, {8'h00, 8'h01, 8'h41, 8'h00, 8'h12, 8'h35, 8'h08, 8'h40}, {8'h77}, 8);
+    #10000000;
+    `assert("all page program bytes sent to SPI", spi_mosi_length, 0);
+    `assert("chip select released after page 1", spi_cs, 1'b1);
+    send_usb_ctrl_in(0, {8'h00, 8'h02, 8'h00, 8'h00, 8'h00, 8'h00, 8'h08, 8'hC0}, {8'h02, 8'h00}, 2 * 8);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
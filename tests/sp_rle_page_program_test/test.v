@@ -0,0 +1,32 @@
+`include "top_tb_header.vh"
+  integer k;
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+  reg [511:0] out_data;
+
+  initial begin
+    // RLE coded page program at 0x123456, 15 bytes expand to 260:
+    // literal 02 12 34 56, 100 x FF, literal 11 22 33, 128 x 00, 25 x AA
+    out_data = {8'hAA, 8'h98, 8'h00, 8'hFF, 8'h33, 8'h22, 8'h11, 8'h02,
+                8'hFF, 8'hE3, 8'h56, 8'h34, 8'h12, 8'h02, 8'h03};
+    mosi = {8'h02, 8'h12, 8'h34, 8'h56};
+    for (k = 0; k < 100; k = k + 1)
+      mosi = {mosi, 8'hFF};
+    mosi = {mosi, 8'h11, 8'h22, 8'h33};
+    for (k = 0; k < 128; k = k + 1)
+      mosi = {mosi, 8'h00};
+    for (k = 0; k < 25; k = k + 1)
+      mosi = {mosi, 8'hAA};
+    miso = 0;
+    prepare_spi_xfer(mosi, miso, 260 * 8);
+
+    // bRequest 7, wValue 0, wIndex 260 decoded bytes, wLength 15
+    send_usb_ctrl_out(0, {8'h00, 8'h0F, 8'h01, 8'h04, 8'h00, 8'h00, 8'h07, 8'h40}, out_data, 15 * 8);
+    `assert("all decoded bytes sent to SPI", spi_mosi_length, 0);
+
+    #2000000;
+    `assert("chip select released", spi_cs, 1'b1);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
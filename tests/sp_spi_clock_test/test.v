@@ -0,0 +1,54 @@
+`include "top_tb_header.vh"
+  integer k;
+  reg [7:0] data_byte;
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+  reg [511:0] out_data;
+  reg [1023:0] in_data;
+
+  // shortest SCK period in 48 MHz cycles while chip select is low
+  integer sck_cycles = 0;
+  integer sck_period = 1000;
+  always @(posedge clk_48mhz) begin
+    sck_cycles = sck_cycles + 1;
+  end
+  always @(posedge spi_sck) begin
+    if (spi_cs == 1'b0 && sck_cycles < sck_period)
+      sck_period = sck_cycles;
+    sck_cycles = 0;
+  end
+
+  initial begin
+    // MISO valid 110 ns (5.3 cycles) after the falling edge: later than
+    // the rising edge 4 cycles after it and a sample 1 cycle later,
+    // earlier than the sample 2 cycles later
+    spi_miso_delay = 110000;
+
+    // SPI clock: bRequest 9, wValue divider 3, wIndex sample delay 2
+    send_usb_ctrl_xfer(0, {8'h00, 8'h00, 8'h00, 8'h02, 8'h00, 8'h03, 8'h09, 8'h40});
+
+    // fast read 0x0B at 6 MHz, MISO sampled 2 cycles after the rising edge
+    out_data = {8'h56, 8'h34, 8'h12, 8'h0B};
+    in_data = 0;
+    mosi = {8'h0B, 8'h12, 8'h34, 8'h56};
+    miso = 32'h00000000;
+    for (k = 4; k < 32; k = k + 1) begin
+      data_byte = k < 4 + 1 ? 8'h00 : k * 7 + 1;
+      in_data[k * 8 +: 8] = data_byte;
+      mosi = {mosi, 8'h00};
+      miso = {miso, data_byte};
+    end
+    prepare_spi_xfer(mosi, miso, 32 * 8);
+
+    // SPI OUT: bRequest 0, wIndex 0x0004: 4 header bytes, wLength 32
+    send_usb_ctrl_out(0, {8'h00, 8'h20, 8'h00, 8'h04, 8'h00, 8'h00, 8'h00, 8'h40}, out_data, 32 * 8);
+
+    #80000000;
+
+    `assert("chip select released", spi_cs, 1'b1);
+    `assert("SCK period is 8 cycles with divider 3", sck_period, 8);
+    send_usb_ctrl_in(0, {8'h00, 8'h20, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'hC0}, in_data, 32 * 8);
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
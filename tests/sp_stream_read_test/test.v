@@ -0,0 +1,61 @@
+`include "top_tb_header.vh"
+  integer k;
+  reg [7:0] data_byte;
+  reg [1024 * 8:0] mosi;
+  reg [1024 * 8:0] miso;
+  reg [1023:0] in_data [0:3];
+
+  initial begin
+    // stream read: gateware sends fast read 0x0B, address and a dummy byte
+    // and streams 128 bytes in one control IN transfer, 4 packets of 32
+    mosi = {8'h0B, 8'h12, 8'h34, 8'h56, 8'hFF};
+    miso = 40'h0000000000;
+    for (k = 0; k < 4; k = k + 1)
+      in_data[k] = 0;
+    for (k = 0; k < 128; k = k + 1) begin
+      data_byte = k * 3 + 1;
+      in_data[k / 32][(k % 32) * 8 +: 8] = data_byte;
+      mosi = {mosi, 8'hFF};
+      miso = {miso, data_byte};
+    end
+    prepare_spi_xfer(mosi, miso, (5 + 128) * 8);
+
+    // setup stage: bRequest 5, wValue 0x3456, wIndex 0x0B12, wLength 128
+    send_usb_setup(0, 0);
+    send_usb_data0({8'h00, 8'h80, 8'h0B, 8'h12, 8'h34, 8'h56, 8'h05, 8'hC0}, 64);
+    expect_usb_ack();
+
+    // SPI stops when the IN packet buffer holds 32 bytes
+    // and 63 bytes are waiting in the stream buffer
+    #40000000;
+    `assert("chip select held while stream buffer is full", spi_cs, 1'b0);
+
+    // data stage
+    send_usb_in(0, 0);
+    expect_usb_data1(in_data[0], 32 * 8);
+    send_usb_ack();
+
+    #40000000;
+    `assert("chip select held for the last byte", spi_cs, 1'b0);
+    send_usb_in(0, 0);
+    expect_usb_data0(in_data[1], 32 * 8);
+    send_usb_ack();
+
+    #40000000;
+    `assert("chip select released", spi_cs, 1'b1);
+    send_usb_in(0, 0);
+    expect_usb_data1(in_data[2], 32 * 8);
+    send_usb_ack();
+
+    send_usb_in(0, 0);
+    expect_usb_data0(in_data[3], 32 * 8);
+    send_usb_ack();
+
+    // status stage
+    send_usb_out(0, 0);
+    send_usb_data1(0, 0);
+    expect_usb_ack();
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
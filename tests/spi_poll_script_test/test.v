@@ -0,0 +1,29 @@
+`include "top_tb_header.vh"
+  initial begin
+    // script: write enable, then poll status until WIP clears.
+    // flash is busy for two status reads, only the last status is sent
+    prepare_spi_xfer(
+      /* MOSI */ {8'h06, 8'h05, 8'h00, 8'h05, 8'h00, 8'h05, 8'h00},
+      /* MISO */ {8'h00, 8'h00, 8'h03, 8'h00, 8'h01, 8'h00, 8'h02},
+      /* Length */ 56
+    );
+
+    send_usb_out(0, 1);
+    send_usb_data0({8'h01, 8'h05, 8'h02, 8'h06, 8'h00, 8'h00, 8'h00, 8'h01, 8'h01}, 9 * 8);
+    expect_usb_ack();
+
+    #10000000;
+
+    send_usb_in(0, 1);
+    expect_usb_data0({8'h02}, 8);
+    send_usb_ack();
+
+    #10000000;
+    `assert("chip select released", spi_cs, 1'b1);
+
+    send_usb_in(0, 1);
+    expect_usb_nak();
+
+    $finish(0);
+  end
+`include "top_tb_footer.vh"
@@ -1,7 +1,13 @@
 test: test.v ../../common/*.v ../*.vh
-	iverilog -I.. -s top_tb -o test -c ../file_list.txt 
+	iverilog $(IVERILOG_FLAGS) -I.. -s top_tb -o test -c ../file_list.txt 
 	./test
 
+# cycle counts of tests which call bench_report, one JSON line each
+bench: test.v ../../common/*.v ../*.vh
+	iverilog $(IVERILOG_FLAGS) -DBENCH -DBENCH_NAME=\"$(notdir $(CURDIR))\" -I.. -s top_tb -o bench -c ../file_list.txt
+	./bench | sed -n -e 's/^BENCH //p'
+
 clean:
 	-rm test
 	-rm test.vcd
+	-rm bench
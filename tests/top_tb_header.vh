@@ -19,10 +19,12 @@
         end
 
 module top_tb;
+`ifndef BENCH
     initial begin
       $dumpfile("test.vcd");
       $dumpvars(0, dut);
     end
+`endif
 
     reg clk_48mhz;
     reg reset = 0;
@@ -57,6 +59,39 @@ module top_tb;
     // boot interface
     wire boot;
 
+`ifdef TINYFPGASP
+    // tests which define TINYFPGASP run on the SPI passthru bootloader
+    wire [3:0] spi_dq;
+    wire [3:0] spi_dq_oe;
+
+    tinyfpgasp_bootloader #(
+      .SPI_DUAL(1),
+      .SPI_QUAD(1),
+      .SPI_BULK(1)
+    ) dut (
+      .clk_48mhz(clk_48mhz),
+      .reset(reset),
+
+      .usb_p_tx(usb_p_tx_raw),
+      .usb_n_tx(usb_n_tx_raw),
+
+      .usb_p_rx(usb_p_rx),
+      .usb_n_rx(usb_n_rx),
+
+      .usb_tx_en(usb_tx_en),
+
+      .led(led),
+
+      .spi_cs(spi_cs),
+      .spi_sck(spi_sck),
+      .spi_mosi(spi_mosi),
+      .spi_miso(spi_miso),
+      .spi_dq(spi_dq),
+      .spi_dq_oe(spi_dq_oe),
+
+      .boot(boot)
+    );
+`else
     tinyfpga_bootloader dut (
       .clk_48mhz(clk_48mhz),
       .reset(reset),
@@ -78,6 +113,7 @@ module top_tb;
 
       .boot(boot)
     );
+`endif
 
 
     
@@ -92,6 +128,8 @@ module top_tb;
     reg [1024 * 8:0] miso_data = 8097'h0;
     reg [31:0] spi_mosi_length = 32'h0;
     reg [31:0] spi_miso_length = 32'h0;
+    reg [31:0] spi_header_clocks = 32'h0; // single bit clocks before wide output
+    reg [2:0] spi_miso_width = 1; // bits per clock driven by flash after header
 
     task prepare_spi_xfer;
       input [1024 * 8:0] new_mosi_data;
@@ -102,17 +140,68 @@ module top_tb;
       miso_data = new_miso_data;
       spi_mosi_length <= new_length - 1; 
       spi_miso_length <= new_length; 
+      spi_header_clocks <= 0;
+      spi_miso_width <= 1;
+    end
+    endtask
+
+    // dual/quad output read: after header clocks the flash drives
+    // width bits per clock, highest bit on IO1 (dual) or IO3 (quad).
+    // MOSI is checked only during header clocks.
+    task prepare_spi_wide_xfer;
+      input [1024 * 8:0] new_mosi_data;
+      input [1024 * 8:0] new_miso_data;
+      input [31:0] new_length;
+      input [31:0] new_header_clocks;
+      input [2:0] new_width;
+    begin
+      mosi_data = new_mosi_data;
+      miso_data = new_miso_data;
+      spi_mosi_length <= new_header_clocks - 1; 
+      spi_miso_length <= new_length; 
+      spi_header_clocks <= new_header_clocks;
+      spi_miso_width <= new_width;
     end
     endtask
+
+    wire spi_wide_out = spi_cs == 1'b0 && spi_header_clocks == 0 && spi_miso_width > 1;
     
-    assign spi_miso = (spi_miso_length == 32'hffffffff) ? 1'b1 : miso_data[spi_miso_length];
+    assign spi_miso = (spi_miso_length == 32'hffffffff) ? 1'b1 : miso_data[spi_miso_length + spi_wide_out];
+
+    // flash output changes spi_miso_delay (ps) after the falling edge,
+    // less than half an SCK period
+    integer spi_miso_delay = 0;
 
     always @(negedge spi_sck) begin
+      if (spi_miso_delay != 0)
+        #(spi_miso_delay);
       if (spi_cs == 1'b0 && spi_miso_length > 0) begin
-        spi_miso_length <= spi_miso_length - 1;
+        if (spi_header_clocks != 0) begin
+          spi_miso_length <= spi_miso_length - 1;
+          spi_header_clocks <= spi_header_clocks - 1;
+        end else begin
+          spi_miso_length <= spi_miso_length - spi_miso_width;
+        end
       end
     end
 
+`ifdef TINYFPGASP
+    // IO0 is MOSI unless the flash drives it, IO2 and IO3 float high
+    assign spi_dq[0] = spi_dq_oe[0] ? spi_mosi : (spi_wide_out ? miso_data[spi_miso_length] : 1'bz);
+    assign spi_dq[1] = spi_miso;
+    assign spi_dq[2] = spi_dq_oe[2] ? 1'b1 : (spi_wide_out && spi_miso_width == 4 ? miso_data[spi_miso_length + 2] : 1'b1);
+    assign spi_dq[3] = spi_dq_oe[3] ? 1'b1 : (spi_wide_out && spi_miso_width == 4 ? miso_data[spi_miso_length + 3] : 1'b1);
+
+    always @(posedge spi_sck) begin
+      if (spi_wide_out) begin
+        `assert_true("IO0 must be released in wide mode", !spi_dq_oe[0]);
+      end
+      if (spi_wide_out && spi_miso_width == 4) begin
+        `assert_true("IO2 and IO3 must be released in quad mode", spi_dq_oe[3:2] == 2'b00);
+      end
+    end
+`endif
+
     always @(posedge spi_sck) begin
       if (spi_cs == 1'b0 && spi_mosi_length > 0) begin
         `assert("SPI MOSI data", spi_mosi, mosi_data[spi_mosi_length]);
@@ -121,6 +210,55 @@ module top_tb;
     end
     
 
+    ///////////////////////////////////////////////////////////////////////////
+    ///////////////////////////////////////////////////////////////////////////
+    ////
+    //// Benchmark Counters
+    ////
+    ///////////////////////////////////////////////////////////////////////////
+    ///////////////////////////////////////////////////////////////////////////
+    // from bench_start count 48 MHz cycles, SPI clocks, cycles without
+    // SPI clock edge and NAKs received by the host. Compiled with -DBENCH
+    // ("make bench"), bench_report prints them as one JSON line.
+`ifndef BENCH_NAME
+ `define BENCH_NAME "test"
+`endif
+    integer bench_cycles = 0;
+    integer bench_spi_clocks = 0; // SCK rising edges with chip select low
+    integer bench_spi_idle = 0; // cycles without SCK edge
+    integer bench_naks = 0;
+    reg bench_sck = 1'b1;
+
+    always @(posedge clk_48mhz) begin
+      bench_cycles = bench_cycles + 1;
+      if (spi_sck == bench_sck) begin
+        bench_spi_idle = bench_spi_idle + 1;
+      end else if (spi_sck && !spi_cs) begin
+        bench_spi_clocks = bench_spi_clocks + 1;
+      end
+      bench_sck = spi_sck;
+    end
+
+    task bench_start;
+    begin
+      bench_cycles = 0;
+      bench_spi_clocks = 0;
+      bench_spi_idle = 0;
+      bench_naks = 0;
+    end
+    endtask
+
+    task bench_report;
+      input [31:0] bytes; // payload bytes transferred since bench_start
+    begin
+`ifdef BENCH
+      $display("BENCH {\"test\": \"%0s\", \"bytes\": %0d, \"cycles\": %0d, \"cycles_per_byte\": %0.2f, \"spi_clocks\": %0d, \"spi_idle_cycles\": %0d, \"naks\": %0d}",
+        `BENCH_NAME, bytes, bench_cycles, 1.0 * bench_cycles / bytes, bench_spi_clocks, bench_spi_idle, bench_naks);
+`endif
+    end
+    endtask
+
+
     ///////////////////////////////////////////////////////////////////////////
     ///////////////////////////////////////////////////////////////////////////
     ////
@@ -236,7 +374,8 @@ module top_tb;
       send_usb_se0();
       send_usb_se0();
       send_usb_j();
-      wait_usb_interpacket_delay();
+      // the device may answer 2 bit times after eop, listen before that
+      #83328;
     end
     endtask
 
@@ -489,6 +628,10 @@ module top_tb;
       // shift the data down to the bottom so the first bit is data[0]
       data = data >> (1024 - length);
 
+      if (length == 8 && data[3:0] == 4'b1010) begin
+        bench_naks = bench_naks + 1;
+      end
+
       wait_usb_interpacket_delay();
     end
     endtask
@@ -524,7 +667,8 @@ module top_tb;
     end
     endtask
 
-    task expect_usb_data;
+    // check the data packet already received in usb_tx_data
+    task check_usb_data;
       input [3:0] pid;
       input [1023:0] data;
       input [10:0] length;
@@ -558,8 +702,6 @@ module top_tb;
         raw_usb_data[i] = 1'b0;
       end
 
-      get_usb_raw(usb_tx_data, usb_tx_len);
-
       //`assert_true("data packets are less than 536 bits long", usb_tx_len < 536);
       //`assert_true("data packets are at least 24 bits long", usb_tx_len >= 24);
       `assert("data length", usb_tx_len, length + 24);
@@ -569,6 +711,50 @@ module top_tb;
       `assert("data pid mismatch", usb_tx_data[3:0], pid);
     end
     endtask
+
+    task expect_usb_data;
+      input [3:0] pid;
+      input [1023:0] data;
+      input [10:0] length;
+    begin
+      get_usb_raw(usb_tx_data, usb_tx_len);
+      check_usb_data(pid, data, length);
+    end
+    endtask
+
+    // IN token repeated while the device NAKs, the packet is in usb_tx_data
+    task get_usb_in;
+      input [7:0] addr;
+      input [3:0] endp;
+    begin
+      usb_tx_len = 8;
+      usb_tx_data[3:0] = 4'b1010;
+      while (usb_tx_len == 8 && usb_tx_data[3:0] == 4'b1010) begin
+        send_usb_in(addr, endp);
+        get_usb_raw(usb_tx_data, usb_tx_len);
+      end
+    end
+    endtask
+
+    // OUT data packet repeated while the device NAKs
+    task send_usb_out_data;
+      input [7:0] addr;
+      input [3:0] endp;
+      input [3:0] pid;
+      input [511:0] data;
+      input [10:0] length;
+    begin
+      usb_tx_len = 8;
+      usb_tx_data[3:0] = 4'b1010;
+      while (usb_tx_len == 8 && usb_tx_data[3:0] == 4'b1010) begin
+        send_usb_out(addr, endp);
+        send_usb_data(pid, data, length);
+        get_usb_raw(usb_tx_data, usb_tx_len);
+      end
+      `assert("OUT handshake length", usb_tx_len, 8);
+      `assert("OUT handshake pid mismatch", usb_tx_data[3:0], 4'b0010);
+    end
+    endtask
       
     task expect_usb_data1;
       input [1023:0] data;
@@ -603,6 +789,78 @@ module top_tb;
     endtask
 
 
+    task send_usb_ctrl_out;
+      input [7:0] addr;
+      input [63:0] setup_data;
+      input [511:0] data;
+      input [10:0] length;
+    begin
+      // setup stage
+      send_usb_setup(addr, 0); 
+      send_usb_data0(setup_data, 64);
+      expect_usb_ack();
+
+      // data stage
+      send_usb_out(addr, 0);
+      send_usb_data1(data, length);
+      expect_usb_ack();
+
+      // status stage
+      expect_usb_status_in(addr);
+    end
+    endtask
+
+    // status stage of OUT transfer is NAKed until SPI has sent all the data
+    task expect_usb_status_in;
+      input [7:0] addr;
+    begin
+      get_usb_in(addr, 0);
+      `assert("status stage data length", usb_tx_len, 24);
+      `assert("status stage data pid mismatch", usb_tx_data[3:0], 4'b1011);
+      send_usb_ack();
+    end
+    endtask
+
+    task send_usb_ctrl_in;
+      input [7:0] addr;
+      input [63:0] setup_data;
+      input [1023:0] data;
+      input [10:0] length;
+    begin
+      // setup stage
+      send_usb_setup(addr, 0); 
+      send_usb_data0(setup_data, 64);
+      expect_usb_ack();
+
+      // data stage
+      send_usb_in(addr, 0);
+      expect_usb_data1(data, length);
+      send_usb_ack();
+
+      // status stage
+      send_usb_out(addr, 0);
+      send_usb_data1(0, 0);
+      expect_usb_ack();
+    end
+    endtask
+
+    // reference model of zlib CRC32, one byte
+    function [31:0] crc32_ref;
+      input [31:0] crc;
+      input [7:0] data;
+      integer n;
+    begin
+      crc32_ref = crc;
+      for (n = 0; n < 8; n = n + 1) begin
+        if (crc32_ref[0] ^ data[n]) begin
+          crc32_ref = (crc32_ref >> 1) ^ 32'hEDB88320;
+        end else begin
+          crc32_ref = crc32_ref >> 1;
+        end
+      end
+    end
+    endfunction
+
     task send_usb_address_device;
       input [7:0] old_addr;
       input [7:0] new_addr;
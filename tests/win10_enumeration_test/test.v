@@ -14,8 +14,8 @@
     // data stage
     send_usb_in(0, 0);
     expect_usb_data1(
-      {8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h21, 8'h00, 8'h12, 
-       8'h09, 8'h20, 8'h00, 8'h00, 8'h02, 8'h02, 8'h00, 8'h01, 8'h12}, 18 * 8);
+      {8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h61, 8'h30, 8'h1d, 
+       8'h50, 8'h20, 8'h00, 8'h00, 8'h02, 8'h02, 8'h00, 8'h01, 8'h12}, 18 * 8);
     send_usb_ack();
 
     // status stage
@@ -45,8 +45,8 @@
     // data stage
     send_usb_in(30, 0);
     expect_usb_data1(
-      {8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h21, 8'h00, 8'h12, 
-       8'h09, 8'h20, 8'h00, 8'h00, 8'h02, 8'h02, 8'h00, 8'h01, 8'h12}, 18 * 8);
+      {8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h61, 8'h30, 8'h1d, 
+       8'h50, 8'h20, 8'h00, 8'h00, 8'h02, 8'h02, 8'h00, 8'h01, 8'h12}, 18 * 8);
     send_usb_ack();
 
     // status stage
@@ -117,8 +117,8 @@
     // data stage
     send_usb_in(30, 0);
     expect_usb_data1(
-      {8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h21, 8'h00, 8'h12, 
-       8'h09, 8'h20, 8'h00, 8'h00, 8'h02, 8'h02, 8'h00, 8'h01, 8'h12}, 18 * 8);
+      {8'h01, 8'h00, 8'h00, 8'h00, 8'h00, 8'h00, 8'h61, 8'h30, 8'h1d, 
+       8'h50, 8'h20, 8'h00, 8'h00, 8'h02, 8'h02, 8'h00, 8'h01, 8'h12}, 18 * 8);
     send_usb_ack();
 
     // status stage